@@ -0,0 +1,453 @@
+#include "common.h"
+#include <sys/timerfd.h>
+
+/*================== layers & animation ===============*/
+/*层是按先后叠放在背景(图片或纯色)上的图片. 层的位置、不透明度、裁剪或图片改变时,
+ *把旧的和新的屏幕矩形登记为脏区; 下一帧只重画脏区: 先画背景, 再按顺序画和它相交的层,
+ *画完所有脏区后用fb_update_rect一次送屏. 动画由timerfd每ANIM_PERIOD_MS触发一次, 进度按task_get_time()计算,
+ *某一帧慢了只会跳过中间状态, 不会拖长动画*/
+
+#define ANIM_PERIOD_MS	16
+#define DAMAGE_MAX	8	/*再多就合并到面积增加最少的矩形里*/
+
+typedef struct {
+	int x1, y1, x2, y2;
+} rect;
+
+struct fb_layer {
+	fb_layer *next;	/*上面一层*/
+	fb_image *image;
+	fb_layer_state st;
+	rect drawn;	/*当前状态在屏幕上占的矩形*/
+
+	/*动画*/
+	int animating;
+	int finished;	/*动画结束了, 还没调用done*/
+	fb_layer_state from, to;
+	fb_image *fade_to;	/*交叉淡化的目标图片*/
+	int fade_t;	/*0..255*/
+	myTime start;
+	int duration, ease;
+	Layer_Func done;
+	void *arg;
+};
+
+static fb_layer *layers;	/*最下面一层*/
+static fb_image *bg_image;
+static int bg_color;
+static rect damage[DAMAGE_MAX];
+static int damage_num;
+static int timer_fd = -1;
+static int timer_on;
+static fb_image *fade_buf;	/*半透明层交叉淡化的中间图片*/
+
+/*------------------ rects ------------------*/
+static int _rect_empty(const rect *r)
+{
+	return (r->x1 >= r->x2)||(r->y1 >= r->y2);
+}
+
+static int _rect_area(const rect *r)
+{
+	return (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static rect _rect_union(const rect *a, const rect *b)
+{
+	rect r;
+	r.x1 = (a->x1 < b->x1) ? a->x1 : b->x1;
+	r.y1 = (a->y1 < b->y1) ? a->y1 : b->y1;
+	r.x2 = (a->x2 > b->x2) ? a->x2 : b->x2;
+	r.y2 = (a->y2 > b->y2) ? a->y2 : b->y2;
+	return r;
+}
+
+static rect _rect_intersect(const rect *a, const rect *b)
+{
+	rect r;
+	r.x1 = (a->x1 > b->x1) ? a->x1 : b->x1;
+	r.y1 = (a->y1 > b->y1) ? a->y1 : b->y1;
+	r.x2 = (a->x2 < b->x2) ? a->x2 : b->x2;
+	r.y2 = (a->y2 < b->y2) ? a->y2 : b->y2;
+	return r;
+}
+
+/*层当前状态在屏幕上可见的矩形, 看不见时为空*/
+static rect _layer_rect(fb_layer *l)
+{
+	static const rect screen = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+	fb_layer_state *s = &l->st;
+	rect r = {0, 0, 0, 0}, img;
+
+	if((l->image == NULL)||(s->alpha <= 0)) return r;
+	img.x1 = s->x;
+	img.y1 = s->y;
+	img.x2 = s->x + l->image->pixel_w;
+	img.y2 = s->y + l->image->pixel_h;
+	r.x1 = s->x + s->clip_x;
+	r.y1 = s->y + s->clip_y;
+	r.x2 = r.x1 + s->clip_w;
+	r.y2 = r.y1 + s->clip_h;
+	r = _rect_intersect(&r, &img);
+	r = _rect_intersect(&r, &screen);
+	return r;
+}
+
+/*------------------ timer ------------------*/
+static void _anim_cb(int fd);
+
+static void _timer_start(void)
+{
+	struct itimerspec its;
+
+	if(timer_on) return;
+	if(timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if(timer_fd < 0) {
+			printf("fb_layer: timerfd error %d\n", errno);
+			return;
+		}
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_nsec = ANIM_PERIOD_MS * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(timer_fd, 0, &its, NULL);
+	if(task_add_file(timer_fd, _anim_cb) < 0) { /*下次有动画时再试*/
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(timer_fd, 0, &its, NULL);
+		return;
+	}
+	timer_on = 1;
+}
+
+static void _timer_stop(void)
+{
+	struct itimerspec its;
+
+	if(!timer_on) return;
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(timer_fd, 0, &its, NULL);
+	task_delete_file(timer_fd);
+	timer_on = 0;
+}
+
+/*登记脏区, 下一帧重画*/
+static void _damage(const rect *r)
+{
+	int i, best = 0, best_grow = 0;
+
+	if(_rect_empty(r)) return;
+	for(i=0; i<damage_num; ++i)
+	{
+		rect u = _rect_union(&damage[i], r);
+		int grow = _rect_area(&u) - _rect_area(&damage[i]);
+		if(grow == 0) return; /*已经包含*/
+		/*重叠得多时合并, 少画重叠的部分*/
+		if(_rect_area(&u) <= _rect_area(&damage[i]) + _rect_area(r)) {
+			damage[i] = u;
+			_timer_start();
+			return;
+		}
+		if((i == 0)||(grow < best_grow)) { best = i; best_grow = grow; }
+	}
+	if(damage_num < DAMAGE_MAX) damage[damage_num++] = *r;
+	else damage[best] = _rect_union(&damage[best], r);
+	_timer_start();
+}
+
+/*------------------ redraw ------------------*/
+/*放在屏幕(sx,sy)的图片落在c里面的部分, c已经在图片范围内; 只是一个栈上的视图, 不分配内存*/
+static void _view(fb_image *v, fb_image *img, int sx, int sy, const rect *c)
+{
+	int bpp = ((img->color_type == FB_COLOR_ALPHA_8)||(img->color_type == FB_COLOR_INDEX_8)) ? 1 : 4;
+	*v = *img;
+	v->pixel_w = c->x2 - c->x1;
+	v->pixel_h = c->y2 - c->y1;
+	v->content = img->content + (c->y1 - sy) * img->line_byte + (c->x1 - sx) * bpp;
+}
+
+static void _draw_background(const rect *r)
+{
+	rect img, c;
+	fb_image v;
+
+	if(bg_image != NULL) {
+		img.x1 = 0; img.y1 = 0;
+		img.x2 = bg_image->pixel_w; img.y2 = bg_image->pixel_h;
+		c = _rect_intersect(r, &img);
+		if((c.x1 != r->x1)||(c.y1 != r->y1)||(c.x2 != r->x2)||(c.y2 != r->y2))
+			fb_draw_rect(r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1, bg_color);
+		if(!_rect_empty(&c)) {
+			_view(&v, bg_image, 0, 0, &c);
+			fb_draw_image(c.x1, c.y1, &v, 0);
+		}
+		return;
+	}
+	fb_draw_rect(r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1, bg_color);
+}
+
+static void _draw_layer(fb_layer *l, const rect *c)
+{
+	fb_image va, vb, v;
+	int alpha = l->st.alpha;
+	int w, h;
+
+	_view(&va, l->image, l->st.x, l->st.y, c);
+	if(l->fade_to == NULL) {
+		if(alpha >= 255) fb_draw_image(c->x1, c->y1, &va, 0);
+		else fb_draw_image_ex(c->x1, c->y1, &va, 0, alpha, 0, 0);
+		return;
+	}
+	_view(&vb, l->fade_to, l->st.x, l->st.y, c);
+	if(alpha >= 255) {
+		fb_draw_crossfade(c->x1, c->y1, &va, &vb, l->fade_t);
+		return;
+	}
+	/*先把a和b混合好, 再整体按alpha画一次*/
+	w = c->x2 - c->x1;
+	h = c->y2 - c->y1;
+	if((va.color_type != vb.color_type)||(va.color_type == FB_COLOR_ALPHA_8)||(va.color_type == FB_COLOR_INDEX_8)) {
+		/*格式不同或者是1字节的图片, 只能分两遍画*/
+		fb_draw_image_ex(c->x1, c->y1, &va, 0, alpha * (255 - l->fade_t) / 255, 0, 0);
+		fb_draw_image_ex(c->x1, c->y1, &vb, 0, alpha * l->fade_t / 255, 0, 0);
+		return;
+	}
+	if((fade_buf == NULL)||(fade_buf->color_type != va.color_type)||
+		(fade_buf->pixel_w < w)||(fade_buf->pixel_h < h)) {
+		if(fade_buf != NULL) {
+			if(fade_buf->pixel_w > w) w = fade_buf->pixel_w;
+			if(fade_buf->pixel_h > h) h = fade_buf->pixel_h;
+		}
+		fb_free_image(fade_buf);
+		fade_buf = fb_new_image(va.color_type, w, h, 0);
+	}
+	if(fade_buf == NULL) return;
+	v = *fade_buf;
+	v.pixel_w = c->x2 - c->x1;
+	v.pixel_h = c->y2 - c->y1;
+	fb_crossfade_image(&v, &va, &vb, l->fade_t);
+	fb_draw_image_ex(c->x1, c->y1, &v, 0, alpha, 0, 0);
+}
+
+static void _redraw(void)
+{
+	fb_rect rs[DAMAGE_MAX];
+	int i;
+	fb_layer *l;
+
+	if(damage_num == 0) return;
+	for(i=0; i<damage_num; ++i)
+	{
+		_draw_background(&damage[i]);
+		for(l = layers; l != NULL; l = l->next)
+		{
+			rect c = _rect_intersect(&l->drawn, &damage[i]);
+			if(!_rect_empty(&c)) _draw_layer(l, &c);
+		}
+		rs[i].x = damage[i].x1;
+		rs[i].y = damage[i].y1;
+		rs[i].w = damage[i].x2 - damage[i].x1;
+		rs[i].h = damage[i].y2 - damage[i].y1;
+	}
+	/*一帧只送屏一次, 每个脏区单独复制, 离得远的两个小区域不会变成一个大矩形*/
+	fb_update_rect(rs, damage_num);
+	damage_num = 0;
+}
+
+/*------------------ animation ------------------*/
+static float _ease(int ease, float t)
+{
+	switch(ease) {
+	case FB_EASE_IN:
+		return t * t;
+	case FB_EASE_OUT:
+		return 1 - (1 - t) * (1 - t);
+	case FB_EASE_IN_OUT:
+		return (t < 0.5f) ? 2 * t * t : 1 - 2 * (1 - t) * (1 - t);
+	default:
+		return t;
+	}
+}
+
+static int _lerp(int a, int b, float e)
+{
+	float v = a + (b - a) * e;
+	return (int)((v >= 0) ? v + 0.5f : v - 0.5f);
+}
+
+/*改变层的状态, 旧的和新的矩形都要重画*/
+static void _layer_change(fb_layer *l, const fb_layer_state *st)
+{
+	_damage(&l->drawn);
+	l->st = *st;
+	l->drawn = _layer_rect(l);
+	_damage(&l->drawn);
+}
+
+static void _anim_cb(int fd)
+{
+	uint64_t n;
+	myTime now;
+	fb_layer *l;
+	int active = 0;
+
+	if(read(fd, &n, sizeof(n)) < 0) return;
+	now = task_get_time();
+	for(l = layers; l != NULL; l = l->next)
+	{
+		fb_layer_state st;
+		float t, e;
+
+		if(!l->animating) continue;
+		t = (l->duration > 0) ? (float)MYTIME_DIFF(now, l->start) / l->duration : 1;
+		if(t >= 1) {
+			t = 1;
+			l->animating = 0;
+			l->finished = 1;
+		}
+		else {
+			if(t < 0) t = 0;
+			active = 1;
+		}
+		e = _ease(l->ease, t);
+		st.x = _lerp(l->from.x, l->to.x, e);
+		st.y = _lerp(l->from.y, l->to.y, e);
+		st.alpha = _lerp(l->from.alpha, l->to.alpha, e);
+		st.clip_x = _lerp(l->from.clip_x, l->to.clip_x, e);
+		st.clip_y = _lerp(l->from.clip_y, l->to.clip_y, e);
+		st.clip_w = _lerp(l->from.clip_w, l->to.clip_w, e);
+		st.clip_h = _lerp(l->from.clip_h, l->to.clip_h, e);
+		if(l->fade_to != NULL) {
+			l->fade_t = _lerp(0, 255, e);
+			if(l->finished) {
+				l->image = l->fade_to;
+				l->fade_to = NULL;
+			}
+			_layer_change(l, &st); /*图片内容变了, 位置不变也要重画*/
+		}
+		else if(memcmp(&st, &l->st, sizeof(st)) != 0) {
+			_layer_change(l, &st);
+		}
+	}
+
+	_redraw();
+	if(!active) _timer_stop();
+
+	/*done可能释放层或者开始新的动画, 每次从头找*/
+	for(;;)
+	{
+		for(l = layers; l != NULL; l = l->next)
+			if(l->finished) break;
+		if(l == NULL) break;
+		l->finished = 0;
+		if(l->done) l->done(l, l->arg);
+	}
+}
+
+/*停止正在进行的动画, 交叉淡化直接跳到结束*/
+static void _layer_stop(fb_layer *l)
+{
+	l->animating = 0;
+	l->finished = 0;
+	if(l->fade_to != NULL) {
+		l->image = l->fade_to;
+		l->fade_to = NULL;
+		_layer_change(l, &l->st);
+	}
+}
+
+/*------------------ public ------------------*/
+void fb_layer_set_background(fb_image *image, int color)
+{
+	static const rect screen = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+	bg_image = image;
+	bg_color = color;
+	_damage(&screen);
+}
+
+fb_layer * fb_layer_new(fb_image *image, int x, int y)
+{
+	fb_layer *l, **pp;
+
+	if(image == NULL) return NULL;
+	l = calloc(1, sizeof(fb_layer));
+	if(l == NULL) return NULL;
+	l->image = image;
+	l->st.x = x;
+	l->st.y = y;
+	l->st.alpha = 255;
+	l->st.clip_w = image->pixel_w;
+	l->st.clip_h = image->pixel_h;
+	for(pp = &layers; *pp != NULL; pp = &(*pp)->next);
+	*pp = l;
+	l->drawn = _layer_rect(l);
+	_damage(&l->drawn);
+	return l;
+}
+
+void fb_layer_free(fb_layer *layer)
+{
+	fb_layer **pp;
+
+	if(layer == NULL) return;
+	for(pp = &layers; *pp != NULL; pp = &(*pp)->next)
+	{
+		if(*pp == layer) {
+			*pp = layer->next;
+			break;
+		}
+	}
+	_damage(&layer->drawn);
+	free(layer);
+}
+
+void fb_layer_get_state(fb_layer *layer, fb_layer_state *st)
+{
+	if((layer == NULL)||(st == NULL)) return;
+	*st = layer->st;
+}
+
+void fb_layer_set_state(fb_layer *layer, const fb_layer_state *st)
+{
+	if((layer == NULL)||(st == NULL)) return;
+	_layer_stop(layer);
+	_layer_change(layer, st);
+}
+
+void fb_layer_set_image(fb_layer *layer, fb_image *image)
+{
+	if((layer == NULL)||(image == NULL)) return;
+	_layer_stop(layer);
+	layer->image = image;
+	_layer_change(layer, &layer->st);
+}
+
+int fb_layer_animate(fb_layer *layer, const fb_layer_state *to, int duration, int ease, Layer_Func done, void *arg)
+{
+	if((layer == NULL)||(to == NULL)) return -1;
+	_layer_stop(layer);
+	layer->from = layer->st;
+	layer->to = *to;
+	layer->start = task_get_time();
+	layer->duration = duration;
+	layer->ease = ease;
+	layer->done = done;
+	layer->arg = arg;
+	layer->animating = 1;
+	_timer_start();
+	return 0;
+}
+
+int fb_layer_crossfade(fb_layer *layer, fb_image *image, int duration, int ease, Layer_Func done, void *arg)
+{
+	if((layer == NULL)||(image == NULL)) return -1;
+	if((image->pixel_w != layer->image->pixel_w)||(image->pixel_h != layer->image->pixel_h)) {
+		printf("fb_layer_crossfade: image size %dx%d != %dx%d\n", image->pixel_w, image->pixel_h,
+			layer->image->pixel_w, layer->image->pixel_h);
+		return -1;
+	}
+	fb_layer_animate(layer, &layer->st, duration, ease, done, arg);
+	layer->fade_to = image;
+	layer->fade_t = 0;
+	return 0;
+}
@@ -0,0 +1,436 @@
+#include "common.h"
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <linux/videodev2.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CAM_USE_NEON	1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CAM_USE_SSE2	1
+#endif
+
+/*================== camera preview ===============*/
+/*V4L2摄像头(或录下来的原始YUV文件)预览: 驱动的mmap缓冲区按行取样(最近邻缩放),
+ *再用SIMD转换成BGRX直接写进屏幕缓冲区, 中间没有fb_image.
+ *BT.601 limited range, 系数放大64倍用16位整数计算, SIMD和C的结果完全一样*/
+
+#define CAMERA_NUM_MAX	2
+#define CAMERA_BUF_NUM	4
+
+struct fb_camera {
+	int fd;	/*V4L2设备, 或者播放原始文件用的timerfd*/
+	int format, w, h, stride;
+	/*V4L2*/
+	struct {
+		void *start;
+		size_t len;
+	} bufs[CAMERA_BUF_NUM];
+	int buf_num;
+	int streaming;
+	/*原始文件*/
+	unsigned char *map;
+	size_t map_len;
+	int frame_bytes, frame_num, frame_idx;
+	/*预览*/
+	int x, y, dw, dh;
+	Camera_Func callback;
+	void *arg;
+	int frames;
+	myTime start_time;
+};
+
+static fb_camera *cameras[CAMERA_NUM_MAX];
+
+/*------------------ YUV -> BGRX ------------------*/
+#define YUV_Y	74	/*1.164*64*/
+#define YUV_RV	102	/*1.596*64*/
+#define YUV_GU	25	/*0.391*64*/
+#define YUV_GV	52	/*0.813*64*/
+#define YUV_BU	129	/*2.018*64*/
+
+static inline int _clamp255(int v)
+{
+	return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+/*Y/U/V都是每个像素一个值(已经取样好), 输出n个像素*/
+static void _yuv_row(const unsigned char *py, const unsigned char *pu, const unsigned char *pv, int *dst, int n)
+{
+	int i = 0;
+#if defined(CAM_USE_NEON)
+	uint8x8x4_t out;
+	out.val[3] = vdup_n_u8(0xFF);
+	for(; i+8 <= n; i += 8)
+	{
+		int16x8_t y = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(py + i))), vdupq_n_s16(16)), YUV_Y);
+		int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pu + i))), vdupq_n_s16(128));
+		int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pv + i))), vdupq_n_s16(128));
+		y = vqaddq_s16(y, vdupq_n_s16(32));
+		int16x8_t r = vqaddq_s16(y, vmulq_n_s16(v, YUV_RV));
+		int16x8_t g = vqsubq_s16(vqsubq_s16(y, vmulq_n_s16(u, YUV_GU)), vmulq_n_s16(v, YUV_GV));
+		int16x8_t b = vqaddq_s16(y, vmulq_n_s16(u, YUV_BU));
+		out.val[0] = vqshrun_n_s16(b, 6);
+		out.val[1] = vqshrun_n_s16(g, 6);
+		out.val[2] = vqshrun_n_s16(r, 6);
+		vst4_u8((uint8_t *)(dst + i), out);
+	}
+#elif defined(CAM_USE_SSE2)
+	__m128i z = _mm_setzero_si128(), ff = _mm_set1_epi8((char)0xFF);
+	__m128i c16 = _mm_set1_epi16(16), c128 = _mm_set1_epi16(128), c32 = _mm_set1_epi16(32);
+	__m128i ky = _mm_set1_epi16(YUV_Y), krv = _mm_set1_epi16(YUV_RV), kgu = _mm_set1_epi16(YUV_GU);
+	__m128i kgv = _mm_set1_epi16(YUV_GV), kbu = _mm_set1_epi16(YUV_BU);
+	for(; i+8 <= n; i += 8)
+	{
+		__m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(py + i)), z);
+		__m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pu + i)), z);
+		__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pv + i)), z);
+		y = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, c16), ky), c32);
+		u = _mm_sub_epi16(u, c128);
+		v = _mm_sub_epi16(v, c128);
+		__m128i r = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(v, krv)), 6);
+		__m128i g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(y, _mm_mullo_epi16(u, kgu)), _mm_mullo_epi16(v, kgv)), 6);
+		__m128i b = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(u, kbu)), 6);
+		__m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, z), _mm_packus_epi16(g, z));
+		__m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, z), ff);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(bg, ra));
+	}
+#endif
+	for(; i < n; ++i)
+	{
+		int y = (py[i] - 16)*YUV_Y + 32;
+		int u = pu[i] - 128, v = pv[i] - 128;
+		int r = _clamp255((y + v*YUV_RV) >> 6);
+		int g = _clamp255((y - u*YUV_GU - v*YUV_GV) >> 6);
+		int b = _clamp255((y + u*YUV_BU) >> 6);
+		dst[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+	}
+}
+
+void fb_draw_yuv(int x, int y, int w, int h, const unsigned char *frame, int format, int fw, int fh, int stride)
+{
+	unsigned char ybuf[SCREEN_WIDTH], ubuf[SCREEN_WIDTH], vbuf[SCREEN_WIDTH];
+#ifdef FB_RENDER_565
+	int rgb[SCREEN_WIDTH];
+#endif
+	int cx1, cy1, cx2, cy2, stepx, stepy, fx0, fx, fy, i, j, n;
+	const unsigned char *uv_plane;
+
+	if((frame == NULL)||(w <= 0)||(h <= 0)||(fw <= 0)||(fh <= 0)) return;
+	if((format != FB_CAMERA_YUYV)&&(format != FB_CAMERA_NV12)) return;
+	if(stride <= 0) stride = (format == FB_CAMERA_YUYV) ? fw*2 : fw;
+	uv_plane = frame + stride*fh;
+
+	cx1 = (x < 0) ? 0 : x;
+	cy1 = (y < 0) ? 0 : y;
+	cx2 = (x+w > SCREEN_WIDTH) ? SCREEN_WIDTH : x+w;
+	cy2 = (y+h > SCREEN_HEIGHT) ? SCREEN_HEIGHT : y+h;
+	if((cx1 >= cx2)||(cy1 >= cy2)) return;
+	n = cx2 - cx1;
+
+	fb_pixel *buf = fb_draw_buffer(cx1, cy1, n, cy2-cy1);
+	/*16.16定点, 取目标像素中心对应的源像素*/
+	stepx = ((long long)fw << 16) / w;
+	stepy = ((long long)fh << 16) / h;
+	fx0 = (cx1 - x)*stepx + stepx/2;
+	fy = (cy1 - y)*stepy + stepy/2;
+	for(j = cy1; j < cy2; ++j, fy += stepy)
+	{
+		int sy = fy >> 16;
+		const unsigned char *py;
+		if(format == FB_CAMERA_YUYV) {
+			const unsigned char *src = frame + sy*stride;
+			for(i = 0, fx = fx0; i < n; ++i, fx += stepx) {
+				int sx = fx >> 16;
+				const unsigned char *pair = src + (sx & ~1)*2; /*Y0 U Y1 V*/
+				ybuf[i] = src[sx*2];
+				ubuf[i] = pair[1];
+				vbuf[i] = pair[3];
+			}
+			py = ybuf;
+		} else {
+			const unsigned char *src = frame + sy*stride;
+			const unsigned char *uv = uv_plane + (sy >> 1)*stride;
+			for(i = 0, fx = fx0; i < n; ++i, fx += stepx) {
+				int sx = fx >> 16;
+				ybuf[i] = src[sx];
+				ubuf[i] = uv[sx & ~1];
+				vbuf[i] = uv[(sx & ~1) + 1];
+			}
+			py = ybuf;
+			if(fw == w) py = src + (cx1 - x); /*不缩放时Y直接用原来的行*/
+		}
+#ifdef FB_RENDER_565
+		_yuv_row(py, ubuf, vbuf, rgb, n);
+		for(i = 0; i < n; ++i) buf[j*SCREEN_WIDTH + cx1 + i] = FB_PIXEL(rgb[i]);
+#else
+		_yuv_row(py, ubuf, vbuf, buf + j*SCREEN_WIDTH + cx1, n);
+#endif
+	}
+}
+
+/*------------------ source ------------------*/
+static int _xioctl(int fd, unsigned long req, void *arg)
+{
+	int r;
+	do {
+		r = ioctl(fd, req, arg);
+	} while((r < 0)&&(errno == EINTR));
+	return r;
+}
+
+static int _v4l2_open(fb_camera *cam, char *dev, int fps)
+{
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers req;
+	struct v4l2_streamparm parm;
+	struct v4l2_buffer vb;
+	int i;
+
+	cam->fd = open(dev, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+	if(cam->fd < 0) {
+		printf("fb_camera_open: open %s error %d\n", dev, errno);
+		return -1;
+	}
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = cam->w;
+	fmt.fmt.pix.height = cam->h;
+	fmt.fmt.pix.pixelformat = (cam->format == FB_CAMERA_NV12) ? V4L2_PIX_FMT_NV12 : V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if(_xioctl(cam->fd, VIDIOC_S_FMT, &fmt) < 0) {
+		printf("fb_camera_open: VIDIOC_S_FMT error %d\n", errno);
+		return -1;
+	}
+	if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_NV12) cam->format = FB_CAMERA_NV12;
+	else if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) cam->format = FB_CAMERA_YUYV;
+	else {
+		printf("fb_camera_open: %s does not support YUYV/NV12\n", dev);
+		return -1;
+	}
+	/*驱动可能调整大小*/
+	cam->w = fmt.fmt.pix.width;
+	cam->h = fmt.fmt.pix.height;
+	cam->stride = fmt.fmt.pix.bytesperline;
+
+	if(fps > 0) {
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = fps;
+		_xioctl(cam->fd, VIDIOC_S_PARM, &parm); /*不支持时用默认帧率*/
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = CAMERA_BUF_NUM;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if((_xioctl(cam->fd, VIDIOC_REQBUFS, &req) < 0)||(req.count < 2)) {
+		printf("fb_camera_open: VIDIOC_REQBUFS error %d\n", errno);
+		return -1;
+	}
+	if(req.count > CAMERA_BUF_NUM) req.count = CAMERA_BUF_NUM;
+	for(i=0; i<req.count; ++i)
+	{
+		memset(&vb, 0, sizeof(vb));
+		vb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		vb.memory = V4L2_MEMORY_MMAP;
+		vb.index = i;
+		if(_xioctl(cam->fd, VIDIOC_QUERYBUF, &vb) < 0) return -1;
+		cam->bufs[i].len = vb.length;
+		cam->bufs[i].start = mmap(NULL, vb.length, PROT_READ|PROT_WRITE, MAP_SHARED, cam->fd, vb.m.offset);
+		if(cam->bufs[i].start == MAP_FAILED) {
+			cam->bufs[i].start = NULL;
+			printf("fb_camera_open: mmap error %d\n", errno);
+			return -1;
+		}
+		cam->buf_num++;
+		if(_xioctl(cam->fd, VIDIOC_QBUF, &vb) < 0) return -1;
+	}
+	return 0;
+}
+
+static int _raw_open(fb_camera *cam, char *file, int fps)
+{
+	struct itimerspec its;
+	struct stat st;
+	int fd;
+
+	cam->stride = (cam->format == FB_CAMERA_YUYV) ? cam->w*2 : cam->w;
+	cam->frame_bytes = (cam->format == FB_CAMERA_YUYV) ? cam->stride*cam->h : cam->stride*cam->h*3/2;
+	fd = open(file, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_camera_open: open %s error %d\n", file, errno);
+		return -1;
+	}
+	if((fstat(fd, &st) < 0)||(st.st_size < cam->frame_bytes)) {
+		printf("fb_camera_open: %s is smaller than one frame\n", file);
+		close(fd);
+		return -1;
+	}
+	cam->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(cam->map == MAP_FAILED) {
+		cam->map = NULL;
+		printf("fb_camera_open: mmap error %d\n", errno);
+		return -1;
+	}
+	cam->map_len = st.st_size;
+	cam->frame_num = st.st_size / cam->frame_bytes;
+
+	/*用定时器模拟摄像头的帧率*/
+	cam->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(cam->fd < 0) return -1;
+	if(fps <= 0) fps = 30;
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = 1 / fps; /*fps为1时tv_nsec不能等于1e9*/
+	its.it_interval.tv_nsec = (1000000000 / fps) % 1000000000;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(cam->fd, 0, &its, NULL) < 0) {
+		printf("fb_camera_open: timerfd_settime error %d\n", errno);
+		close(cam->fd);
+		cam->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*------------------ preview ------------------*/
+static void _show_frame(fb_camera *cam, const unsigned char *frame)
+{
+	fb_draw_yuv(cam->x, cam->y, cam->dw, cam->dh, frame, cam->format, cam->w, cam->h, cam->stride);
+	if(cam->callback) cam->callback(cam, cam->arg);
+	fb_update();
+	cam->frames++;
+}
+
+static void _camera_cb(int fd)
+{
+	struct v4l2_buffer vb, last;
+	fb_camera *cam = NULL;
+	uint64_t n;
+	int i, got = 0;
+
+	for(i=0; i<CAMERA_NUM_MAX; ++i)
+		if(cameras[i] && (cameras[i]->fd == fd)) cam = cameras[i];
+	if(cam == NULL) return;
+
+	if(cam->map) {
+		if(read(fd, &n, sizeof(n)) < 0) return;
+		_show_frame(cam, cam->map + (size_t)cam->frame_idx * cam->frame_bytes);
+		cam->frame_idx = (cam->frame_idx + 1) % cam->frame_num;
+		return;
+	}
+
+	/*取出所有已经好的缓冲区, 只显示最新的一个, 其他的马上还给驱动*/
+	for(;;) {
+		memset(&vb, 0, sizeof(vb));
+		vb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		vb.memory = V4L2_MEMORY_MMAP;
+		if(_xioctl(fd, VIDIOC_DQBUF, &vb) < 0) {
+			if(errno != EAGAIN) printf("camera VIDIOC_DQBUF error %d\n", errno);
+			break;
+		}
+		if(got) _xioctl(fd, VIDIOC_QBUF, &last);
+		last = vb;
+		got = 1;
+	}
+	if(got == 0) return;
+	if(last.index < cam->buf_num)
+		_show_frame(cam, cam->bufs[last.index].start);
+	_xioctl(fd, VIDIOC_QBUF, &last);
+}
+
+/*------------------ public ------------------*/
+fb_camera * fb_camera_open(char *dev, int format, int w, int h, int fps)
+{
+	fb_camera *cam;
+	struct stat st;
+	int slot, ret;
+
+	if((dev == NULL)||(w <= 0)||(h <= 0)) return NULL;
+	if((format != FB_CAMERA_YUYV)&&(format != FB_CAMERA_NV12)) return NULL;
+	for(slot=0; (slot<CAMERA_NUM_MAX)&&(cameras[slot] != NULL); ++slot);
+	if(slot == CAMERA_NUM_MAX) {
+		printf("fb_camera_open: too many cameras\n");
+		return NULL;
+	}
+	cam = (fb_camera *)calloc(1, sizeof(fb_camera));
+	if(cam == NULL) return NULL;
+	cam->fd = -1;
+	cam->format = format;
+	cam->w = w;
+	cam->h = h;
+
+	if((stat(dev, &st) == 0)&&S_ISCHR(st.st_mode)) ret = _v4l2_open(cam, dev, fps);
+	else ret = _raw_open(cam, dev, fps);
+	cameras[slot] = cam;
+	if(ret < 0) {
+		fb_camera_close(cam);
+		return NULL;
+	}
+	return cam;
+}
+
+int fb_camera_start(fb_camera *cam, int x, int y, int w, int h, Camera_Func callback, void *arg)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if((cam == NULL)||(w <= 0)||(h <= 0)) return -1;
+	cam->x = x;
+	cam->y = y;
+	cam->dw = w;
+	cam->dh = h;
+	cam->callback = callback;
+	cam->arg = arg;
+	if(cam->streaming) return 0; /*只改预览的位置*/
+	if((cam->map == NULL)&&(_xioctl(cam->fd, VIDIOC_STREAMON, &type) < 0)) {
+		printf("fb_camera_start: VIDIOC_STREAMON error %d\n", errno);
+		return -1;
+	}
+	if(task_add_file(cam->fd, _camera_cb) < 0) {
+		if(cam->map == NULL) _xioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+		return -1;
+	}
+	cam->streaming = 1;
+	cam->frames = 0;
+	cam->start_time = task_get_time();
+	return 0;
+}
+
+void fb_camera_get_size(fb_camera *cam, int *w, int *h)
+{
+	if(cam == NULL) return;
+	if(w) *w = cam->w;
+	if(h) *h = cam->h;
+}
+
+float fb_camera_get_fps(fb_camera *cam)
+{
+	int ms;
+
+	if((cam == NULL)||(cam->streaming == 0)) return 0;
+	ms = task_get_time() - cam->start_time;
+	return (ms > 0) ? cam->frames * 1000.0f / ms : 0;
+}
+
+void fb_camera_close(fb_camera *cam)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int i;
+
+	if(cam == NULL) return;
+	if(cam->streaming) {
+		task_delete_file(cam->fd);
+		if(cam->map == NULL) _xioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+	}
+	for(i=0; i<cam->buf_num; ++i) munmap(cam->bufs[i].start, cam->bufs[i].len);
+	if(cam->map) munmap(cam->map, cam->map_len);
+	if(cam->fd >= 0) close(cam->fd);
+	for(i=0; i<CAMERA_NUM_MAX; ++i)
+		if(cameras[i] == cam) cameras[i] = NULL;
+	free(cam);
+}
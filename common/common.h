@@ -23,17 +23,23 @@ void task_delay(myTime msecs);
 
 typedef void (*Task_Func)(int arg); /*用户的回调函数*/
 
-#define FILE_NUM_MAX    4	/*最多add的文件任务个数*/
+#define FILE_NUM_MAX    16	/*最多add的文件任务个数*/
 #define TIMER_NUM_MAX   4	/*最多add的定时器任务个数*/
+#define IDLE_NUM_MAX    4	/*最多add的空闲任务个数*/
 
-/*添加一个文件任务, 当fd可读时, 会自动调用callback函数*/
-void task_add_file(int fd, Task_Func callback);
+/*添加一个文件任务, 当fd可读时, 会自动调用callback函数; 成功返回0, 失败返回-1*/
+int task_add_file(int fd, Task_Func callback);
 
 /*增加一个定时器任务, 每隔period时间, 会自动调用callback函数*/
 void task_add_timer(myTime period, Task_Func callback);
 
+/*增加一个空闲任务, 每轮循环处理完文件和定时器后调用一次callback(0);
+ *有空闲任务时select不等待, 所以callback每次只应做一小段工作*/
+void task_add_idle(Task_Func callback);
+
 void task_delete_file(int fd); /*删除文件任务*/
 void task_delete_timer(int period); /*删除定时器任务*/
+void task_delete_idle(Task_Func callback); /*删除空闲任务*/
 void task_loop(void); /*进入任务循环, 该函数不返回*/
 
 /*非阻塞方式读/写文件, 返回实际读/写的字节数*/
@@ -46,39 +52,275 @@ int myWrite_nonblock(int fd, void *p, int n);
 #define FB_COLOR_RGB_8880	1
 #define FB_COLOR_RGBA_8888	2
 #define FB_COLOR_ALPHA_8	3
+#define FB_COLOR_RGBA_PREMUL	4 /*颜色已经乘过alpha的RGBA_8888*/
+#define FB_COLOR_INDEX_8	5 /*每个像素是调色板的下标*/
 
 typedef struct {
 	int color_type; /* FB_COLOR_XXXX */
 	int pixel_w, pixel_h;
 	int line_byte;
 	char *content; /*4 byte align*/
+	unsigned int *palette; /*FB_COLOR_INDEX_8: 256个颜色, 和RGBA_8888一样是B,G,R,A; 其他格式不用*/
 } fb_image;
 
 fb_image * fb_new_image(int color_type, int w, int h, int line_byte);
 void fb_free_image(fb_image *image);
 
+/*只用一帧的临时图片, 从帧内存池分配, 下一次fb_update()后自动回收, 不用free;
+ *只能在主线程使用*/
+fb_image * fb_new_frame_image(int color_type, int w, int h);
+void fb_image_frame_end(void); /*fb_update()调用*/
+
+typedef struct {
+	int live_bytes, live_count; /*还没释放的图片*/
+	int slab_bytes; /*小图片slab占用的内存*/
+	int mallocs; /*总共调用malloc的次数*/
+	int frame_allocs, frame_mallocs, frame_bytes; /*上一帧分配图片, 调用malloc的次数和帧内存池用量*/
+} fb_alloc_stat;
+void fb_get_alloc_stat(fb_alloc_stat *st);
+
 fb_image * fb_read_jpeg_image(char *file);
 fb_image * fb_read_png_image(char *file);
+/*flags: FB_PNG_RGB 丢掉alpha得到RGB_8880; FB_PNG_PREMUL 有透明度时得到RGBA_PREMUL;
+ *fb_read_png_image()总是得到RGBA_8888, 没有透明度的图片alpha为255*/
+#define FB_PNG_RGB	0x1
+#define FB_PNG_PREMUL	0x2
+#define FB_PNG_INDEX	0x4 /*调色板图片保留调色板, 得到INDEX_8(tRNS成为调色板的alpha), 其他图片不受影响*/
+fb_image * fb_read_png_image_ex(char *file, int flags);
+/*QOI格式的无损图片, 解码比PNG快; 3通道得到RGB_8880, 4通道得到RGBA_8888*/
+fb_image * fb_read_qoi_image(char *file);
+fb_image * fb_decode_qoi_image(const void *data, int len);
+int fb_write_qoi_image(fb_image *image, char *file); /*RGB_8880存3通道, RGBA存4通道*/
+
+/*把JPEG文件中(sx,sy,sw,sh)区域缩放解码到dst的(dx,dy,dw,dh)矩形中, sw或sh<=0表示整幅图;
+ *dst必须是FB_COLOR_RGB_8880, 矩形超出dst的部分不解码;
+ *利用DCT缩放和按iMCU裁剪, 只解码需要的部分, 成功返回0*/
+int fb_decode_jpeg_into(char *file, int sx, int sy, int sw, int sh,
+	fb_image *dst, int dx, int dy, int dw, int dh);
+/*解码内存中的JPEG, w/h>0时按DCT缩放得到不小于w*h的最小图片; 数据错误时返回NULL, 可以在任何线程调用*/
+fb_image * fb_decode_jpeg_image(const void *data, int len, int w, int h);
+
+/*本地图片文件(.fbi): 像素按fb_image的格式直接存放, 用mmap映射后不需要解码;
+ *多个进程映射同一个文件时共享物理页. 文件由tools/fbiconv生成;
+ *INDEX_8的调色板(1024字节)紧跟在64字节的文件头后面*/
+#define FB_NATIVE_MAGIC	0x31494246 /*"FBI1"*/
+#define FB_NATIVE_ALIGN	64 /*像素数据的偏移和每行字节数都按64字节对齐*/
+
+typedef struct {
+	unsigned int magic;
+	int color_type;
+	int pixel_w, pixel_h;
+	int line_byte;
+	unsigned int offset; /*像素数据在文件中的偏移*/
+	unsigned int reserved[2];
+} fb_native_header;
+
+/*映射一个.fbi文件, 返回图片的content指向映射的内存, 用fb_unmap_image或fb_free_image释放;
+ *映射是私有的, 写图片内容只会复制被写的页, 不会改文件*/
+fb_image * fb_map_image(char *path);
+void fb_unmap_image(fb_image *image);
+int fb_write_native_image(fb_image *image, char *path); /*把图片按原格式存成.fbi*/
+
+/*按文件头判断格式(JPEG, PNG, QOI, .fbi)读取图片*/
+fb_image * fb_read_image(char *file);
+
+/*图片缓存: 同一个文件(路径, 修改时间, 大小)按同样大小和flags解码时直接返回已有的图片;
+ *w/h>0时JPEG缩放解码到这个大小, flags(FB_PNG_xxx)交给PNG解码; 返回的是缓存图片的克隆(共享颜色内存),
+ *写之前调用fb_image_writable, 用完调用fb_cache_put_image(释放并立即按预算淘汰)或fb_free_image*/
+fb_image * fb_cache_get_image(char *path, int w, int h, int flags);
+void fb_cache_put_image(fb_image *image);
+void fb_cache_set_budget(int bytes); /*默认32MB, 被引用的图片不会被淘汰*/
+
+typedef struct {
+	int hits, misses, evictions;
+	int count, bytes;
+} fb_cache_stat_t;
+void fb_cache_get_stat(fb_cache_stat_t *st);
 
-/*得到一个图片的子图片,子图片和原图片共享颜色内存*/
+/*得到一个图片的子图片,子图片和原图片共享颜色内存;
+ *子图片会让原图片的颜色内存一直有效, 原图片可以先释放*/
 fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h);
 
+/*fb_image有引用计数: fb_retain_image加1, fb_free_image减1, 减到0才真正释放;
+ *只适用于fb_new_image/fb_read_xxx_image等返回的图片, 不能用于自己定义的fb_image*/
+fb_image * fb_retain_image(fb_image *image);
+int fb_image_refcount(fb_image *image);
+/*克隆一个图片: 新的头, 共享颜色内存, 不复制像素*/
+fb_image * fb_clone_image(fb_image *img);
+/*写图片之前调用: 如果颜色内存还被其他子图片/克隆共享, 先复制一份(写时复制);
+ *之后img->content和line_byte可能改变, 成功返回0; 头本身被retain了多次时返回-1*/
+int fb_image_writable(fb_image *img);
+
+/*图标图集: image_file是打包好的大图(任何fb_read_image支持的格式), index_file是索引;
+ *fb_atlas_get按名字返回子图片, 在fb_atlas_free之前有效, 要保留更久用fb_retain_image*/
+typedef struct fb_atlas fb_atlas;
+fb_atlas * fb_atlas_load(char *image_file, char *index_file);
+fb_image * fb_atlas_get(fb_atlas *atlas, const char *name);
+void fb_atlas_free(fb_atlas *atlas);
+
 typedef struct {
 	int bytes;	//UTF-8编码所占字节数
 	int advance_x; //x方向步进距离
 	int left;	//左跨距
 	int top;	//上跨距
+	int missing;	//所有字体中都没有这个字, 图片是.notdef
+	int font_gen;	//读这个字时字体栈的版本
 } fb_font_info;
 
 void font_init(char *font_file);
+/*添加备用字体, 主字体中没有的字会到备用字体中查找, 成功返回0*/
+int font_add_fallback(char *font_file);
+/*字体栈的版本, font_init/font_add_fallback加载字体后加1;
+ *缓存了"没有这个字"的地方用它判断要不要重新读*/
+int font_generation(void);
 fb_image * fb_read_font_image(const char *text, int pixel_size, fb_font_info *format);
+/*按unicode读取一个字的图片, format->bytes为0*/
+fb_image * fb_read_glyph_image(unsigned int ucs4, int pixel_size, fb_font_info *format);
+/*解析一个UTF-8字符, 返回其字节数, 编码错误返回0*/
+int fb_utf8_decode(const char *text, unsigned int *ucs4);
+int fb_font_line_height(int pixel_size); /*行距*/
+
+/*FreeType不能跨线程使用, 其他线程读字形要用自己的字体上下文;
+ *克隆出的上下文和主上下文共享mmap的字体文件, 只包含克隆时已加载的字体*/
+typedef struct font_ctx font_ctx;
+font_ctx *font_ctx_clone(void);
+void font_ctx_free(font_ctx *ctx);
+fb_image * fb_read_glyph_image_ctx(font_ctx *ctx, unsigned int ucs4, int pixel_size, fb_font_info *format);
+
+/*=========================== text.c ===============================*/
+typedef struct fb_glyph {
+	struct fb_glyph *next;
+	unsigned int ucs4;
+	int pixel_size;
+	int advance_x, left, top; /*同fb_font_info*/
+	int missing_gen; /*字体里没有这个字时是当时字体栈的版本, 否则-1*/
+	fb_image *image;
+} fb_glyph;
+
+/*从字形缓存中得到一个字, 返回的字形不要释放*/
+const fb_glyph *fb_get_glyph(unsigned int ucs4, int pixel_size);
+void fb_glyph_stat(int *num, int *bytes);
+
+/*把这些字交给后台线程提前放进字形缓存, 不阻塞调用者, 成功返回0*/
+int fb_prewarm_text(const char *text, int font_size);
+int fb_prewarm_codepoints(const unsigned int *ucs4, int num, int font_size);
+int fb_prewarm_pending(void); /*还没处理完的字数*/
+void fb_prewarm_cancel(void); /*丢弃还在排队的预热请求*/
+
+typedef struct {
+	int width;	//步进宽度之和
+	int ascent;	//基线以上的高度
+	int descent;	//基线以下的高度
+} fb_text_metrics;
+
+/*不绘制, 只测量一行文本, 返回宽度*/
+int fb_measure_text(const char *text, int font_size, fb_text_metrics *m);
+
+typedef struct {
+	const fb_glyph *glyph;
+	int x, y; /*字形图片左上角, 相对第一行基线的起点*/
+} fb_layout_item;
+
+typedef struct fb_text_layout {
+	struct fb_text_layout *next;
+	unsigned int hash;
+	char *text;
+	int font_size, max_width;
+	int font_gen; /*排版时字体栈的版本*/
+	int line_height, line_num;
+	int width;	/*最宽一行的步进宽度*/
+	int x1, y1, x2, y2; /*所有字形的包围盒, 相对第一行基线的起点*/
+	int item_num;
+	fb_layout_item *items;
+} fb_text_layout;
+
+/*排版并缓存: max_width>0时自动折行, '\n'强制换行;
+ *返回的布局由缓存管理, 不要释放, 在下次调用fb_layout_text之前一直有效*/
+const fb_text_layout *fb_layout_text(const char *text, int font_size, int max_width);
+
+typedef struct fb_text_run {
+	struct fb_text_run *prev, *next; /*LRU*/
+	struct fb_text_run *hnext; /*散列桶*/
+	unsigned int hash;
+	char *text;
+	int font_size;
+	int font_gen;
+	int x, y;	/*image左上角, 相对基线的起点*/
+	int width;	/*步进宽度*/
+	fb_image *image; /*FB_COLOR_ALPHA_8*/
+} fb_text_run;
+
+/*得到整串文本预先合成好的图片(和fb_draw_text一样排成一行), 由缓存管理, 不要释放;
+ *太大的文本不缓存, 返回NULL*/
+const fb_text_run *fb_get_text_run(const char *text, int font_size);
+void fb_text_run_stat(int *num, int *bytes);
+
+/*画一个整数, 每个数字从缓存的数字条中取, 拼好后画一次, 适合经常变化的计数器*/
+void fb_draw_number(int x, int y, int value, int font_size, int color);
+
+/*=========================== sdf.c ===============================*/
+/*用距离场图集绘制文本, 所有字号共用一份字形数据*/
+void fb_draw_sdf_text(int x, int y, char *text, int font_size, int color);
+void fb_sdf_stat(int *num, int *bytes);
+
+/*=========================== decoder.c ===============================*/
+/*增量解码: 数据可以分多次送入, 每次只解码若干行, 不会长时间阻塞task_loop*/
+#define FB_DECODER_MORE		0	/*还没完成(数据不够或本次的行数用完了)*/
+#define FB_DECODER_DONE		1
+#define FB_DECODER_ERROR	-1
+
+typedef struct fb_decoder fb_decoder;
+/*[y1,y2)行有更新, 或者解码结束(status不是FB_DECODER_MORE)*/
+typedef void (*Decoder_Func)(fb_decoder *dec, int status, int y1, int y2);
+
+fb_decoder *fb_decoder_new(void); /*根据数据开头自动识别JPEG/PNG*/
+int fb_decoder_feed(fb_decoder *dec, const void *data, int len);
+void fb_decoder_feed_end(fb_decoder *dec); /*数据已经全部送入*/
+/*最多解码max_rows行, 返回FB_DECODER_XXX, [*y1,*y2)是本次更新的行*/
+int fb_decoder_step(fb_decoder *dec, int max_rows, int *y1, int *y2);
+fb_image *fb_decoder_image(fb_decoder *dec); /*解析完文件头后才有, 随解码逐行填充*/
+fb_image *fb_decoder_take_image(fb_decoder *dec); /*取走图片, fb_decoder_free不再释放它*/
+void fb_decoder_free(fb_decoder *dec);
+
+/*挂到task_loop上: 从fd读数据(普通文件或socket/tty等), 每轮解码rows_per_slice行,
+ *有进展或结束时调用callback; 结束后解码器从task_loop上摘下, fd由调用者关闭*/
+int fb_decoder_start(fb_decoder *dec, int fd, int rows_per_slice, Decoder_Func callback);
+
+/*=========================== loader.c ===============================*/
+typedef struct {
+	int w, h; /*JPEG按这个大小缩放解码, 0表示原始大小*/
+} fb_load_opts;
+
+/*在task_loop线程中调用, 失败时image为NULL, image由回调负责释放*/
+typedef void (*Load_Func)(fb_image *image, char *path, void *arg);
+
+/*在后台线程中解码图片, 完成后在task_loop中调用callback, opts可以为NULL*/
+int fb_load_image_async(char *path, const fb_load_opts *opts, Load_Func callback, void *arg);
 
 /*=========================== graphic.c ===============================*/
 #define SCREEN_WIDTH	1024
 #define SCREEN_HEIGHT	600
 
+/*渲染缓冲区的像素: 默认是32位颜色; 编译时定义FB_RENDER_565(见rules.mk)则是RGB565,
+ *画图和fb_update的内存带宽减半, 屏幕是32位时在fb_update中展开*/
+#ifdef FB_RENDER_565
+typedef uint16_t fb_pixel;
+#define FB_PIXEL(c)	((fb_pixel)((((c)>>8)&0xF800)|(((c)>>5)&0x07E0)|(((c)>>3)&0x001F)))
+#else
+typedef int fb_pixel;
+#define FB_PIXEL(c)	((fb_pixel)(c))
+#endif
+
 void fb_init(char *dev);
 void fb_update(void);
+typedef struct {
+	int x, y, w, h;
+} fb_rect;
+/*只把这几个矩形送屏(离得远的几个小区域不会变成一个大矩形), 不结束这一帧的临时图片;
+ *调用者保证还没送屏的画面都在这些矩形里, 送完待送屏区域清空*/
+void fb_update_rect(const fb_rect *rects, int n);
+/*FB_RENDER_565: 32位的图片按4x4有序抖动转换成565, 减少色带; 默认打开. 32位缓冲区时没有作用*/
+void fb_set_dither(int on);
 
 /*lab2*/
 void fb_draw_pixel(int x, int y, int color);
@@ -89,6 +331,144 @@ void fb_draw_line(int sx, int sy, int dx, int dy, int color);
 /*lab3*/
 void fb_draw_image(int x, int y, fb_image *image, int color);
 void fb_draw_text(int x, int y, char *text, int font_size, int color);
+/*不变的文本(按钮, 表头): 第一次整串合成并缓存, 以后只画一张图片; 经常变化的文本用fb_draw_text*/
+void fb_draw_label(int x, int y, char *text, int font_size, int color);
+/*fb_draw_image_ex的flags*/
+#define FB_DRAW_TINT	0x1 /*颜色分量乘上color(0xRRGGBB), 比如禁用按钮变灰; ALPHA_8不用*/
+#define FB_DRAW_KEY	0x2 /*RGB_8880: 颜色等于key(0xRRGGBB)的像素透明*/
+#define FB_DRAW_ADD	0x4 /*乘上alpha后加到背景上(发光), 不是普通的混合*/
+/*同fb_draw_image, 整体再乘上不透明度alpha(0..255); 和flags一起在画的同一遍里完成, 不生成中间图片*/
+void fb_draw_image_ex(int x, int y, fb_image *image, int color, int alpha, int flags, int key);
+/*a和b叠在(x,y)按t(0..255, 0是a, 255是b)交叉淡化; 都是同样大小的RGB_8880时一遍混合完*/
+void fb_draw_crossfade(int x, int y, fb_image *a, fb_image *b, int t);
+/*同上, 混合到图片dst: a, b, dst同样大小、同样的4字节格式, 成功返回0*/
+int fb_crossfade_image(fb_image *dst, fb_image *a, fb_image *b, int t);
+/*把JPEG文件的(sx,sy,sw,sh)区域直接解码到屏幕的(x,y,w,h)区域, 不产生中间图片*/
+int fb_draw_jpeg_image(int x, int y, int w, int h, char *file, int sx, int sy, int sw, int sh);
+/*直接写屏幕缓冲区: 把(x,y,w,h)记为要更新的区域, 返回缓冲区起点, 每行SCREEN_WIDTH个像素;
+ *调用者保证只写屏幕内的这个区域*/
+fb_pixel * fb_draw_buffer(int x, int y, int w, int h);
+/*把图片的(sx,sy,sw,sh)区域最近邻缩放画到屏幕的(x,y,w,h)区域, 只支持RGB_8880*/
+void fb_draw_image_scaled(int x, int y, int w, int h, fb_image *image, int sx, int sy, int sw, int sh);
+/*同上, 只画在(clip_x,clip_y,clip_w,clip_h)里面的部分*/
+void fb_draw_image_scaled_clip(int x, int y, int w, int h, fb_image *image, int sx, int sy, int sw, int sh,
+	int clip_x, int clip_y, int clip_w, int clip_h);
+/*(x,y)是第一行基线的起点*/
+void fb_draw_layout(int x, int y, const fb_text_layout *layout, int color);
+
+/*覆盖层精灵(指针, 拖动的预览图): 不画进渲染缓冲区, fb_update送屏时才合成到屏幕上;
+ *移动只更新旧的和新的矩形, 下面的画面不用重画. 后建的在上面*/
+#define FB_SPRITE_MAX	4
+typedef struct fb_sprite fb_sprite;
+/*(hot_x,hot_y)是图片上对准位置的点, 比如箭头的尖; 图片要一直有效到换掉或者释放. 建好先不显示*/
+fb_sprite * fb_sprite_new(fb_image *image, int hot_x, int hot_y);
+void fb_sprite_free(fb_sprite *sprite);
+int fb_sprite_set_image(fb_sprite *sprite, fb_image *image, int hot_x, int hot_y);
+/*下面两个在下一次fb_update时生效*/
+void fb_sprite_move(fb_sprite *sprite, int x, int y);
+void fb_sprite_show(fb_sprite *sprite, int show);
+
+/*=========================== tiled.c ===============================*/
+/*很大的图片(比如地图、扫描件)分块显示: 第一次打开时把图片切成小块存到tile_dir,
+ *并生成逐级缩小一半的金字塔; 显示时只读视口里的块, 读取在后台线程中进行*/
+typedef struct fb_tiled fb_tiled;
+/*后台读到新的块时在task_loop中调用, 应该重画*/
+typedef void (*Tiled_Func)(fb_tiled *tiled, void *arg);
+
+/*把JPEG或非隔行PNG切块, 不需要整幅图的内存, 成功返回0*/
+int fb_tiled_build(char *image_file, char *tile_dir);
+/*tile_dir里没有切好的块时用image_file切块(image_file可以为NULL)*/
+fb_tiled * fb_tiled_open(char *image_file, char *tile_dir, Tiled_Func callback, void *arg);
+void fb_tiled_close(fb_tiled *tiled);
+void fb_tiled_get_size(fb_tiled *tiled, int *w, int *h);
+/*在屏幕(x,y,w,h)里显示图片, 视口左上角是图片的(ix,iy), scale是屏幕像素/图片像素;
+ *返回还没读到的块数*/
+int fb_tiled_draw(fb_tiled *tiled, int x, int y, int w, int h, int ix, int iy, float scale);
+
+/*=========================== player.c ===============================*/
+/*播放MJPEG的AVI文件或编号的JPEG序列: 后台线程提前读取和解码, 按帧率在task_loop中显示;
+ *跟不上时丢帧而不是变慢*/
+typedef struct fb_player fb_player;
+/*播放完成时在task_loop中调用*/
+typedef void (*Player_Func)(fb_player *player, void *arg);
+
+typedef struct {
+	int read, decoded, presented;
+	int dropped_decode;	/*已经过了显示时间, 没有解码*/
+	int dropped_present;	/*解码了但被更新的帧替代*/
+	int read_queue, reorder_queue;	/*当前队列里的帧数*/
+	float read_fps, decode_fps, present_fps;
+	float decode_ms;	/*每帧平均解码时间*/
+} fb_player_stat;
+
+/*source是.avi文件或者printf格式的序列, 如"/data/f%04d.jpg"(编号从0或1开始);
+ *fps<=0时用AVI头里的帧率(没有时25), threads是解码线程数(<=0时为2)*/
+fb_player * fb_player_open(char *source, int fps, int threads);
+/*在屏幕(x,y,w,h)中播放, 不同大小时缩放*/
+int fb_player_start(fb_player *player, int x, int y, int w, int h, Player_Func done, void *arg);
+void fb_player_close(fb_player *player);
+void fb_player_get_stat(fb_player *player, fb_player_stat *stat);
+
+/*=========================== camera.c ===============================*/
+/*摄像头预览: YUV直接转换写进屏幕缓冲区, 不产生中间图片*/
+#define FB_CAMERA_YUYV	1
+#define FB_CAMERA_NV12	2
+typedef struct fb_camera fb_camera;
+/*每帧画完、fb_update之前在task_loop中调用, 可以在预览上面画别的东西*/
+typedef void (*Camera_Func)(fb_camera *camera, void *arg);
+
+/*把一帧fw*fh的YUV(stride为每行字节数, <=0时按紧凑排列)最近邻缩放画到屏幕(x,y,w,h)*/
+void fb_draw_yuv(int x, int y, int w, int h, const unsigned char *frame, int format, int fw, int fh, int stride);
+/*dev是V4L2设备(如/dev/video0), 或者连续存放fw*fh帧的原始YUV文件(按fps循环播放);
+ *驱动可能调整w/h, 用fb_camera_get_size得到实际大小*/
+fb_camera * fb_camera_open(char *dev, int format, int w, int h, int fps);
+/*开始预览到屏幕(x,y,w,h); 预览中再调用只改变位置和大小*/
+int fb_camera_start(fb_camera *camera, int x, int y, int w, int h, Camera_Func callback, void *arg);
+void fb_camera_get_size(fb_camera *camera, int *w, int *h);
+float fb_camera_get_fps(fb_camera *camera);
+void fb_camera_close(fb_camera *camera);
+
+/*=========================== effect.c ===============================*/
+/*盒式模糊radius(1..128), 重复passes遍(3遍接近高斯), 原地处理;
+ *支持RGB_8880, RGBA_8888(透明边缘用RGBA_PREMUL更好), RGBA_PREMUL, ALPHA_8; 成功返回0*/
+int fb_blur_image(fb_image *image, int radius, int passes);
+/*模糊屏幕缓冲区的(x,y,w,h)区域, 比如对话框后面的毛玻璃*/
+void fb_blur_screen(int x, int y, int w, int h, int radius, int passes);
+/*阴影: 图片的alpha四周各扩大radius后模糊, 得到ALPHA_8的图片;
+ *画在(x-radius+dx, y-radius+dy), 颜色和不透明度用fb_draw_image_ex给出*/
+fb_image * fb_new_shadow_image(fb_image *image, int radius);
+
+/*=========================== anim.c ===============================*/
+/*层: 按先后叠放在背景上的图片; 改变后只重画变化的区域.
+ *动画按task_get_time()插值, 由task_loop驱动, 改变在下一帧(约16ms)画出来*/
+typedef struct fb_layer fb_layer;
+/*动画结束时在task_loop中调用, 可以在里面释放层或开始新的动画*/
+typedef void (*Layer_Func)(fb_layer *layer, void *arg);
+
+typedef struct {
+	int x, y;	/*图片左上角的屏幕位置*/
+	int alpha;	/*0..255*/
+	int clip_x, clip_y, clip_w, clip_h; /*只显示图片的这一部分(图片坐标)*/
+} fb_layer_state;
+
+#define FB_EASE_LINEAR	0
+#define FB_EASE_IN	1 /*先慢后快*/
+#define FB_EASE_OUT	2 /*先快后慢*/
+#define FB_EASE_IN_OUT	3
+
+/*背景: image为NULL(或比屏幕小)的地方用color填充*/
+void fb_layer_set_background(fb_image *image, int color);
+/*新建一层放在最上面, 显示整个图片; 图片在层释放或换掉之前要一直有效*/
+fb_layer * fb_layer_new(fb_image *image, int x, int y);
+void fb_layer_free(fb_layer *layer);
+void fb_layer_get_state(fb_layer *layer, fb_layer_state *st);
+/*立即改变, 正在进行的动画停止(不调用done)*/
+void fb_layer_set_state(fb_layer *layer, const fb_layer_state *st);
+void fb_layer_set_image(fb_layer *layer, fb_image *image);
+/*在duration毫秒内从当前状态变到to, ease是FB_EASE_XXX; done可以为NULL*/
+int fb_layer_animate(fb_layer *layer, const fb_layer_state *to, int duration, int ease, Layer_Func done, void *arg);
+/*在duration毫秒内把层的图片交叉淡化成同样大小的image, 结束后层显示image*/
+int fb_layer_crossfade(fb_layer *layer, fb_image *image, int duration, int ease, Layer_Func done, void *arg);
 
 /*=========================== input.c ===============================*/
 /*lab4*/
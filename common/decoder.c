@@ -0,0 +1,490 @@
+#include "common.h"
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <png.h>
+
+/*================== incremental image decoder ===============*/
+/*数据可以分多次送入(fb_decoder_feed), 每次fb_decoder_step最多解码若干行就返回,
+ *JPEG使用可挂起的数据源, PNG使用libpng的渐进读取, 数据不够时都只是暂停*/
+
+#define DECODER_TYPE_UNKNOWN	0
+#define DECODER_TYPE_JPEG	1
+#define DECODER_TYPE_PNG	2
+
+#define DECODER_STATE_HEADER	0
+#define DECODER_STATE_START	1
+#define DECODER_STATE_SCAN	2
+#define DECODER_STATE_FINISH	3
+#define DECODER_STATE_END	4
+
+/*每次交给png_process_data的字节数. libpng解压IDAT时在行回调里不能暂停
+ *(png_process_data_pause会弄乱它的缓冲区计数), 只能一小块一小块地送,
+ *行数一够就停, 一片最多多出这么多压缩数据解出来的行*/
+#define PNG_CHUNK	256
+
+struct fb_decoder {
+	int type;
+	int state;
+	int status;
+	unsigned char *buf;	/*还没消耗的数据从buf+pos开始*/
+	int pos, len, cap;
+	int eof;	/*数据已经全部送入*/
+	int starved;	/*因为缺数据而暂停*/
+	int skip;	/*JPEG要跳过但还没到达的字节数*/
+	fb_image *image;
+	int y1, y2;	/*本次step更新的行*/
+
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_source_mgr src;
+	struct {
+		struct jpeg_error_mgr pub;
+		jmp_buf jb;
+	} jerr;
+
+	png_structp png;
+	png_infop info;
+	int png_rows;	/*已经收到的行回调数*/
+
+	/*task_loop集成*/
+	int fd;
+	int is_file;	/*普通文件, 在空闲任务里读*/
+	int fd_task;	/*fd已经用task_add_file登记*/
+	int rows_per_slice;
+	Decoder_Func callback;
+};
+
+/*------------------ jpeg source manager ------------------*/
+static void _jpeg_init_source(j_decompress_ptr cinfo) { }
+static void _jpeg_term_source(j_decompress_ptr cinfo) { }
+
+static boolean _jpeg_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+	fb_decoder *dec = (fb_decoder *)cinfo->client_data;
+
+	if(dec->eof) { /*文件被截断, 补一个EOI让libjpeg结束*/
+		cinfo->src->next_input_byte = eoi;
+		cinfo->src->bytes_in_buffer = 2;
+		return TRUE;
+	}
+	dec->starved = 1;
+	return FALSE; /*挂起, 保持next_input_byte不变*/
+}
+
+static void _jpeg_skip_input_data(j_decompress_ptr cinfo, long num)
+{
+	fb_decoder *dec = (fb_decoder *)cinfo->client_data;
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if(num <= 0) return;
+	if(num <= (long)src->bytes_in_buffer) {
+		src->next_input_byte += num;
+		src->bytes_in_buffer -= num;
+	} else {
+		dec->skip += num - src->bytes_in_buffer;
+		src->next_input_byte += src->bytes_in_buffer;
+		src->bytes_in_buffer = 0;
+	}
+}
+
+static void _jpeg_error_exit(j_common_ptr cinfo)
+{
+	fb_decoder *dec = (fb_decoder *)cinfo->client_data;
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(dec->jerr.jb, 1);
+}
+
+static void _jpeg_init(fb_decoder *dec)
+{
+	dec->cinfo.err = jpeg_std_error(&dec->jerr.pub);
+	dec->jerr.pub.error_exit = _jpeg_error_exit;
+	jpeg_create_decompress(&dec->cinfo);
+	dec->cinfo.client_data = dec;
+	dec->src.init_source = _jpeg_init_source;
+	dec->src.fill_input_buffer = _jpeg_fill_input_buffer;
+	dec->src.skip_input_data = _jpeg_skip_input_data;
+	dec->src.resync_to_restart = jpeg_resync_to_restart;
+	dec->src.term_source = _jpeg_term_source;
+	dec->src.next_input_byte = dec->buf;
+	dec->src.bytes_in_buffer = dec->len;
+	dec->cinfo.src = &dec->src;
+}
+
+static int _jpeg_step(fb_decoder *dec, int max_rows)
+{
+	struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+	JSAMPROW row;
+
+	if(setjmp(dec->jerr.jb)) return FB_DECODER_ERROR;
+
+	switch(dec->state) {
+	case DECODER_STATE_HEADER:
+		if(jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED)
+			return FB_DECODER_MORE;
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->do_fancy_upsampling = FALSE;
+		cinfo->out_color_space = JCS_EXT_BGRX;
+		dec->state = DECODER_STATE_START;
+		/* fall through */
+	case DECODER_STATE_START:
+		if(!jpeg_start_decompress(cinfo))
+			return FB_DECODER_MORE;
+		dec->image = fb_new_image(FB_COLOR_RGB_8880, cinfo->output_width, cinfo->output_height, 0);
+		if(dec->image == NULL) return FB_DECODER_ERROR;
+		dec->state = DECODER_STATE_SCAN;
+		/* fall through */
+	case DECODER_STATE_SCAN:
+		while((max_rows > 0)&&(cinfo->output_scanline < cinfo->output_height))
+		{
+			int y = cinfo->output_scanline;
+			row = (JSAMPROW)(dec->image->content + y*dec->image->line_byte);
+			if(jpeg_read_scanlines(cinfo, &row, 1) == 0)
+				return FB_DECODER_MORE;
+			if(dec->y1 > y) dec->y1 = y;
+			if(dec->y2 < y+1) dec->y2 = y+1;
+			max_rows--;
+		}
+		if(cinfo->output_scanline < cinfo->output_height)
+			return FB_DECODER_MORE;
+		dec->state = DECODER_STATE_FINISH;
+		/* fall through */
+	case DECODER_STATE_FINISH:
+		if(!jpeg_finish_decompress(cinfo))
+			return FB_DECODER_MORE;
+		dec->state = DECODER_STATE_END;
+		/* fall through */
+	default:
+		return FB_DECODER_DONE;
+	}
+}
+
+/*------------------ png progressive reader ------------------*/
+static void _png_info_cb(png_structp png, png_infop info)
+{
+	fb_decoder *dec = (fb_decoder *)png_get_progressive_ptr(png);
+	int color_type = png_get_color_type(png, info);
+	int has_alpha;
+
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_bgr(png);
+	has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+	if(!has_alpha) png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	dec->image = fb_new_image(has_alpha ? FB_COLOR_RGBA_8888 : FB_COLOR_RGB_8880,
+		png_get_image_width(png, info), png_get_image_height(png, info), 0);
+	if(dec->image == NULL) png_error(png, "out of memory");
+	/*隔行图片的各遍会合并到已有的行上, 先清零*/
+	memset(dec->image->content, 0, dec->image->line_byte * dec->image->pixel_h);
+	dec->state = DECODER_STATE_SCAN;
+}
+
+static void _png_row_cb(png_structp png, png_bytep new_row, png_uint_32 row_num, int pass)
+{
+	fb_decoder *dec = (fb_decoder *)png_get_progressive_ptr(png);
+	int y = row_num;
+
+	if(new_row == NULL) return; /*隔行图片这一遍这一行没有变化*/
+	png_progressive_combine_row(png, (png_bytep)(dec->image->content + y*dec->image->line_byte), new_row);
+	if(dec->y1 > y) dec->y1 = y;
+	if(dec->y2 < y+1) dec->y2 = y+1;
+	dec->png_rows++;
+}
+
+static void _png_end_cb(png_structp png, png_infop info)
+{
+	fb_decoder *dec = (fb_decoder *)png_get_progressive_ptr(png);
+	dec->state = DECODER_STATE_END;
+}
+
+static int _png_init(fb_decoder *dec)
+{
+	dec->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if(dec->png == NULL) return -1;
+	dec->info = png_create_info_struct(dec->png);
+	if(dec->info == NULL) return -1;
+	png_set_progressive_read_fn(dec->png, dec, _png_info_cb, _png_row_cb, _png_end_cb);
+	return 0;
+}
+
+static int _png_step(fb_decoder *dec, int max_rows)
+{
+	int target = dec->png_rows + max_rows;
+	int n;
+
+	if(setjmp(png_jmpbuf(dec->png))) return FB_DECODER_ERROR;
+
+	while((dec->state != DECODER_STATE_END)&&(dec->png_rows < target))
+	{
+		n = dec->len - dec->pos;
+		if(n <= 0) {
+			if(dec->eof) return FB_DECODER_ERROR; /*数据提前结束*/
+			dec->starved = 1;
+			return FB_DECODER_MORE;
+		}
+		if(n > PNG_CHUNK) n = PNG_CHUNK;
+		png_process_data(dec->png, dec->info, dec->buf + dec->pos, n);
+		dec->pos += n;
+	}
+	return (dec->state == DECODER_STATE_END) ? FB_DECODER_DONE : FB_DECODER_MORE;
+}
+
+/*------------------ public ------------------*/
+fb_decoder *fb_decoder_new(void)
+{
+	fb_decoder *dec = (fb_decoder *)calloc(1, sizeof(fb_decoder));
+	if(dec == NULL) return NULL;
+	dec->fd = -1;
+	dec->status = FB_DECODER_MORE;
+	return dec;
+}
+
+int fb_decoder_feed(fb_decoder *dec, const void *data, int len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	if((dec == NULL)||(len < 0)||(dec->eof)) return -1;
+
+	if(dec->type == DECODER_TYPE_JPEG) { /*libjpeg自己记录消耗到哪里*/
+		dec->pos = dec->len - dec->src.bytes_in_buffer;
+	}
+	if(dec->skip > 0) {
+		int n = (dec->skip < len) ? dec->skip : len;
+		dec->skip -= n;
+		p += n;
+		len -= n;
+	}
+
+	/*丢掉已经消耗的数据, 再追加*/
+	if(dec->pos > 0) {
+		memmove(dec->buf, dec->buf + dec->pos, dec->len - dec->pos);
+		dec->len -= dec->pos;
+		dec->pos = 0;
+	}
+	if(dec->len + len > dec->cap) {
+		int cap = dec->cap ? dec->cap : 16*1024;
+		while(cap < dec->len + len) cap *= 2;
+		unsigned char *buf = (unsigned char *)realloc(dec->buf, cap);
+		if(buf == NULL) return -1;
+		dec->buf = buf;
+		dec->cap = cap;
+	}
+	memcpy(dec->buf + dec->len, p, len);
+	dec->len += len;
+	dec->starved = 0;
+
+	if(dec->type == DECODER_TYPE_UNKNOWN) {
+		if(dec->len < 4) return 0;
+		if((dec->buf[0] == 0xFF)&&(dec->buf[1] == 0xD8)) {
+			dec->type = DECODER_TYPE_JPEG;
+			_jpeg_init(dec);
+		} else if(png_sig_cmp(dec->buf, 0, 4) == 0) {
+			dec->type = DECODER_TYPE_PNG;
+			if(_png_init(dec) < 0) dec->status = FB_DECODER_ERROR;
+		} else {
+			printf("fb_decoder_feed: unknown image format\n");
+			dec->status = FB_DECODER_ERROR;
+		}
+	}
+	if(dec->type == DECODER_TYPE_JPEG) {
+		dec->src.next_input_byte = dec->buf;
+		dec->src.bytes_in_buffer = dec->len;
+	}
+	return 0;
+}
+
+void fb_decoder_feed_end(fb_decoder *dec)
+{
+	if(dec == NULL) return;
+	dec->eof = 1;
+	dec->starved = 0;
+}
+
+int fb_decoder_step(fb_decoder *dec, int max_rows, int *y1, int *y2)
+{
+	int status;
+
+	if(dec == NULL) return FB_DECODER_ERROR;
+	dec->y1 = 0x7fffffff;
+	dec->y2 = 0;
+	if(dec->status != FB_DECODER_MORE) {
+		status = dec->status;
+	} else if(dec->type == DECODER_TYPE_JPEG) {
+		status = _jpeg_step(dec, max_rows);
+	} else if(dec->type == DECODER_TYPE_PNG) {
+		status = _png_step(dec, max_rows);
+	} else {
+		if(dec->eof) status = FB_DECODER_ERROR;
+		else {
+			dec->starved = 1;
+			status = FB_DECODER_MORE;
+		}
+	}
+	dec->status = status;
+	if(dec->y2 == 0) dec->y1 = 0;
+	if(y1) *y1 = dec->y1;
+	if(y2) *y2 = dec->y2;
+	return status;
+}
+
+fb_image *fb_decoder_image(fb_decoder *dec)
+{
+	return dec ? dec->image : NULL;
+}
+
+fb_image *fb_decoder_take_image(fb_decoder *dec)
+{
+	fb_image *image;
+	if(dec == NULL) return NULL;
+	image = dec->image;
+	dec->image = NULL;
+	return image;
+}
+
+/*------------------ task_loop ------------------*/
+/*所有挂在task_loop上的解码器共用一个空闲任务, 每轮每个解码器解码一片;
+ *都在等数据时撤掉空闲任务, 避免task_loop空转*/
+
+#define DECODER_NUM_MAX	4
+#define DECODER_READ_SIZE	(16*1024)
+
+static fb_decoder *decoders[DECODER_NUM_MAX];
+
+static void _decoder_idle(int arg);
+
+static void _decoder_schedule(void)
+{
+	int i, busy = 0;
+	for(i=0; i<DECODER_NUM_MAX; ++i)
+	{
+		fb_decoder *dec = decoders[i];
+		if(dec == NULL) continue;
+		if(!dec->starved || (dec->is_file && !dec->eof)) busy = 1;
+	}
+	if(busy) task_add_idle(_decoder_idle);
+	else task_delete_idle(_decoder_idle);
+}
+
+static void _decoder_detach(int i)
+{
+	fb_decoder *dec = decoders[i];
+	decoders[i] = NULL;
+	if(dec->fd_task) task_delete_file(dec->fd);
+	dec->fd_task = 0;
+	dec->fd = -1;
+}
+
+/*读一次fd, 返回读到的字节数, 0表示到了文件尾或出错*/
+static int _decoder_read(fb_decoder *dec)
+{
+	char buf[DECODER_READ_SIZE];
+	int n;
+
+	do {
+		n = read(dec->fd, buf, sizeof(buf));
+	} while((n < 0)&&(errno == EINTR));
+	if(n > 0) {
+		if(fb_decoder_feed(dec, buf, n) < 0) { /*内存不够, 这张图片解不下去了*/
+			printf("decoder feed %d failed\n", dec->fd);
+			dec->status = FB_DECODER_ERROR;
+			dec->starved = 0;
+			return 0;
+		}
+		return n;
+	}
+	if((n < 0)&&((errno == EAGAIN)||(errno == EWOULDBLOCK)))
+		return -1;
+	if(n < 0) printf("decoder read %d error(%d): %s\n", dec->fd, errno, strerror(errno));
+	fb_decoder_feed_end(dec);
+	return 0;
+}
+
+static void _decoder_fd_cb(int fd)
+{
+	int i;
+	for(i=0; i<DECODER_NUM_MAX; ++i)
+	{
+		fb_decoder *dec = decoders[i];
+		if((dec == NULL)||(dec->fd != fd)) continue;
+		if(_decoder_read(dec) == 0) {
+			task_delete_file(fd); /*到文件尾了, 剩下的交给空闲任务*/
+			dec->fd_task = 0;
+		}
+		break;
+	}
+	_decoder_schedule();
+}
+
+static void _decoder_idle(int arg)
+{
+	int i, status, y1, y2;
+
+	for(i=0; i<DECODER_NUM_MAX; ++i)
+	{
+		fb_decoder *dec = decoders[i];
+		if(dec == NULL) continue;
+		if(dec->starved && dec->is_file && !dec->eof)
+			_decoder_read(dec);
+		if(dec->starved) continue;
+
+		status = fb_decoder_step(dec, dec->rows_per_slice, &y1, &y2);
+		if(status != FB_DECODER_MORE) _decoder_detach(i);
+		if((status != FB_DECODER_MORE)||(y2 > y1))
+			dec->callback(dec, status, y1, y2);
+	}
+	_decoder_schedule();
+}
+
+int fb_decoder_start(fb_decoder *dec, int fd, int rows_per_slice, Decoder_Func callback)
+{
+	struct stat st;
+	int i;
+
+	if((dec == NULL)||(fd < 0)||(rows_per_slice <= 0)||(callback == NULL)) return -1;
+	for(i=0; i<DECODER_NUM_MAX; ++i)
+	{
+		if(decoders[i] == NULL) break;
+	}
+	if(i >= DECODER_NUM_MAX) {
+		printf("start decoder too many\n");
+		return -1;
+	}
+
+	dec->fd = fd;
+	dec->rows_per_slice = rows_per_slice;
+	dec->callback = callback;
+	/*普通文件随时可读, 在空闲任务里边读边解; 其他的等fd可读时再读*/
+	dec->is_file = ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode));
+	if(!dec->is_file) {
+		if(task_add_file(fd, _decoder_fd_cb) < 0) {
+			dec->fd = -1;
+			return -1;
+		}
+		dec->fd_task = 1;
+	}
+	decoders[i] = dec;
+	_decoder_schedule();
+	return 0;
+}
+
+void fb_decoder_free(fb_decoder *dec)
+{
+	int i;
+
+	if(dec == NULL) return;
+	for(i=0; i<DECODER_NUM_MAX; ++i)
+	{
+		if(decoders[i] == dec) {
+			_decoder_detach(i);
+			_decoder_schedule();
+		}
+	}
+	if(dec->type == DECODER_TYPE_JPEG) jpeg_destroy_decompress(&dec->cinfo);
+	if(dec->png) png_destroy_read_struct(&dec->png, dec->info ? &dec->info : NULL, NULL);
+	fb_free_image(dec->image);
+	free(dec->buf);
+	free(dec);
+}
@@ -0,0 +1,324 @@
+#include "common.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLUR_USE_NEON	1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLUR_USE_SSE2	1
+#endif
+
+/*================== blur ===============*/
+/*可分离的盒式模糊: 每个方向用滑动和, 每个像素的代价和半径无关; 重复几遍接近高斯.
+ *纵向按BLUR_STRIP像素宽的竖条处理, 一条的工作集留在缓存里, 一行里的各列用SIMD一起加减;
+ *横向4行一起, 16个通道放在两个向量里*/
+
+#define BLUR_STRIP	32
+#define BLUR_RADIUS_MAX	128	/*窗口最多257, 和不超过16位*/
+#define BLUR_THREADS	2	/*RK3399的两个A72核*/
+#define BLUR_THREAD_PIXELS	(256*256)	/*小图片不值得开线程*/
+
+/*src的n行, 每行nb字节, 每个字节单独求平均(通道交错也一样):
+ *dst第i行 = src第i-r..i+r行的平均, 超出的行用最边上的行; sum是nb个16位的临时空间*/
+static void _box_lines(const unsigned char *src, int sstride, unsigned char *dst, int dstride,
+	int nb, int n, int r, uint16_t *sum)
+{
+	int i, j, k;
+	/*乘倒数代替除法: ceil(65536/(2r+1)), 结果不会超过255*/
+	unsigned int inv = (65536 + 2*r) / (2*r + 1);
+
+	for(j=0; j<nb; ++j) sum[j] = src[j] * (r + 1);
+	for(k=1; k<=r; ++k)
+	{
+		const unsigned char *p = src + ((k < n) ? k : n-1) * sstride;
+		for(j=0; j<nb; ++j) sum[j] += p[j];
+	}
+
+	for(i=0; i<n; ++i)
+	{
+		unsigned char *o = dst + i * dstride;
+		const unsigned char *add = src + ((i+r+1 < n) ? i+r+1 : n-1) * sstride;
+		const unsigned char *sub = src + ((i-r > 0) ? i-r : 0) * sstride;
+		j = 0;
+#if defined(BLUR_USE_NEON)
+		const uint16x4_t vinv = vdup_n_u16(inv);
+		for(; j+8<=nb; j+=8)
+		{
+			uint16x8_t s = vld1q_u16(sum + j);
+			uint32x4_t lo = vmull_u16(vget_low_u16(s), vinv);
+			uint32x4_t hi = vmull_u16(vget_high_u16(s), vinv);
+			vst1_u8(o + j, vmovn_u16(vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16))));
+			s = vsubw_u8(vaddw_u8(s, vld1_u8(add + j)), vld1_u8(sub + j));
+			vst1q_u16(sum + j, s);
+		}
+#elif defined(BLUR_USE_SSE2)
+		const __m128i vinv = _mm_set1_epi16((short)inv);
+		const __m128i zero = _mm_setzero_si128();
+		for(; j+8<=nb; j+=8)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)(sum + j));
+			__m128i q = _mm_mulhi_epu16(s, vinv);
+			_mm_storel_epi64((__m128i *)(o + j), _mm_packus_epi16(q, q));
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(add + j)), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(sub + j)), zero);
+			_mm_storeu_si128((__m128i *)(sum + j), _mm_sub_epi16(_mm_add_epi16(s, a), b));
+		}
+#endif
+		for(; j<nb; ++j)
+		{
+			o[j] = (sum[j] * inv) >> 16;
+			sum[j] += add[j] - sub[j]; /*16位回绕, 减完又回到范围内*/
+		}
+	}
+}
+
+/*横向, 4字节像素: 4行的像素交错放进两边补了r个像素的ti, 每一步4行共16个通道一起滑动求和;
+ *rows里可以有重复的行*/
+static void _box_rows4(unsigned char **rows, int w, int r, unsigned char *ti)
+{
+	int x, j, k, n = w + 2*r + 1;
+	unsigned int inv = (65536 + 2*r) / (2*r + 1);
+	uint16_t sum[16];
+
+	for(x=0; x<n; ++x)
+	{
+		int sx = (x < r) ? 0 : ((x - r < w) ? x - r : w - 1);
+		for(k=0; k<4; ++k) ((uint32_t *)ti)[4*x + k] = ((const uint32_t *)rows[k])[sx];
+	}
+	for(j=0; j<16; ++j) sum[j] = 0;
+	for(x=0; x<=2*r; ++x)
+		for(j=0; j<16; ++j) sum[j] += ti[x*16 + j];
+
+#if defined(BLUR_USE_NEON)
+	uint16x8_t s0 = vld1q_u16(sum), s1 = vld1q_u16(sum + 8);
+	const uint16x4_t vinv = vdup_n_u16(inv);
+	for(x=0; x<w; ++x)
+	{
+		uint16x4_t q0 = vshrn_n_u32(vmull_u16(vget_low_u16(s0), vinv), 16);
+		uint16x4_t q1 = vshrn_n_u32(vmull_u16(vget_high_u16(s0), vinv), 16);
+		uint16x4_t q2 = vshrn_n_u32(vmull_u16(vget_low_u16(s1), vinv), 16);
+		uint16x4_t q3 = vshrn_n_u32(vmull_u16(vget_high_u16(s1), vinv), 16);
+		uint32x4_t q = vreinterpretq_u32_u8(vcombine_u8(vmovn_u16(vcombine_u16(q0, q1)), vmovn_u16(vcombine_u16(q2, q3))));
+		vst1q_lane_u32((uint32_t *)rows[0] + x, q, 0);
+		vst1q_lane_u32((uint32_t *)rows[1] + x, q, 1);
+		vst1q_lane_u32((uint32_t *)rows[2] + x, q, 2);
+		vst1q_lane_u32((uint32_t *)rows[3] + x, q, 3);
+		uint8x16_t a = vld1q_u8(ti + (x + 2*r + 1)*16), b = vld1q_u8(ti + x*16);
+		s0 = vsubw_u8(vaddw_u8(s0, vget_low_u8(a)), vget_low_u8(b));
+		s1 = vsubw_u8(vaddw_u8(s1, vget_high_u8(a)), vget_high_u8(b));
+	}
+#elif defined(BLUR_USE_SSE2)
+	const __m128i vinv = _mm_set1_epi16((short)inv);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s0 = _mm_loadu_si128((const __m128i *)sum), s1 = _mm_loadu_si128((const __m128i *)(sum + 8));
+	for(x=0; x<w; ++x)
+	{
+		__m128i q = _mm_packus_epi16(_mm_mulhi_epu16(s0, vinv), _mm_mulhi_epu16(s1, vinv));
+		((uint32_t *)rows[3])[x] = _mm_cvtsi128_si32(_mm_srli_si128(q, 12));
+		((uint32_t *)rows[2])[x] = _mm_cvtsi128_si32(_mm_srli_si128(q, 8));
+		((uint32_t *)rows[1])[x] = _mm_cvtsi128_si32(_mm_srli_si128(q, 4));
+		((uint32_t *)rows[0])[x] = _mm_cvtsi128_si32(q);
+		__m128i a = _mm_loadu_si128((const __m128i *)(ti + (x + 2*r + 1)*16));
+		__m128i b = _mm_loadu_si128((const __m128i *)(ti + x*16));
+		s0 = _mm_sub_epi16(_mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero)), _mm_unpacklo_epi8(b, zero));
+		s1 = _mm_sub_epi16(_mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero)), _mm_unpackhi_epi8(b, zero));
+	}
+#else
+	for(x=0; x<w; ++x)
+	{
+		for(k=3; k>=0; --k)
+			for(j=0; j<4; ++j) rows[k][x*4 + j] = (sum[k*4 + j] * inv) >> 16;
+		for(j=0; j<16; ++j) sum[j] += ti[(x + 2*r + 1)*16 + j] - ti[x*16 + j];
+	}
+#endif
+}
+
+/*横向, 1字节像素(阴影之类的小图片)*/
+static void _box_row1(unsigned char *row, int w, int r, unsigned char *t)
+{
+	int x, n = w + 2*r + 1;
+	unsigned int inv = (65536 + 2*r) / (2*r + 1);
+	unsigned int sum = 0;
+
+	for(x=0; x<n; ++x) t[x] = row[(x < r) ? 0 : ((x - r < w) ? x - r : w - 1)];
+	for(x=0; x<=2*r; ++x) sum += t[x];
+	for(x=0; x<w; ++x)
+	{
+		row[x] = (sum * inv) >> 16;
+		sum += t[x + 2*r + 1] - t[x];
+	}
+}
+
+typedef struct {
+	unsigned char *img;
+	int w, h, lb, bpp, radius, passes;
+	int threads;
+	unsigned char *buf[BLUR_THREADS];
+	pthread_barrier_t barrier;
+} blur_job;
+
+/*线程id做第id份: 横向按4行一组、纵向按竖条轮流分配, 两个方向之间等所有线程做完*/
+static void _blur_part(blur_job *job, int id)
+{
+	int w = job->w, h = job->h, lb = job->lb, bpp = job->bpp, radius = job->radius;
+	unsigned char *img = job->img;
+	unsigned char *a = job->buf[id]; /*纵向的竖条*/
+	unsigned char *t = a + BLUR_STRIP * bpp * h; /*横向补了边的行*/
+	uint16_t *sum = (uint16_t *)(t + (w + 2*radius + 1) * 16);
+	int p, x0, y, k;
+
+	for(p=0; p<job->passes; ++p)
+	{
+		/*横向*/
+		for(y=id*4; y<h; y+=4*job->threads)
+		{
+			if(bpp == 1) {
+				for(k=y; (k<y+4)&&(k<h); ++k) _box_row1(img + k*lb, w, radius, t);
+			}
+			else {
+				unsigned char *rows[4];
+				for(k=0; k<4; ++k) rows[k] = img + ((y+k < h) ? y+k : h-1)*lb;
+				_box_rows4(rows, w, radius, t);
+			}
+		}
+		if(job->threads > 1) pthread_barrier_wait(&job->barrier);
+		/*纵向: 源要保持不变, 先复制出来, 结果直接写回图片*/
+		for(x0=id*BLUR_STRIP; x0<w; x0+=BLUR_STRIP*job->threads)
+		{
+			int sw = (w - x0 < BLUR_STRIP) ? w - x0 : BLUR_STRIP;
+			int nb = sw * bpp;
+			for(y=0; y<h; ++y) memcpy(a + y*nb, img + y*lb + x0*bpp, nb);
+			_box_lines(a, nb, img + x0*bpp, lb, nb, h, radius, sum);
+		}
+		if(job->threads > 1) pthread_barrier_wait(&job->barrier);
+	}
+}
+
+static void * _blur_thread(void *arg)
+{
+	_blur_part(arg, 1);
+	return NULL;
+}
+
+/*img的(w,h)个像素, 每行lb字节, 原地模糊*/
+static int _blur(unsigned char *img, int w, int h, int lb, int bpp, int radius, int passes)
+{
+	blur_job job;
+	pthread_t tid;
+	unsigned char *buf;
+	int size, i;
+
+	if((radius < 1)||(passes < 1)||(w <= 0)||(h <= 0)) return 0;
+	if(radius > BLUR_RADIUS_MAX) radius = BLUR_RADIUS_MAX;
+
+	job.img = img;
+	job.w = w;
+	job.h = h;
+	job.lb = lb;
+	job.bpp = bpp;
+	job.radius = radius;
+	job.passes = passes;
+	job.threads = (w * h >= BLUR_THREAD_PIXELS) ? BLUR_THREADS : 1;
+
+	size = BLUR_STRIP * bpp * h + (w + 2*radius + 1) * 16 + BLUR_STRIP * 4 * sizeof(uint16_t);
+	size = (size + 63) & ~63;
+	buf = malloc(size * job.threads);
+	if(buf == NULL) return -1;
+	for(i=0; i<job.threads; ++i) job.buf[i] = buf + i*size;
+
+	if(job.threads > 1) {
+		pthread_barrier_init(&job.barrier, NULL, job.threads);
+		if(pthread_create(&tid, NULL, _blur_thread, &job) != 0) {
+			pthread_barrier_destroy(&job.barrier);
+			job.threads = 1;
+		}
+	}
+	_blur_part(&job, 0);
+	if(job.threads > 1) {
+		pthread_join(tid, NULL);
+		pthread_barrier_destroy(&job.barrier);
+	}
+	free(buf);
+	return 0;
+}
+
+int fb_blur_image(fb_image *image, int radius, int passes)
+{
+	int bpp;
+
+	if(image == NULL) return -1;
+	if(image->color_type == FB_COLOR_ALPHA_8) bpp = 1;
+	else if((image->color_type == FB_COLOR_RGB_8880)||(image->color_type == FB_COLOR_RGBA_8888)||
+		(image->color_type == FB_COLOR_RGBA_PREMUL)) bpp = 4;
+	else return -1;
+	if(fb_image_writable(image) < 0) return -1;
+	return _blur((unsigned char *)image->content, image->pixel_w, image->pixel_h, image->line_byte, bpp, radius, passes);
+}
+
+void fb_blur_screen(int x, int y, int w, int h, int radius, int passes)
+{
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x+w > SCREEN_WIDTH) w = SCREEN_WIDTH - x;
+	if(y+h > SCREEN_HEIGHT) h = SCREEN_HEIGHT - y;
+	if((w <= 0)||(h <= 0)) return;
+
+	fb_pixel *buf = fb_draw_buffer(x, y, w, h) + y*SCREEN_WIDTH + x;
+#ifdef FB_RENDER_565
+	/*展开成32位模糊, 再抖动画回去*/
+	fb_image *tmp = fb_new_frame_image(FB_COLOR_RGB_8880, w, h);
+	if(tmp == NULL) return;
+	for(int j = 0; j < h; ++j)
+	{
+		unsigned int *d = (unsigned int *)(tmp->content + j*tmp->line_byte);
+		for(int i = 0; i < w; ++i)
+		{
+			unsigned int p = buf[j*SCREEN_WIDTH + i];
+			unsigned int r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+			d[i] = 0xFF000000 | (((r << 3)|(r >> 2)) << 16) | (((g << 2)|(g >> 4)) << 8) | ((b << 3)|(b >> 2));
+		}
+	}
+	_blur((unsigned char *)tmp->content, w, h, tmp->line_byte, 4, radius, passes);
+	fb_draw_image(x, y, tmp, 0);
+#else
+	_blur((unsigned char *)buf, w, h, SCREEN_WIDTH*4, 4, radius, passes);
+#endif
+}
+
+fb_image * fb_new_shadow_image(fb_image *image, int radius)
+{
+	fb_image *sh;
+	int x, y;
+
+	if(image == NULL) return NULL;
+	if(radius < 0) radius = 0;
+	sh = fb_new_image(FB_COLOR_ALPHA_8, image->pixel_w + 2*radius, image->pixel_h + 2*radius, 0);
+	if(sh == NULL) return NULL;
+	memset(sh->content, 0, sh->line_byte * sh->pixel_h);
+
+	/*图片的alpha放在中间, 没有alpha的格式当作不透明*/
+	for(y=0; y<image->pixel_h; ++y)
+	{
+		unsigned char *d = (unsigned char *)sh->content + (y + radius) * sh->line_byte + radius;
+		const unsigned char *s = (const unsigned char *)image->content + y * image->line_byte;
+		switch(image->color_type) {
+		case FB_COLOR_RGBA_8888:
+		case FB_COLOR_RGBA_PREMUL:
+			for(x=0; x<image->pixel_w; ++x) d[x] = s[x*4 + 3];
+			break;
+		case FB_COLOR_ALPHA_8:
+			memcpy(d, s, image->pixel_w);
+			break;
+		case FB_COLOR_INDEX_8:
+			for(x=0; x<image->pixel_w; ++x) d[x] = image->palette[s[x]] >> 24;
+			break;
+		default:
+			memset(d, 255, image->pixel_w);
+			break;
+		}
+	}
+	/*3遍半径radius/3的盒式模糊, 边缘大约扩散radius*/
+	if(radius > 0) _blur((unsigned char *)sh->content, sh->pixel_w, sh->pixel_h, sh->line_byte, 1,
+		(radius + 2) / 3, 3);
+	return sh;
+}
@@ -13,13 +13,22 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLIT_USE_NEON	1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLIT_USE_SSE2	1
+#endif
+
 #ifndef NULL
 #define NULL ((void*)0)
 #endif
 
 static int LCD_FB_FD;
 static int *LCD_FB_BUF = NULL;
-static int DRAW_BUF[SCREEN_WIDTH*SCREEN_HEIGHT];
+static int LCD_FB_BPP = 32;
+static fb_pixel DRAW_BUF[SCREEN_WIDTH*SCREEN_HEIGHT];
 
 static struct area {
 	int x1, x2, y1, y2;
@@ -81,25 +90,59 @@ void fb_init(char *dev)
 
 	LCD_FB_FD = fd;
 	LCD_FB_BUF = addr;
+	LCD_FB_BPP = fb_var.bits_per_pixel;
 
 	//set empty
 	AREA_SET_EMPTY(&update_area);
 	return;
 }
 
-static void _copy_area(int *dst, int *src, struct area *pa)
+#ifdef FB_RENDER_565
+/*565的屏幕直接复制, 32位的屏幕展开成8888; src是区域左上角的像素, 每行stride个*/
+static void _copy_rect(int *dst, const fb_pixel *src, int stride, const struct area *pa)
+{
+	int x, y, w, h;
+	x = pa->x1; w = pa->x2-x;
+	y = pa->y1; h = pa->y2-y;
+	if(LCD_FB_BPP == 16) {
+		fb_pixel *d = (fb_pixel *)dst + y*SCREEN_WIDTH + x;
+		while(h-- > 0){
+			memcpy(d, src, w*2);
+			src += stride;
+			d += SCREEN_WIDTH;
+		}
+		return;
+	}
+	dst += y*SCREEN_WIDTH + x;
+	while(h-- > 0){
+		for(int i = 0; i < w; ++i){
+			unsigned int p = src[i];
+			unsigned int r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+			dst[i] = 0xFF000000 | (((r << 3)|(r >> 2)) << 16) | (((g << 2)|(g >> 4)) << 8) | ((b << 3)|(b >> 2));
+		}
+		src += stride;
+		dst += SCREEN_WIDTH;
+	}
+}
+#else
+static void _copy_rect(int *dst, const fb_pixel *src, int stride, const struct area *pa)
 {
 	int x, y, w, h;
 	x = pa->x1; w = pa->x2-x;
 	y = pa->y1; h = pa->y2-y;
-	src += y*SCREEN_WIDTH + x;
 	dst += y*SCREEN_WIDTH + x;
 	while(h-- > 0){
 		memcpy(dst, src, w*4);
-		src += SCREEN_WIDTH;
+		src += stride;
 		dst += SCREEN_WIDTH;
 	}
 }
+#endif
+
+static void _copy_area(int *dst, fb_pixel *src, const struct area *pa)
+{
+	_copy_rect(dst, src + pa->y1*SCREEN_WIDTH + pa->x1, SCREEN_WIDTH, pa);
+}
 
 static int _check_area(struct area *pa)
 {
@@ -118,14 +161,41 @@ static int _check_area(struct area *pa)
 	return 0;
 }
 
+static void _sprite_present(const struct area *scene);
+static void _sprite_cover(const struct area *scene);
+
 void fb_update(void)
 {
-	if(_check_area(&update_area) == 0) return; //is empty
+	fb_image_frame_end(); /*这一帧的临时图片已经画完*/
+	if(_check_area(&update_area) == 0) { //is empty
+		_sprite_present(NULL);
+		return;
+	}
 	_copy_area(LCD_FB_BUF, DRAW_BUF, &update_area);
+	_sprite_present(&update_area); /*画面盖掉的精灵重新合成*/
 	AREA_SET_EMPTY(&update_area); //set empty
 	return;
 }
 
+void fb_update_rect(const fb_rect *rects, int n)
+{
+	struct area a;
+	int i;
+
+	for(i=0; i<n; ++i)
+	{
+		a.x1 = rects[i].x;
+		a.y1 = rects[i].y;
+		a.x2 = rects[i].x + rects[i].w;
+		a.y2 = rects[i].y + rects[i].h;
+		if(_check_area(&a) == 0) continue;
+		_copy_area(LCD_FB_BUF, DRAW_BUF, &a);
+		_sprite_cover(&a);
+	}
+	_sprite_present(NULL);
+	AREA_SET_EMPTY(&update_area);
+}
+
 /*======================================================================*/
 
 static void * _begin_draw(int x, int y, int w, int h)
@@ -142,9 +212,9 @@ static void * _begin_draw(int x, int y, int w, int h)
 void fb_draw_pixel(int x, int y, int color)
 {
 	if(x<0 || y<0 || x>=SCREEN_WIDTH || y>=SCREEN_HEIGHT) return;
-	int *buf = _begin_draw(x,y,1,1);
+	fb_pixel *buf = _begin_draw(x,y,1,1);
 /*---------------------------------------------------*/
-	*(buf + y*SCREEN_WIDTH + x) = color;
+	*(buf + y*SCREEN_WIDTH + x) = FB_PIXEL(color);
 /*---------------------------------------------------*/
 	return;
 }
@@ -156,17 +226,28 @@ void fb_draw_rect(int x, int y, int w, int h, int color)
 	if(y < 0) { h += y; y = 0;}
 	if(y+h >SCREEN_HEIGHT) { h = SCREEN_HEIGHT-y;}
 	if(w<=0 || h<=0) return;
-	int *buf = _begin_draw(x,y,w,h);
+	fb_pixel *buf = _begin_draw(x,y,w,h);
 /*---------------------------------------------------*/
     /* previously (kept as comment):
      printf("you need implement fb_draw_rect()\n"); exit(0);
     */
-	int *dst = buf + y*SCREEN_WIDTH + x;
+	fb_pixel c = FB_PIXEL(color);
+	fb_pixel *dst = buf + y*SCREEN_WIDTH + x;
 	for(int j = 0; j < h; ++j){
-		int *row = dst + j*SCREEN_WIDTH;
+		fb_pixel *row = dst + j*SCREEN_WIDTH;
+#ifdef FB_RENDER_565
+		/*对齐到4字节后一次写两个像素*/
+		int i = 0;
+		if(((uintptr_t)row & 2)&&(w > 0)) row[i++] = c;
+		uint32_t c2 = c | ((uint32_t)c << 16);
+		uint32_t *row2 = (uint32_t *)(row + i);
+		for(int k = 0; k < (w - i) >> 1; ++k) row2[k] = c2;
+		if((w - i) & 1) row[w-1] = c;
+#else
 		for(int i = 0; i < w; ++i){
-			row[i] = color;
+			row[i] = c;
 		}
+#endif
 	}
 
 /*---------------------------------------------------*/
@@ -184,7 +265,8 @@ void fb_draw_line(int x1, int y1, int x2, int y2, int color)
 	int miny = (y1 < y2) ? y1 : y2;
 	int w = (x1 > x2 ? x1 - x2 : x2 - x1) + 1;
 	int h = (y1 > y2 ? y1 - y2 : y2 - y1) + 1;
-	int *buf = _begin_draw(minx, miny, w, h);
+	fb_pixel *buf = _begin_draw(minx, miny, w, h);
+	fb_pixel c = FB_PIXEL(color);
 
 	// Bresenham 整数算法
 	int dx = (x2 > x1) ? (x2 - x1) : (x1 - x2);
@@ -197,7 +279,7 @@ void fb_draw_line(int x1, int y1, int x2, int y2, int color)
 	int y = y1;
 	for(;;){
 		if(x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT){
-			buf[y*SCREEN_WIDTH + x] = color;
+			buf[y*SCREEN_WIDTH + x] = c;
 		}
 		if(x == x2 && y == y2) break;
 		int e2 = err << 1; // 2*err
@@ -209,109 +291,746 @@ void fb_draw_line(int x1, int y1, int x2, int y2, int color)
 	return;
 }
 
-void fb_draw_image(int x, int y, fb_image *image, int color)
+/*======================== blitters ========================*/
+/*每种(源格式, 混合方式, 有没有全局透明度, 效果)都从同一个模板生成一个专门的行函数,
+ *目标格式(8888或565)在编译时由FB_RENDER_565决定. 每次画图查一次表, 每行调用一次;
+ *常用的组合在_blit_init里换成手写或SIMD的版本.*/
+#define BLIT_COPY	0 /*不看源的alpha, 直接覆盖*/
+#define BLIT_OVER	1 /*按alpha混合*/
+#define BLIT_ADD	2 /*乘上alpha后加到目标, 饱和*/
+#define BLIT_MODES	3
+#define BLIT_TYPES	(FB_COLOR_INDEX_8+1)
+#define BLIT_TINT	FB_DRAW_TINT /*效果, 可以组合*/
+#define BLIT_KEY	FB_DRAW_KEY
+#define BLIT_FX	4
+
+typedef struct {
+	int color; /*FB_COLOR_ALPHA_8的颜色*/
+	int alpha; /*全局透明度 1..255*/
+	int tint; /*BLIT_TINT: 0xRRGGBB*/
+	int key; /*BLIT_KEY: 0xRRGGBB*/
+	const unsigned int *palette;
+	const unsigned char *planes; /*BLIT_INDEX_SIMD: 调色板拆成的B,G,R,A四个256字节平面*/
+#ifdef FB_RENDER_565
+	const fb_pixel *pal565; /*FB_COLOR_INDEX_8转好的调色板*/
+	const unsigned char *dither; /*这一行的抖动阈值, 用屏幕x&3取*/
+	int dx; /*第一个像素的屏幕x*/
+#endif
+} blit_ctx;
+
+typedef void (*blit_row_func)(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c);
+
+#define BLIT_INLINE static inline __attribute__((always_inline))
+
+#ifdef FB_RENDER_565
+static int dither_on = 1;
+static const unsigned char bayer4[4][4] = { /*0..15*/
+	{ 0,  8,  2, 10},
+	{12,  4, 14,  6},
+	{ 3, 11,  1,  9},
+	{15,  7, 13,  5},
+};
+static const unsigned char bayer_off[4] = {0, 0, 0, 0};
+
+/*d是抖动阈值0..15: 5位通道的量化步长是8, 6位是4*/
+static inline fb_pixel _pack565(int r, int g, int b, int d)
 {
-	if(image == NULL) return;
+	r += d >> 1; g += d >> 2; b += d >> 1;
+	if(r > 255) r = 255;
+	if(g > 255) g = 255;
+	if(b > 255) b = 255;
+	return (fb_pixel)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+}
+
+static inline void _unpack565(fb_pixel p, int *r, int *g, int *b)
+{
+	int r5 = p >> 11, g6 = (p >> 5) & 0x3F, b5 = p & 0x1F;
+	*r = (r5 << 3) | (r5 >> 2);
+	*g = (g6 << 2) | (g6 >> 4);
+	*b = (b5 << 3) | (b5 >> 2);
+}
+
+/*把dst原来的颜色和(r,g,b)按a混合, 和32位的公式一样*/
+static inline fb_pixel _blend565(fb_pixel p, int r, int g, int b, int a, int d)
+{
+	int pr, pg, pb;
+	_unpack565(p, &pr, &pg, &pb);
+	return _pack565(pr + ((r - pr) * a >> 8), pg + ((g - pg) * a >> 8), pb + ((b - pb) * a >> 8), d);
+}
+#endif
+
+/*取第i个源像素, RGB_8880的alpha当作255*/
+BLIT_INLINE void _blit_fetch(const unsigned char *s, int i, const blit_ctx *c, const int type,
+	int *r, int *g, int *b, int *a)
+{
+	if(type == FB_COLOR_ALPHA_8){
+		*r = (c->color >> 16) & 0xFF; *g = (c->color >> 8) & 0xFF; *b = c->color & 0xFF;
+		*a = s[i];
+	}else if(type == FB_COLOR_INDEX_8){
+		unsigned int p = c->palette[s[i]];
+		*r = (p >> 16) & 0xFF; *g = (p >> 8) & 0xFF; *b = p & 0xFF;
+		*a = p >> 24;
+	}else{
+		s += i * 4;
+		*b = s[0]; *g = s[1]; *r = s[2];
+		*a = (type == FB_COLOR_RGB_8880) ? 255 : s[3];
+	}
+}
+
+/*写第i个目标像素; pm表示(r,g,b)已经乘过a, BLIT_COPY到这里和BLIT_OVER一样*/
+BLIT_INLINE void _blit_store(fb_pixel *d, int i, const blit_ctx *c, int r, int g, int b, int a,
+	const int pm, const int mode)
+{
+#ifdef FB_RENDER_565
+	int dv = c->dither[(c->dx + i) & 3];
+	int pr, pg, pb;
+	if(mode == BLIT_ADD){
+		if(a == 0) return;
+		if(!pm) { r = r * (a + 1) >> 8; g = g * (a + 1) >> 8; b = b * (a + 1) >> 8; }
+		_unpack565(d[i], &pr, &pg, &pb);
+		d[i] = _pack565(pr + r, pg + g, pb + b, dv);
+	}else if(pm){
+		int ia = 255 - a;
+		if(ia == 0){
+			d[i] = _pack565(r, g, b, dv);
+		}else if(ia != 255){
+			_unpack565(d[i], &pr, &pg, &pb);
+			d[i] = _pack565(r + (pr * ia >> 8), g + (pg * ia >> 8), b + (pb * ia >> 8), dv);
+		}
+	}else if(a == 255){
+		d[i] = _pack565(r, g, b, dv);
+	}else if(a != 0){
+		d[i] = _blend565(d[i], r, g, b, a, dv);
+	}
+#else
+	unsigned char *p = (unsigned char *)(d + i); /*alpha字节保持原样*/
+	if(mode == BLIT_ADD){
+		if(a == 0) return;
+		if(!pm) { r = r * (a + 1) >> 8; g = g * (a + 1) >> 8; b = b * (a + 1) >> 8; }
+		r += p[2]; g += p[1]; b += p[0];
+		p[0] = (b > 255) ? 255 : b;
+		p[1] = (g > 255) ? 255 : g;
+		p[2] = (r > 255) ? 255 : r;
+	}else if(pm){
+		int ia = 255 - a;
+		if(ia == 0){
+			p[0] = b; p[1] = g; p[2] = r;
+		}else if(ia != 255){
+			p[0] = (unsigned char)(b + (p[0] * ia >> 8));
+			p[1] = (unsigned char)(g + (p[1] * ia >> 8));
+			p[2] = (unsigned char)(r + (p[2] * ia >> 8));
+		}
+	}else if(a == 255){
+		p[0] = b; p[1] = g; p[2] = r;
+	}else if(a != 0){
+		p[0] = (unsigned char)(p[0] + ((b - p[0]) * a >> 8));
+		p[1] = (unsigned char)(p[1] + ((g - p[1]) * a >> 8));
+		p[2] = (unsigned char)(p[2] + ((r - p[2]) * a >> 8));
+	}
+#endif
+}
+
+/*行函数的模板: type/mode/ga/fx都是常量, 展开后每个组合只剩自己的分支*/
+BLIT_INLINE void _blit_row(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c,
+	const int type, const int mode, const int ga, const int fx)
+{
+	const int pm = (type == FB_COLOR_RGBA_PREMUL) && (mode != BLIT_COPY);
+	const blit_ctx lc = *c; /*写目标可能和*c重叠, 拷一份让编译器把参数留在寄存器里*/
+	for(int i = 0; i < w; ++i){
+		int r, g, b, a;
+		_blit_fetch(s, i, &lc, type, &r, &g, &b, &a);
+		if((fx & BLIT_KEY) && (((r << 16) | (g << 8) | b) == lc.key)) continue;
+		if(mode == BLIT_COPY) a = 255;
+		if(fx & BLIT_TINT){
+			r = r * (((lc.tint >> 16) & 0xFF) + 1) >> 8;
+			g = g * (((lc.tint >> 8) & 0xFF) + 1) >> 8;
+			b = b * ((lc.tint & 0xFF) + 1) >> 8;
+		}
+		if(ga){
+			int k = lc.alpha + 1;
+			a = a * k >> 8;
+			if(pm) { r = r * k >> 8; g = g * k >> 8; b = b * k >> 8; }
+		}
+		_blit_store(d, i, &lc, r, g, b, a, pm, mode);
+	}
+}
+
+#define BLIT_DEFINE(type, mode, ga, fx) \
+static void _blit_##type##_##mode##_##ga##_##fx(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c) \
+{ _blit_row(d, s, w, c, FB_COLOR_##type, BLIT_##mode, ga, fx); }
+#define BLIT_ENTRY(type, mode, ga, fx)	[FB_COLOR_##type][BLIT_##mode][ga][fx] = _blit_##type##_##mode##_##ga##_##fx,
+
+#define BLIT_EACH_MODE(X, type, fx) \
+	X(type, COPY, 0, fx) X(type, COPY, 1, fx) X(type, OVER, 0, fx) \
+	X(type, OVER, 1, fx) X(type, ADD, 0, fx) X(type, ADD, 1, fx)
+/*只生成有意义的效果: 色键只用于RGB_8880, ALPHA_8的颜色本来就是参数*/
+#define BLIT_EACH(X) \
+	BLIT_EACH_MODE(X, RGB_8880, 0) BLIT_EACH_MODE(X, RGB_8880, 1) \
+	BLIT_EACH_MODE(X, RGB_8880, 2) BLIT_EACH_MODE(X, RGB_8880, 3) \
+	BLIT_EACH_MODE(X, RGBA_8888, 0) BLIT_EACH_MODE(X, RGBA_8888, 1) \
+	BLIT_EACH_MODE(X, RGBA_PREMUL, 0) BLIT_EACH_MODE(X, RGBA_PREMUL, 1) \
+	BLIT_EACH_MODE(X, INDEX_8, 0) BLIT_EACH_MODE(X, INDEX_8, 1) \
+	BLIT_EACH_MODE(X, ALPHA_8, 0)
 
-	int ix = 0; //image x
-	int iy = 0; //image y
-	int w = image->pixel_w; //draw width
-	int h = image->pixel_h; //draw height
+BLIT_EACH(BLIT_DEFINE)
 
-	if(x<0) {w+=x; ix-=x; x=0;}
-	if(y<0) {h+=y; iy-=y; y=0;}
-	
-	if(x+w > SCREEN_WIDTH) {
-		w = SCREEN_WIDTH - x;
+static blit_row_func blit_table[BLIT_TYPES][BLIT_MODES][2][BLIT_FX] = {
+	BLIT_EACH(BLIT_ENTRY)
+};
+
+/*------------------ 替换表里的常用组合 ------------------*/
+#ifdef FB_RENDER_565
+/*RGB_8880: 没有分支的转换, 编译器可以向量化*/
+static void _blit_8880_565(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	const unsigned int *sp = (const unsigned int *)s;
+	/*同一行的抖动每4个像素重复, 先算出每个位置加在r/b和g上的值*/
+	unsigned int add5[4], add6[4];
+	for(int i = 0; i < 4; ++i){
+		add5[i] = c->dither[(c->dx + i) & 3] >> 1;
+		add6[i] = c->dither[(c->dx + i) & 3] >> 2;
 	}
-	if(y+h > SCREEN_HEIGHT) {
-		h = SCREEN_HEIGHT - y;
+	for(int col = 0; col < w; ++col){
+		unsigned int p = sp[col];
+		unsigned int r = ((p >> 16) & 0xFF) + add5[col & 3];
+		unsigned int g = ((p >> 8) & 0xFF) + add6[col & 3];
+		unsigned int b = (p & 0xFF) + add5[col & 3];
+		r = (r > 255) ? 255 : r;
+		g = (g > 255) ? 255 : g;
+		b = (b > 255) ? 255 : b;
+		d[col] = (fb_pixel)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
 	}
-	if((w <= 0)||(h <= 0)) return;
+}
+
+/*不透明的调色板: 查转好的565表, 不抖动*/
+static void _blit_index_565(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	const fb_pixel *pal = c->pal565;
+	for(int col = 0; col < w; ++col) d[col] = pal[s[col]];
+}
 
-	int *buf = _begin_draw(x,y,w,h);
+/*字形: 在565里直接混合, 一次乘法*/
+static void _blit_a8_565(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	unsigned int cc = FB_PIXEL(c->color);
+	unsigned int fg = (cc | (cc << 16)) & 0x07E0F81F; /*g移到高16位, r和b留在低16位, 中间有空位*/
+	for(int col = 0; col < w; ++col){
+		unsigned int a = s[col];
+		if(a == 0) continue;
+		if(a == 255) { d[col] = cc; continue; }
+		unsigned int bg = (d[col] | ((unsigned int)d[col] << 16)) & 0x07E0F81F;
+		unsigned int a5 = (a + 4) >> 3; /*0..32, 乘完每个分量不超过自己的空位*/
+		bg = ((fg * a5 + bg * (32 - a5)) >> 5) & 0x07E0F81F;
+		d[col] = (fb_pixel)(bg | (bg >> 16));
+	}
+}
+#else
+static void _blit_copy_8888(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	memcpy(d, s, (unsigned int)(w * 4));
+}
+
+/*不透明的调色板: 查表, 一次4个像素*/
+static void _blit_index_8888(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	const unsigned int *pal = c->palette;
+	int col = 0;
+	for(; col + 4 <= w; col += 4){
+		unsigned int c0 = pal[s[col]], c1 = pal[s[col+1]];
+		unsigned int c2 = pal[s[col+2]], c3 = pal[s[col+3]];
+		d[col] = c0; d[col+1] = c1; d[col+2] = c2; d[col+3] = c3;
+	}
+	for(; col < w; ++col) d[col] = pal[s[col]];
+}
+
+/*RGBA_8888混合: p + ((s-p)*a>>8) 等于 (p*(256-a) + s*a)>>8, 16位装得下;
+ *a==255的像素直接取源, 目标的alpha字节保持原样, 结果和模板逐位相同*/
+#if defined(BLIT_USE_NEON)
+static void _blit_rgba_over_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const uint16x8_t k256 = vdupq_n_u16(256);
+	const uint8x8_t k255 = vdup_n_u8(255);
+	for(; col + 8 <= w; col += 8){
+		uint8x8x4_t sv = vld4_u8(s + col * 4); /*分开成B,G,R,A四个平面*/
+		uint8x8x4_t dv = vld4_u8((const uint8_t *)(d + col));
+		uint16x8_t a = vmovl_u8(sv.val[3]);
+		uint16x8_t ia = vsubq_u16(k256, a);
+		uint8x8_t opaque = vceq_u8(sv.val[3], k255);
+		for(int k = 0; k < 3; ++k){
+			uint16x8_t t = vmulq_u16(vmovl_u8(dv.val[k]), ia);
+			t = vmlaq_u16(t, vmovl_u8(sv.val[k]), a);
+			dv.val[k] = vbsl_u8(opaque, sv.val[k], vshrn_n_u16(t, 8));
+		}
+		vst4_u8((uint8_t *)(d + col), dv);
+	}
+	_blit_row(d + col, s + col * 4, w - col, c, FB_COLOR_RGBA_8888, BLIT_OVER, 0, 0);
+}
+
+/*RGB_8880淡入淡出: 全局透明度是常数, 公式同上*/
+static void _blit_rgb_fade_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const uint16x8_t a = vdupq_n_u16(c->alpha), ia = vdupq_n_u16(256 - c->alpha);
+	for(; col + 8 <= w; col += 8){
+		uint8x8x4_t sv = vld4_u8(s + col * 4);
+		uint8x8x4_t dv = vld4_u8((const uint8_t *)(d + col));
+		for(int k = 0; k < 3; ++k){
+			uint16x8_t t = vmulq_u16(vmovl_u8(dv.val[k]), ia);
+			dv.val[k] = vshrn_n_u16(vmlaq_u16(t, vmovl_u8(sv.val[k]), a), 8);
+		}
+		vst4_u8((uint8_t *)(d + col), dv);
+	}
+	_blit_row(d + col, s + col * 4, w - col, c, FB_COLOR_RGB_8880, BLIT_COPY, 1, 0);
+}
+#define BLIT_RGBA_OVER_SIMD	_blit_rgba_over_simd
+#define BLIT_RGB_FADE_SIMD	_blit_rgb_fade_simd
+
+#if defined(__aarch64__) /*vqtbl4q/vqtbx4q只有AArch64有*/
+/*一次查表指令最多查64字节, 256项的平面分4段: 第一段查不到的得0, 后面三段查不到的保持原值*/
+BLIT_INLINE uint8x16_t _pal_lookup(const unsigned char *plane, uint8x16_t idx)
+{
+	const uint8x16_t k64 = vdupq_n_u8(64);
+	uint8x16x4_t t;
+	uint8x16_t v;
+	for(int k = 0; k < 4; ++k) t.val[k] = vld1q_u8(plane + k * 16);
+	v = vqtbl4q_u8(t, idx);
+	for(int seg = 64; seg < 256; seg += 64){
+		idx = vsubq_u8(idx, k64);
+		for(int k = 0; k < 4; ++k) t.val[k] = vld1q_u8(plane + seg + k * 16);
+		v = vqtbx4q_u8(v, t, idx);
+	}
+	return v;
+}
+
+static void _pal_planes(const unsigned int *pal, unsigned char *planes)
+{
+	for(int i = 0; i < 256; i += 16){
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(pal + i));
+		for(int k = 0; k < 4; ++k) vst1q_u8(planes + k * 256 + i, v.val[k]);
+	}
+}
+
+/*不透明的调色板: 一次16个像素, 查B,G,R三个平面再交织写回*/
+static void _blit_index_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const unsigned char *pl = c->planes;
+	for(; col + 16 <= w; col += 16){
+		uint8x16_t idx = vld1q_u8(s + col);
+		uint8x16x4_t v;
+		v.val[0] = _pal_lookup(pl, idx);
+		v.val[1] = _pal_lookup(pl + 256, idx);
+		v.val[2] = _pal_lookup(pl + 512, idx);
+		v.val[3] = vdupq_n_u8(255); /*只有全部不透明的调色板会走到这里*/
+		vst4q_u8((uint8_t *)(d + col), v);
+	}
+	_blit_index_8888(d + col, s + col, w - col, c);
+}
+
+/*半透明的调色板: 查出四个平面后和_blit_rgba_over_simd一样混合*/
+static void _blit_index_over_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const unsigned char *pl = c->planes;
+	const uint16x8_t k256 = vdupq_n_u16(256);
+	for(; col + 16 <= w; col += 16){
+		uint8x16_t idx = vld1q_u8(s + col);
+		uint8x16_t a = _pal_lookup(pl + 768, idx);
+		uint8x16_t opaque = vceqq_u8(a, vdupq_n_u8(255));
+		uint16x8_t alo = vmovl_u8(vget_low_u8(a)), ahi = vmovl_u8(vget_high_u8(a));
+		uint16x8_t ialo = vsubq_u16(k256, alo), iahi = vsubq_u16(k256, ahi);
+		uint8x16x4_t dv = vld4q_u8((const uint8_t *)(d + col));
+		for(int k = 0; k < 3; ++k){
+			uint8x16_t sv = _pal_lookup(pl + k * 256, idx);
+			uint16x8_t lo = vmulq_u16(vmovl_u8(vget_low_u8(dv.val[k])), ialo);
+			uint16x8_t hi = vmulq_u16(vmovl_u8(vget_high_u8(dv.val[k])), iahi);
+			lo = vmlaq_u16(lo, vmovl_u8(vget_low_u8(sv)), alo);
+			hi = vmlaq_u16(hi, vmovl_u8(vget_high_u8(sv)), ahi);
+			dv.val[k] = vbslq_u8(opaque, sv, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		}
+		vst4q_u8((uint8_t *)(d + col), dv);
+	}
+	_blit_row(d + col, s + col, w - col, c, FB_COLOR_INDEX_8, BLIT_OVER, 0, 0);
+}
+#define BLIT_INDEX_SIMD	_blit_index_simd
+#define BLIT_INDEX_OVER_SIMD	_blit_index_over_simd
+#endif
+#elif defined(BLIT_USE_SSE2)
+static void _blit_rgba_over_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k256 = _mm_set1_epi16(256);
+	const __m128i amask = _mm_set1_epi32(0xFF000000);
+	for(; col + 4 <= w; col += 4){
+		__m128i sp = _mm_loadu_si128((const __m128i *)(s + col * 4));
+		__m128i dp = _mm_loadu_si128((const __m128i *)(d + col));
+		__m128i slo = _mm_unpacklo_epi8(sp, zero), shi = _mm_unpackhi_epi8(sp, zero);
+		__m128i dlo = _mm_unpacklo_epi8(dp, zero), dhi = _mm_unpackhi_epi8(dp, zero);
+		/*每个像素的alpha复制到4个通道*/
+		__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+		__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+		__m128i rlo = _mm_add_epi16(_mm_mullo_epi16(dlo, _mm_sub_epi16(k256, alo)), _mm_mullo_epi16(slo, alo));
+		__m128i rhi = _mm_add_epi16(_mm_mullo_epi16(dhi, _mm_sub_epi16(k256, ahi)), _mm_mullo_epi16(shi, ahi));
+		__m128i res = _mm_packus_epi16(_mm_srli_epi16(rlo, 8), _mm_srli_epi16(rhi, 8));
+		__m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(sp, amask), amask);
+		res = _mm_or_si128(_mm_and_si128(opaque, sp), _mm_andnot_si128(opaque, res));
+		res = _mm_or_si128(_mm_andnot_si128(amask, res), _mm_and_si128(amask, dp));
+		_mm_storeu_si128((__m128i *)(d + col), res);
+	}
+	_blit_row(d + col, s + col * 4, w - col, c, FB_COLOR_RGBA_8888, BLIT_OVER, 0, 0);
+}
+
+/*RGB_8880淡入淡出: 全局透明度是常数, 公式同上*/
+static void _blit_rgb_fade_simd(fb_pixel *d, const unsigned char *s, int w, const blit_ctx *c)
+{
+	int col = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i a = _mm_set1_epi16(c->alpha), ia = _mm_set1_epi16(256 - c->alpha);
+	const __m128i amask = _mm_set1_epi32(0xFF000000);
+	for(; col + 4 <= w; col += 4){
+		__m128i sp = _mm_loadu_si128((const __m128i *)(s + col * 4));
+		__m128i dp = _mm_loadu_si128((const __m128i *)(d + col));
+		__m128i rlo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(dp, zero), ia), _mm_mullo_epi16(_mm_unpacklo_epi8(sp, zero), a));
+		__m128i rhi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(dp, zero), ia), _mm_mullo_epi16(_mm_unpackhi_epi8(sp, zero), a));
+		__m128i res = _mm_packus_epi16(_mm_srli_epi16(rlo, 8), _mm_srli_epi16(rhi, 8));
+		res = _mm_or_si128(_mm_andnot_si128(amask, res), _mm_and_si128(amask, dp));
+		_mm_storeu_si128((__m128i *)(d + col), res);
+	}
+	_blit_row(d + col, s + col * 4, w - col, c, FB_COLOR_RGB_8880, BLIT_COPY, 1, 0);
+}
+#define BLIT_RGBA_OVER_SIMD	_blit_rgba_over_simd
+#define BLIT_RGB_FADE_SIMD	_blit_rgb_fade_simd
+#endif
+#endif
+
+static void _blit_init(void)
+{
+#ifdef FB_RENDER_565
+	blit_table[FB_COLOR_RGB_8880][BLIT_COPY][0][0] = _blit_8880_565;
+	blit_table[FB_COLOR_INDEX_8][BLIT_COPY][0][0] = _blit_index_565;
+	blit_table[FB_COLOR_ALPHA_8][BLIT_OVER][0][0] = _blit_a8_565;
+#else
+	blit_table[FB_COLOR_RGB_8880][BLIT_COPY][0][0] = _blit_copy_8888;
+	blit_table[FB_COLOR_INDEX_8][BLIT_COPY][0][0] = _blit_index_8888;
+#ifdef BLIT_RGBA_OVER_SIMD
+	blit_table[FB_COLOR_RGBA_8888][BLIT_OVER][0][0] = BLIT_RGBA_OVER_SIMD;
+	blit_table[FB_COLOR_RGB_8880][BLIT_COPY][1][0] = BLIT_RGB_FADE_SIMD;
+#endif
+#ifdef BLIT_INDEX_SIMD
+	blit_table[FB_COLOR_INDEX_8][BLIT_COPY][0][0] = BLIT_INDEX_SIMD;
+	blit_table[FB_COLOR_INDEX_8][BLIT_OVER][0][0] = BLIT_INDEX_OVER_SIMD;
+#endif
+#endif
+}
+
+static int _palette_opaque(const unsigned int *pal)
+{
+	for(int i = 0; i < 256; ++i){
+		if((pal[i] >> 24) != 255) return 0;
+	}
+	return 1;
+}
+
+/*画到d(每行stride个像素), (sx,sy)是d在屏幕上的位置, 决定抖动*/
+static void _blit_to(fb_pixel *d, int stride, int sx, int sy, fb_image *image, int ix, int iy,
+	int w, int h, int color, int alpha, int flags, int key)
+{
+	static int ready = 0;
+	int type = image->color_type;
+	int mode = (flags & FB_DRAW_ADD) ? BLIT_ADD : BLIT_OVER;
+	int fx = flags & (BLIT_TINT | BLIT_KEY);
+	blit_ctx c;
+
+	if(!ready) { _blit_init(); ready = 1; }
+	if((type <= 0)||(type >= BLIT_TYPES)) return;
+	if(alpha <= 0) return;
+	if(alpha > 255) alpha = 255;
+	if(type != FB_COLOR_RGB_8880) fx &= ~BLIT_KEY;
+	if(type == FB_COLOR_ALPHA_8) fx = 0;
+
+	/*不透明的源, 混合就是覆盖*/
+	if((mode == BLIT_OVER) && ((type == FB_COLOR_RGB_8880) ||
+		((type == FB_COLOR_INDEX_8) && _palette_opaque(image->palette)))) mode = BLIT_COPY;
+
+	c.color = color;
+	c.alpha = alpha;
+	c.tint = color & 0xFFFFFF;
+	c.key = key & 0xFFFFFF;
+	c.palette = image->palette;
+	int bpp = ((type == FB_COLOR_ALPHA_8)||(type == FB_COLOR_INDEX_8)) ? 1 : 4;
+	const unsigned char *src = (const unsigned char *)image->content + iy * image->line_byte + ix * bpp;
+	blit_row_func f = blit_table[type][mode][alpha != 255][fx];
+
+#ifdef FB_RENDER_565
+	fb_pixel pal565[256];
+	c.dx = sx;
+	if(type == FB_COLOR_INDEX_8){
+		for(int i = 0; i < 256; ++i) pal565[i] = FB_PIXEL(image->palette[i]);
+		c.pal565 = pal565;
+	}
+#endif
+#ifdef BLIT_INDEX_SIMD
+	unsigned char planes[4*256];
+	if((f == BLIT_INDEX_SIMD)||(f == BLIT_INDEX_OVER_SIMD)){
+		_pal_planes(image->palette, planes);
+		c.planes = planes;
+	}
+#endif
+	for(int row = 0; row < h; ++row){
+#ifdef FB_RENDER_565
+		c.dither = dither_on ? bayer4[(sy + row) & 3] : bayer_off;
+#endif
+		f(d, src, w, &c);
+		d += stride;
+		src += image->line_byte;
+	}
+}
+
+/*把图片的(ix,iy,w,h)区域画到dst, alpha/flags/key同fb_draw_image_ex, 调用者负责裁剪和登记脏区*/
+static void _blit_image_ex(char *dst, fb_image *image, int ix, int iy, int w, int h, int color,
+	int alpha, int flags, int key)
+{
+	int off = (fb_pixel *)dst - DRAW_BUF;
+	_blit_to((fb_pixel *)dst, SCREEN_WIDTH, off % SCREEN_WIDTH, off / SCREEN_WIDTH,
+		image, ix, iy, w, h, color, alpha, flags, key);
+}
+
+/*把图片的(ix,iy,w,h)区域画到dst, 调用者负责裁剪和登记脏区*/
+static void _blit_image(char *dst, fb_image *image, int ix, int iy, int w, int h, int color)
+{
+	_blit_image_ex(dst, image, ix, iy, w, h, color, 255, 0, 0);
+}
+
+void fb_set_dither(int on)
+{
+#ifdef FB_RENDER_565
+	dither_on = on;
+#endif
+}
+
+/*裁剪到屏幕内, 返回0表示完全不可见*/
+static int _clip_image(int *x, int *y, fb_image *image, int *ix, int *iy, int *w, int *h)
+{
+	*ix = 0; //image x
+	*iy = 0; //image y
+	*w = image->pixel_w; //draw width
+	*h = image->pixel_h; //draw height
+
+	if(*x<0) {*w+=*x; *ix-=*x; *x=0;}
+	if(*y<0) {*h+=*y; *iy-=*y; *y=0;}
+
+	if(*x+*w > SCREEN_WIDTH) {
+		*w = SCREEN_WIDTH - *x;
+	}
+	if(*y+*h > SCREEN_HEIGHT) {
+		*h = SCREEN_HEIGHT - *y;
+	}
+	return ((*w > 0)&&(*h > 0));
+}
+
+void fb_draw_image(int x, int y, fb_image *image, int color)
+{
+	int ix, iy, w, h;
+
+	if(image == NULL) return;
+	if(!_clip_image(&x, &y, image, &ix, &iy, &w, &h)) return;
+
+	fb_pixel *buf = _begin_draw(x,y,w,h);
 /*---------------------------------------------------------------*/
 	char *dst = (char *)(buf + y*SCREEN_WIDTH + x);
-	char *src; //不同的图像颜色格式定位不同
 /*---------------------------------------------------------------*/
+	_blit_image(dst, image, ix, iy, w, h, color);
+	return;
+}
 
-	int alpha;
-	int ww;
+void fb_draw_image_ex(int x, int y, fb_image *image, int color, int alpha, int flags, int key)
+{
+	int ix, iy, w, h;
 
-	if(image->color_type == FB_COLOR_RGB_8880) /*lab3: jpg*/
-	{
-		/* previously (kept as comment):
-		printf("you need implement fb_draw_image() FB_COLOR_RGB_8880\n"); exit(0);
-		*/
-		for(int row = 0; row < h; ++row){
-			char *drow = dst + row * (SCREEN_WIDTH * 4);
-			src = image->content + (iy + row) * image->line_byte + ix * 4;
-			memcpy(drow, src, (unsigned int)(w * 4));
-		}
+	if((image == NULL)||(alpha <= 0)) return;
+	if(!_clip_image(&x, &y, image, &ix, &iy, &w, &h)) return;
 
-		return;
+	fb_pixel *buf = _begin_draw(x,y,w,h);
+	_blit_image_ex((char *)(buf + y*SCREEN_WIDTH + x), image, ix, iy, w, h, color, alpha, flags, key);
+}
+
+/*a和b的n个字节按t(1..254)混合: (a*(256-t) + b*t)>>8, 和先画a再按不透明度t画b的结果相同*/
+static void _lerp_bytes(unsigned char *p, const unsigned char *a, const unsigned char *b, int n, int t)
+{
+	int i = 0;
+#if defined(BLIT_USE_NEON)
+	const uint8x8_t ka = vdup_n_u8(256 - t), kb = vdup_n_u8(t);
+	for(; i + 16 <= n; i += 16){
+		uint8x16_t va = vld1q_u8(a + i), vb = vld1q_u8(b + i);
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), ka), vget_low_u8(vb), kb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), ka), vget_high_u8(vb), kb);
+		vst1q_u8(p + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
 	}
-	else if(image->color_type == FB_COLOR_RGBA_8888) /*lab3: png*/
-	{
-		/* previously (kept as comment):
-		printf("you need implement fb_draw_image() FB_COLOR_RGBA_8888\n"); exit(0);
-		*/
-		for(int row = 0; row < h; ++row){
-			char *drow = dst + row * (SCREEN_WIDTH * 4);
-			src = image->content + (iy + row) * image->line_byte + ix * 4;
-			for(int col = 0; col < w; ++col){
-				unsigned char B1 = (unsigned char)src[col*4 + 0];
-				unsigned char G1 = (unsigned char)src[col*4 + 1];
-				unsigned char R1 = (unsigned char)src[col*4 + 2];
-				unsigned char A1 = (unsigned char)src[col*4 + 3];
-				unsigned char *p = (unsigned char*)(drow + col*4);
-				if(A1 == 0){
-					// fully transparent, do nothing
-				}else if(A1 == 255){
-					p[0] = B1; p[1] = G1; p[2] = R1; /* keep alpha as-is or set opaque */
-					/* p[3] = 0xFF; */
-				}else{
-					p[0] = (unsigned char)(p[0] + (((int)B1 - (int)p[0]) * A1 >> 8));
-					p[1] = (unsigned char)(p[1] + (((int)G1 - (int)p[1]) * A1 >> 8));
-					p[2] = (unsigned char)(p[2] + (((int)R1 - (int)p[2]) * A1 >> 8));
-				}
-			}
-		}
+#elif defined(BLIT_USE_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ka = _mm_set1_epi16(256 - t), kb = _mm_set1_epi16(t);
+	for(; i + 16 <= n; i += 16){
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i)), vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), ka), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), kb));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), ka), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), kb));
+		_mm_storeu_si128((__m128i *)(p + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+	for(; i < n; ++i) p[i] = (unsigned char)((a[i] * (256 - t) + b[i] * t) >> 8);
+}
 
-		return;
+/*a和b的一行按t(1..254)混合到渲染缓冲区*/
+#ifdef FB_RENDER_565
+static void _crossfade_row(fb_pixel *d, const unsigned char *a, const unsigned char *b, int w, int t,
+	const unsigned char *dither, int dx)
+{
+	for(int i = 0; i < w; ++i, a += 4, b += 4){
+		int dv = dither[(dx + i) & 3];
+		d[i] = _pack565((a[2] * (256 - t) + b[2] * t) >> 8, (a[1] * (256 - t) + b[1] * t) >> 8,
+			(a[0] * (256 - t) + b[0] * t) >> 8, dv);
 	}
-	else if(image->color_type == FB_COLOR_ALPHA_8) /*lab3: font*/
-	{
-		/* previously (kept as comment):
-		printf("you need implement fb_draw_image() FB_COLOR_ALPHA_8\n"); exit(0);
-		*/
-		unsigned char Rc = (unsigned char)((color >> 16) & 0xFF);
-		unsigned char Gc = (unsigned char)((color >> 8) & 0xFF);
-		unsigned char Bc = (unsigned char)(color & 0xFF);
-		for(int row = 0; row < h; ++row){
-			char *drow = dst + row * (SCREEN_WIDTH * 4);
-			src = image->content + (iy + row) * image->line_byte + ix; // 1 byte per pixel alpha
-			for(int col = 0; col < w; ++col){
-				unsigned char A1 = (unsigned char)src[col];
-				unsigned char *p = (unsigned char*)(drow + col*4);
-				if(A1 == 0){
-					// fully transparent, do nothing
-				}else if(A1 == 255){
-					p[0] = Bc; p[1] = Gc; p[2] = Rc; /* p[3] = 0xFF; */
-				}else{
-					p[0] = (unsigned char)(p[0] + (((int)Bc - (int)p[0]) * A1 >> 8));
-					p[1] = (unsigned char)(p[1] + (((int)Gc - (int)p[1]) * A1 >> 8));
-					p[2] = (unsigned char)(p[2] + (((int)Rc - (int)p[2]) * A1 >> 8));
-				}
-			}
-		}
+}
+#else
+static void _crossfade_row(fb_pixel *d, const unsigned char *a, const unsigned char *b, int w, int t)
+{
+	_lerp_bytes((unsigned char *)d, a, b, w * 4, t);
+}
+#endif
+
+int fb_crossfade_image(fb_image *dst, fb_image *a, fb_image *b, int t)
+{
+	fb_image *src;
+	int row;
+
+	if((dst == NULL)||(a == NULL)||(b == NULL)) return -1;
+	if((a->color_type != dst->color_type)||(b->color_type != dst->color_type)||
+		(dst->color_type == FB_COLOR_ALPHA_8)||(dst->color_type == FB_COLOR_INDEX_8)||
+		(a->pixel_w != dst->pixel_w)||(a->pixel_h != dst->pixel_h)||
+		(b->pixel_w != dst->pixel_w)||(b->pixel_h != dst->pixel_h)) return -1;
+	src = (t <= 0) ? a : (t >= 255) ? b : NULL;
+	for(row = 0; row < dst->pixel_h; ++row){
+		unsigned char *d = (unsigned char *)dst->content + row*dst->line_byte;
+		if(src != NULL) memcpy(d, src->content + row*src->line_byte, dst->pixel_w*4);
+		else _lerp_bytes(d, (unsigned char *)a->content + row*a->line_byte,
+			(unsigned char *)b->content + row*b->line_byte, dst->pixel_w*4, t);
+	}
+	return 0;
+}
+
+void fb_draw_crossfade(int x, int y, fb_image *a, fb_image *b, int t)
+{
+	int ix, iy, w, h;
 
+	if((a == NULL)||(b == NULL)) return;
+	if(t <= 0) { fb_draw_image(x, y, a, 0); return; }
+	if(t >= 255) { fb_draw_image(x, y, b, 0); return; }
+	if((a->color_type != FB_COLOR_RGB_8880)||(b->color_type != FB_COLOR_RGB_8880)||
+		(a->pixel_w != b->pixel_w)||(a->pixel_h != b->pixel_h)) {
+		/*不能一遍混合的, 分两遍画*/
+		fb_draw_image(x, y, a, 0);
+		fb_draw_image_ex(x, y, b, 0, t, 0, 0);
 		return;
 	}
+	if(!_clip_image(&x, &y, a, &ix, &iy, &w, &h)) return;
+
+	fb_pixel *d = (fb_pixel *)_begin_draw(x, y, w, h) + y*SCREEN_WIDTH + x;
+	const unsigned char *pa = (const unsigned char *)a->content + iy*a->line_byte + ix*4;
+	const unsigned char *pb = (const unsigned char *)b->content + iy*b->line_byte + ix*4;
+	for(int row = 0; row < h; ++row){
+#ifdef FB_RENDER_565
+		_crossfade_row(d, pa, pb, w, t, dither_on ? bayer4[(y + row) & 3] : bayer_off, x);
+#else
+		_crossfade_row(d, pa, pb, w, t);
+#endif
+		d += SCREEN_WIDTH;
+		pa += a->line_byte;
+		pb += b->line_byte;
+	}
+}
+
+void fb_draw_image_scaled_clip(int x, int y, int w, int h, fb_image *image, int sx, int sy, int sw, int sh,
+	int clip_x, int clip_y, int clip_w, int clip_h)
+{
+	int cx1, cy1, cx2, cy2, stepx, stepy, fx0, fy;
+
+	if((image == NULL)||(image->color_type != FB_COLOR_RGB_8880)) return;
+	if((w <= 0)||(h <= 0)||(sw <= 0)||(sh <= 0)) return;
+	if((sx < 0)||(sy < 0)||(sx+sw > image->pixel_w)||(sy+sh > image->pixel_h)) return;
+
+	/*目标矩形和裁剪矩形, 屏幕求交*/
+	cx1 = (x > clip_x) ? x : clip_x;
+	cy1 = (y > clip_y) ? y : clip_y;
+	cx2 = (x+w < clip_x+clip_w) ? x+w : clip_x+clip_w;
+	cy2 = (y+h < clip_y+clip_h) ? y+h : clip_y+clip_h;
+	if(cx1 < 0) cx1 = 0;
+	if(cy1 < 0) cy1 = 0;
+	if(cx2 > SCREEN_WIDTH) cx2 = SCREEN_WIDTH;
+	if(cy2 > SCREEN_HEIGHT) cy2 = SCREEN_HEIGHT;
+	if((cx1 >= cx2)||(cy1 >= cy2)) return;
+
+	fb_pixel *buf = _begin_draw(cx1, cy1, cx2-cx1, cy2-cy1);
+/*---------------------------------------------------------------*/
+	/*16.16定点, 取目标像素中心对应的源像素*/
+	stepx = ((long long)sw << 16) / w;
+	stepy = ((long long)sh << 16) / h;
+	fx0 = (cx1 - x)*stepx + stepx/2;
+	fy = (cy1 - y)*stepy + stepy/2;
+	for(int j = cy1; j < cy2; ++j, fy += stepy){
+		fb_pixel *dst = buf + j*SCREEN_WIDTH + cx1;
+		int *src = (int *)(image->content + (sy + (fy >> 16))*image->line_byte) + sx;
+#ifdef FB_RENDER_565
+		const unsigned char *dm = bayer4[j & 3];
+		for(int i = 0, fx = fx0; i < cx2-cx1; ++i, fx += stepx){
+			unsigned int c = src[fx >> 16];
+			dst[i] = _pack565((c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF, dither_on ? dm[(cx1 + i) & 3] : 0);
+		}
+#else
+		if(sw == w) {
+			memcpy(dst, src + (cx1 - x), (cx2-cx1)*4);
+			continue;
+		}
+		for(int i = 0, fx = fx0; i < cx2-cx1; ++i, fx += stepx){
+			dst[i] = src[fx >> 16];
+		}
+#endif
+	}
 /*---------------------------------------------------------------*/
 	return;
 }
 
+void fb_draw_image_scaled(int x, int y, int w, int h, fb_image *image, int sx, int sy, int sw, int sh)
+{
+	fb_draw_image_scaled_clip(x, y, w, h, image, sx, sy, sw, sh, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+int fb_draw_jpeg_image(int x, int y, int w, int h, char *file, int sx, int sy, int sw, int sh)
+{
+	if((w <= 0)||(h <= 0)) return -1;
+#ifdef FB_RENDER_565
+	/*先解码到这一帧的临时图片, 再转换成565*/
+	fb_image *tmp = fb_new_frame_image(FB_COLOR_RGB_8880, w, h);
+	if(tmp == NULL) return -1;
+	if(fb_decode_jpeg_into(file, sx, sy, sw, sh, tmp, 0, 0, w, h) < 0) return -1;
+	fb_draw_image(x, y, tmp, 0);
+	return 0;
+#else
+	fb_image screen;
+	screen.color_type = FB_COLOR_RGB_8880;
+	screen.pixel_w = SCREEN_WIDTH;
+	screen.pixel_h = SCREEN_HEIGHT;
+	screen.line_byte = SCREEN_WIDTH*4;
+	screen.content = (char *)_begin_draw(x,y,w,h);
+	return fb_decode_jpeg_into(file, sx, sy, sw, sh, &screen, x, y, w, h);
+#endif
+}
+
+fb_pixel * fb_draw_buffer(int x, int y, int w, int h)
+{
+	return (fb_pixel *)_begin_draw(x, y, w, h);
+}
+
 void fb_draw_border(int x, int y, int w, int h, int color)
 {
 	if(w<=0 || h<=0) return;
@@ -326,20 +1045,261 @@ void fb_draw_border(int x, int y, int w, int h, int color)
 /** draw a text string **/
 void fb_draw_text(int x, int y, char *text, int font_size, int color)
 {
-	fb_image *img;
-	fb_font_info info;
-	int i=0;
-	int len = strlen(text);
-	while(i < len)
+	const fb_glyph *g;
+	unsigned int ucs4;
+	int n;
+
+	while(*text)
 	{
-		img = fb_read_font_image(text+i, font_size, &info);
-		if(img == NULL) break;
-		fb_draw_image(x+info.left, y-info.top, img, color);
-		fb_free_image(img);
+		n = fb_utf8_decode(text, &ucs4);
+		if(n == 0) break;
+		g = fb_get_glyph(ucs4, font_size);
+		if(g == NULL) break;
+		fb_draw_image(x+g->left, y-g->top, g->image, color);
+
+		x += g->advance_x;
+		text += n;
+	}
+	return;
+}
 
-		x += info.advance_x;
-		i += info.bytes;
+/** draw a static label from the text run cache **/
+void fb_draw_label(int x, int y, char *text, int font_size, int color)
+{
+	const fb_text_run *run = fb_get_text_run(text, font_size);
+	if(run == NULL) { /*太大或者没有可见的字*/
+		fb_draw_text(x, y, text, font_size, color);
+		return;
+	}
+	fb_draw_image(x+run->x, y+run->y, run->image, color);
+}
+
+/** draw a cached layout: one damage merge, then plain blits **/
+void fb_draw_layout(int x, int y, const fb_text_layout *layout, int color)
+{
+	int i, gx, gy, ix, iy, w, h;
+	fb_pixel *buf;
+
+	if((layout == NULL)||(layout->item_num == 0)) return;
+
+	/*整个布局只登记一次脏区, 超出屏幕的部分由_check_area裁掉*/
+	buf = _begin_draw(x+layout->x1, y+layout->y1,
+		layout->x2-layout->x1, layout->y2-layout->y1);
+	for(i=0; i<layout->item_num; ++i)
+	{
+		const fb_layout_item *it = &layout->items[i];
+		gx = x + it->x;
+		gy = y + it->y;
+		if(!_clip_image(&gx, &gy, it->glyph->image, &ix, &iy, &w, &h)) continue;
+		_blit_image((char *)(buf + gy*SCREEN_WIDTH + gx), it->glyph->image, ix, iy, w, h, color);
 	}
 	return;
 }
 
+/*======================================================================*/
+/* 覆盖层精灵: 渲染缓冲区里从来没有精灵, 它本身就是精灵下面保存的像素.
+ * 送屏时先用它恢复旧位置, 再把精灵合成到一小块缓冲区里直接写屏幕,
+ * 不读屏幕, 也不用重画下面的画面 */
+struct fb_sprite {
+	int used;
+	int visible;
+	int dirty; /*移动/显示/换图以后还没送屏*/
+	fb_image *image;
+	int hot_x, hot_y;
+	int x, y;
+	struct area shown; /*屏幕上现在画着精灵的区域, x2<=x1是没有*/
+	fb_pixel *buf; /*合成用, 图片大小*/
+	int buf_size;
+};
+static struct fb_sprite sprites[FB_SPRITE_MAX];
+static struct area sprite_erase[FB_SPRITE_MAX]; /*释放了的精灵还留在屏幕上的区域*/
+static int sprite_erase_num = 0;
+
+static int _sprite_rect(struct fb_sprite *s, struct area *pa)
+{
+	pa->x1 = s->x - s->hot_x;
+	pa->y1 = s->y - s->hot_y;
+	pa->x2 = pa->x1 + s->image->pixel_w;
+	pa->y2 = pa->y1 + s->image->pixel_h;
+	if(pa->x1 < 0) pa->x1 = 0;
+	if(pa->y1 < 0) pa->y1 = 0;
+	if(pa->x2 > SCREEN_WIDTH) pa->x2 = SCREEN_WIDTH;
+	if(pa->y2 > SCREEN_HEIGHT) pa->y2 = SCREEN_HEIGHT;
+	return (pa->x2 > pa->x1) && (pa->y2 > pa->y1);
+}
+
+static int _area_overlap(const struct area *a, const struct area *b)
+{
+	return (a->x1 < b->x2) && (b->x1 < a->x2) && (a->y1 < b->y2) && (b->y1 < a->y2);
+}
+
+/*旧位置从渲染缓冲区恢复, keep里面马上要重新合成的部分不动, 免得闪一下*/
+static void _sprite_restore(const struct area *old, const struct area *keep)
+{
+	struct area a;
+	if((keep == NULL) || !_area_overlap(old, keep)) {
+		_copy_area(LCD_FB_BUF, DRAW_BUF, old);
+		return;
+	}
+	a = *old; /*上面*/
+	a.y2 = keep->y1;
+	if(a.y2 > a.y1) _copy_area(LCD_FB_BUF, DRAW_BUF, &a);
+	a = *old; /*下面*/
+	a.y1 = keep->y2;
+	if(a.y2 > a.y1) _copy_area(LCD_FB_BUF, DRAW_BUF, &a);
+	a = *old; /*中间的左右两边*/
+	if(keep->y1 > a.y1) a.y1 = keep->y1;
+	if(keep->y2 < a.y2) a.y2 = keep->y2;
+	a.x2 = keep->x1;
+	if(a.x2 > a.x1) _copy_area(LCD_FB_BUF, DRAW_BUF, &a);
+	a.x1 = keep->x2;
+	a.x2 = old->x2;
+	if(a.x2 > a.x1) _copy_area(LCD_FB_BUF, DRAW_BUF, &a);
+}
+
+/*pa区域: 下面的画面加上所有和它相交的精灵(后建的在上面), 写到屏幕*/
+static void _sprite_compose(struct fb_sprite *s, const struct area *pa)
+{
+	int w = pa->x2 - pa->x1, h = pa->y2 - pa->y1;
+	struct area r, c;
+
+	for(int row = 0; row < h; ++row)
+		memcpy(s->buf + row*w, DRAW_BUF + (pa->y1+row)*SCREEN_WIDTH + pa->x1, w*sizeof(fb_pixel));
+	for(int i = 0; i < FB_SPRITE_MAX; ++i) {
+		struct fb_sprite *t = &sprites[i];
+		if(!t->used || !t->visible) continue;
+		if(!_sprite_rect(t, &r) || !_area_overlap(&r, pa)) continue;
+		c.x1 = (r.x1 > pa->x1) ? r.x1 : pa->x1;
+		c.y1 = (r.y1 > pa->y1) ? r.y1 : pa->y1;
+		c.x2 = (r.x2 < pa->x2) ? r.x2 : pa->x2;
+		c.y2 = (r.y2 < pa->y2) ? r.y2 : pa->y2;
+		_blit_to(s->buf + (c.y1-pa->y1)*w + (c.x1-pa->x1), w, c.x1, c.y1, t->image,
+			c.x1 - (t->x - t->hot_x), c.y1 - (t->y - t->hot_y), c.x2-c.x1, c.y2-c.y1, 0, 255, 0, 0);
+	}
+	_copy_rect(LCD_FB_BUF, s->buf, w, pa);
+}
+
+/*fb_update送屏时调用; scene是这次从渲染缓冲区复制过的区域*/
+/*scene这部分画面刚送屏, 盖掉的精灵在_sprite_present里重新合成*/
+static void _sprite_cover(const struct area *scene)
+{
+	struct area r;
+	for(int i = 0; i < FB_SPRITE_MAX; ++i) {
+		struct fb_sprite *s = &sprites[i];
+		if(s->used && s->visible && _sprite_rect(s, &r) && _area_overlap(scene, &r)) s->dirty = 1;
+	}
+}
+
+static void _sprite_present(const struct area *scene)
+{
+	struct area restored[FB_SPRITE_MAX*2], r;
+	int n = 0, i, k, need;
+
+	for(i = 0; i < sprite_erase_num; ++i) {
+		_copy_area(LCD_FB_BUF, DRAW_BUF, &sprite_erase[i]);
+		restored[n++] = sprite_erase[i];
+	}
+	sprite_erase_num = 0;
+	for(i = 0; i < FB_SPRITE_MAX; ++i) {
+		struct fb_sprite *s = &sprites[i];
+		if(!s->used || !s->dirty) continue;
+		if(s->shown.x2 > s->shown.x1) {
+			int keep = s->visible && _sprite_rect(s, &r);
+			_sprite_restore(&s->shown, keep ? &r : NULL);
+			restored[n++] = s->shown;
+			s->shown.x1 = s->shown.x2 = 0;
+		}
+	}
+	for(i = 0; i < FB_SPRITE_MAX; ++i) {
+		struct fb_sprite *s = &sprites[i];
+		if(!s->used) continue;
+		need = s->dirty;
+		s->dirty = 0;
+		if(!s->visible || !_sprite_rect(s, &r)) continue;
+		if((scene != NULL) && _area_overlap(scene, &r)) need = 1;
+		for(k = 0; k < n; ++k)
+			if(_area_overlap(&restored[k], &r)) need = 1;
+		if(!need) continue;
+		_sprite_compose(s, &r);
+		s->shown = r;
+	}
+}
+
+fb_sprite * fb_sprite_new(fb_image *image, int hot_x, int hot_y)
+{
+	for(int i = 0; i < FB_SPRITE_MAX; ++i) {
+		struct fb_sprite *s = &sprites[i];
+		if(s->used) continue;
+		s->buf = NULL;
+		s->buf_size = 0;
+		s->image = NULL;
+		if(fb_sprite_set_image(s, image, hot_x, hot_y) < 0) return NULL;
+		s->used = 1;
+		s->visible = 0;
+		s->dirty = 0;
+		s->x = s->y = 0;
+		s->shown.x1 = s->shown.x2 = 0;
+		return s;
+	}
+	printf("fb_sprite_new: too many sprites\n");
+	return NULL;
+}
+
+void fb_sprite_free(fb_sprite *s)
+{
+	if(s == NULL) return;
+	if(s->shown.x2 > s->shown.x1) { /*下一次fb_update擦掉*/
+		if(sprite_erase_num < FB_SPRITE_MAX) sprite_erase[sprite_erase_num++] = s->shown;
+		else { /*满了, 并到最后一个里*/
+			struct area *pa = &sprite_erase[FB_SPRITE_MAX-1];
+			if(s->shown.x1 < pa->x1) pa->x1 = s->shown.x1;
+			if(s->shown.y1 < pa->y1) pa->y1 = s->shown.y1;
+			if(s->shown.x2 > pa->x2) pa->x2 = s->shown.x2;
+			if(s->shown.y2 > pa->y2) pa->y2 = s->shown.y2;
+		}
+	}
+	s->used = 0;
+	s->image = NULL;
+	free(s->buf);
+	s->buf = NULL;
+	s->buf_size = 0;
+}
+
+int fb_sprite_set_image(fb_sprite *s, fb_image *image, int hot_x, int hot_y)
+{
+	int size;
+	if((s == NULL) || (image == NULL)) return -1;
+	size = image->pixel_w * image->pixel_h;
+	if(size > s->buf_size) {
+		fb_pixel *buf = malloc(size * sizeof(fb_pixel));
+		if(buf == NULL) {
+			printf("fb_sprite_set_image: out of memory\n");
+			return -1;
+		}
+		free(s->buf);
+		s->buf = buf;
+		s->buf_size = size;
+	}
+	s->image = image;
+	s->hot_x = hot_x;
+	s->hot_y = hot_y;
+	s->dirty = 1;
+	return 0;
+}
+
+void fb_sprite_move(fb_sprite *s, int x, int y)
+{
+	if((s == NULL) || ((s->x == x) && (s->y == y))) return;
+	s->x = x;
+	s->y = y;
+	if(s->visible) s->dirty = 1;
+}
+
+void fb_sprite_show(fb_sprite *s, int show)
+{
+	if((s == NULL) || !s->used) return;
+	show = (show != 0);
+	if(s->visible == show) return;
+	s->visible = show;
+	s->dirty = 1;
+}
@@ -2,65 +2,370 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <linux/fb.h>
 
 #include "common.h"
 
-/*w, h maybe == 0*/
-fb_image * fb_new_image(int color_type, int w, int h, int line_byte)
+/*================== image allocator ===============*/
+/*每个fb_image前面有一个img_block, 记录它是从哪里分配的和引用计数:
+ *小图片(字形, 子图片的头)从按大小分级的slab中分配, 释放后放回空闲链表, 不还给系统;
+ *只用一帧的临时图片从帧内存池中分配, fb_update()之后整体回收;
+ *大图片直接malloc. slab可以在多个线程中使用, 帧内存池只能在主线程使用*/
+
+#define IMG_POOL_HEAP	-1
+#define IMG_POOL_FRAME	-2
+#define IMG_POOL_MAP	-3
+#define IMG_SLAB_CLASS	7	/*64, 128, ... 4096字节*/
+#define IMG_SLAB_MIN	64
+#define IMG_SLAB_PAGE	(64*1024)
+#define IMG_FRAME_SIZE	(256*1024)
+
+typedef struct img_block {
+	int pool;	/*IMG_POOL_XXX, 或slab的级别*/
+	int bytes;	/*块的大小*/
+	int ref;	/*这个fb_image头的引用计数*/
+	int users;	/*块的使用者: 自己的头(ref>0时算1个)和使用块里颜色内存的其他头*/
+	struct img_block *parent; /*颜色内存不在自己块里时, 指向颜色内存所在的块*/
+	struct img_block *next; /*空闲链表*/
+} img_block;
+
+typedef struct {
+	img_block block;
+	fb_image image;
+	void *map;	/*fb_map_image()映射的文件*/
+	size_t map_len;
+} mapped_image;
+
+typedef struct {
+	img_block *free_list;
+	char *page;	/*当前正在切分的页*/
+	int page_left;
+} img_slab;
+
+static img_slab slabs[IMG_SLAB_CLASS];
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *frame_pool = NULL;
+static int frame_size = 0, frame_used = 0, frame_peak = 0;
+static img_block *frame_overflow = NULL; /*帧内存池放不下的, 帧结束时free*/
+
+static fb_alloc_stat alloc_stat;
+static int frame_allocs = 0, frame_mallocs = 0;
+
+static void * _img_malloc(size_t size)
 {
-	fb_image *image;
+	__atomic_add_fetch(&alloc_stat.mallocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&frame_mallocs, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
 
-	if((w<0)||(h<0)) return NULL;
+static img_block * _img_alloc(int size)
+{
+	img_slab *s;
+	img_block *b;
+	int c, bytes;
+
+	for(c = 0, bytes = IMG_SLAB_MIN; (c < IMG_SLAB_CLASS)&&(bytes < size); ++c) bytes <<= 1;
+	if(c == IMG_SLAB_CLASS) {
+		b = (img_block *)_img_malloc(size);
+		if(b == NULL) return NULL;
+		b->pool = IMG_POOL_HEAP;
+		bytes = size;
+	} else {
+		s = &slabs[c];
+		pthread_mutex_lock(&slab_lock);
+		b = s->free_list;
+		if(b != NULL) {
+			s->free_list = b->next;
+		} else {
+			if(s->page_left < bytes) {
+				s->page = (char *)_img_malloc(IMG_SLAB_PAGE);
+				s->page_left = (s->page != NULL) ? IMG_SLAB_PAGE : 0;
+				if(s->page != NULL) __atomic_add_fetch(&alloc_stat.slab_bytes, IMG_SLAB_PAGE, __ATOMIC_RELAXED);
+			}
+			if(s->page_left >= bytes) {
+				b = (img_block *)s->page;
+				s->page += bytes;
+				s->page_left -= bytes;
+			}
+		}
+		pthread_mutex_unlock(&slab_lock);
+		if(b == NULL) return NULL;
+		b->pool = c;
+	}
+	b->bytes = bytes;
+	__atomic_add_fetch(&alloc_stat.live_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_stat.live_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&frame_allocs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+static void _img_release(img_block *b)
+{
+	img_slab *s;
+
+	if(b->pool == IMG_POOL_FRAME) return; /*帧结束时统一回收*/
+	__atomic_sub_fetch(&alloc_stat.live_bytes, b->bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&alloc_stat.live_count, 1, __ATOMIC_RELAXED);
+	if(b->pool == IMG_POOL_MAP) munmap(((mapped_image *)b)->map, ((mapped_image *)b)->map_len);
+	if(b->pool < 0) {
+		free(b);
+		return;
+	}
+	s = &slabs[b->pool];
+	pthread_mutex_lock(&slab_lock);
+	b->next = s->free_list;
+	s->free_list = b;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/*检查颜色格式并计算每行字节数, 格式不支持返回-1*/
+static int _image_line_byte(int color_type, int w, int line_byte)
+{
 	switch(color_type)
 	{
 	case FB_COLOR_RGB_8880:
 	case FB_COLOR_RGBA_8888:
+	case FB_COLOR_RGBA_PREMUL:
 		if(line_byte < w*4) line_byte = w*4;
 		break;
 	case FB_COLOR_ALPHA_8:
+	case FB_COLOR_INDEX_8:
 		if(line_byte < w) line_byte = w;
 		break;
 	default:
-		return NULL;
+		return -1;
 	}
+	return line_byte;
+}
 
-	image = (fb_image *)malloc(sizeof(fb_image) + line_byte*h);
-	if(image == NULL) return NULL;
+/*每个像素的字节数*/
+static inline int _image_bpp(int color_type)
+{
+	return ((color_type == FB_COLOR_ALPHA_8)||(color_type == FB_COLOR_INDEX_8)) ? 1 : 4;
+}
 
+/*颜色内存前面的调色板*/
+#define IMG_PALETTE_BYTES	(256*4)
+static inline int _image_extra(int color_type)
+{
+	return (color_type == FB_COLOR_INDEX_8) ? IMG_PALETTE_BYTES : 0;
+}
+
+static fb_image * _image_init(img_block *b, int color_type, int w, int h, int line_byte)
+{
+	fb_image *image = (fb_image *)(b+1);
+	b->ref = 1;
+	b->users = 1;
+	b->parent = NULL;
 	image->color_type = color_type;
 	image->line_byte = line_byte;
 	image->pixel_w = w;
 	image->pixel_h = h;
 	image->content = (char *)(image+1);
+	image->palette = NULL;
+	if(color_type == FB_COLOR_INDEX_8) {
+		image->palette = (unsigned int *)(image+1);
+		memset(image->palette, 0, IMG_PALETTE_BYTES);
+		image->content += IMG_PALETTE_BYTES;
+	}
 	return image;
 }
 
-fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h)
+/*w, h maybe == 0*/
+fb_image * fb_new_image(int color_type, int w, int h, int line_byte)
+{
+	img_block *b;
+
+	if((w<0)||(h<0)) return NULL;
+	line_byte = _image_line_byte(color_type, w, line_byte);
+	if(line_byte < 0) return NULL;
+
+	b = _img_alloc(sizeof(img_block) + sizeof(fb_image) + _image_extra(color_type) + line_byte*h);
+	if(b == NULL) return NULL;
+	return _image_init(b, color_type, w, h, line_byte);
+}
+
+fb_image * fb_new_frame_image(int color_type, int w, int h)
+{
+	img_block *b;
+	int line_byte, size;
+
+	if((w<0)||(h<0)) return NULL;
+	line_byte = _image_line_byte(color_type, w, 0);
+	if(line_byte < 0) return NULL;
+	line_byte = (line_byte + 15) & ~15;
+	size = (sizeof(img_block) + sizeof(fb_image) + _image_extra(color_type) + line_byte*h + 15) & ~15;
+
+	if(frame_used + size <= frame_size) {
+		b = (img_block *)(frame_pool + frame_used);
+		b->pool = IMG_POOL_FRAME;
+	} else {
+		b = (img_block *)_img_malloc(size);
+		if(b == NULL) return NULL;
+		b->pool = IMG_POOL_FRAME;
+		b->next = frame_overflow;
+		frame_overflow = b;
+	}
+	frame_used += size;
+	b->bytes = size;
+	frame_allocs++;
+	return _image_init(b, color_type, w, h, line_byte);
+}
+
+void fb_image_frame_end(void)
+{
+	img_block *b;
+
+	if(frame_peak < frame_used) frame_peak = frame_used;
+	while((b = frame_overflow) != NULL) {
+		frame_overflow = b->next;
+		free(b);
+	}
+	/*这一帧放不下, 下一帧按峰值扩大*/
+	if(frame_used > frame_size) {
+		free(frame_pool);
+		frame_size = (frame_peak > IMG_FRAME_SIZE) ? frame_peak : IMG_FRAME_SIZE;
+		frame_pool = (char *)_img_malloc(frame_size);
+		if(frame_pool == NULL) frame_size = 0;
+	}
+	alloc_stat.frame_bytes = frame_used;
+	alloc_stat.frame_allocs = __atomic_exchange_n(&frame_allocs, 0, __ATOMIC_RELAXED);
+	alloc_stat.frame_mallocs = __atomic_exchange_n(&frame_mallocs, 0, __ATOMIC_RELAXED);
+	frame_used = 0;
+}
+
+void fb_get_alloc_stat(fb_alloc_stat *st)
+{
+	if(st == NULL) return;
+	st->live_bytes = __atomic_load_n(&alloc_stat.live_bytes, __ATOMIC_RELAXED);
+	st->live_count = __atomic_load_n(&alloc_stat.live_count, __ATOMIC_RELAXED);
+	st->slab_bytes = __atomic_load_n(&alloc_stat.slab_bytes, __ATOMIC_RELAXED);
+	st->mallocs = __atomic_load_n(&alloc_stat.mallocs, __ATOMIC_RELAXED);
+	st->frame_allocs = alloc_stat.frame_allocs;
+	st->frame_mallocs = alloc_stat.frame_mallocs;
+	st->frame_bytes = alloc_stat.frame_bytes;
+}
+
+/*================== reference count ===============*/
+/*fb_image头有引用计数, 颜色内存另有使用者计数: 子图片和克隆的图片是新的头,
+ *但使用原图片的颜色内存, 会让原图片的块一直有效;
+ *通过共享颜色内存的头写图片之前调用fb_image_writable(), 写时复制*/
+
+static inline img_block * _img_block(fb_image *image)
+{
+	return (img_block *)image - 1;
+}
+
+static inline img_block * _img_storage(img_block *b)
+{
+	return (b->parent != NULL) ? b->parent : b;
+}
+
+static void _storage_put(img_block *sb)
+{
+	if(__atomic_sub_fetch(&sb->users, 1, __ATOMIC_ACQ_REL) == 0)
+		_img_release(sb);
+}
+
+fb_image * fb_retain_image(fb_image *image)
+{
+	if(image) __atomic_add_fetch(&_img_block(image)->ref, 1, __ATOMIC_RELAXED);
+	return image;
+}
+
+int fb_image_refcount(fb_image *image)
+{
+	return image ? __atomic_load_n(&_img_block(image)->ref, __ATOMIC_RELAXED) : 0;
+}
+
+/*新建一个头, 和img共享颜色内存*/
+static fb_image * _img_view(fb_image *img, char *content, int w, int h)
 {
+	img_block *b, *sb;
 	fb_image *ret;
+
+	b = _img_alloc(sizeof(img_block) + sizeof(fb_image));
+	if(b == NULL) return NULL;
+	sb = _img_storage(_img_block(img));
+	__atomic_add_fetch(&sb->users, 1, __ATOMIC_RELAXED);
+	b->ref = 1;
+	b->users = 1;
+	b->parent = sb;
+	ret = (fb_image *)(b+1);
+	ret->color_type = img->color_type;
+	ret->line_byte = img->line_byte;
+	ret->pixel_w = w;
+	ret->pixel_h = h;
+	ret->content = content;
+	ret->palette = img->palette; /*调色板在颜色内存的块里, 一起共享*/
+	return ret;
+}
+
+fb_image * fb_clone_image(fb_image *img)
+{
+	if(img == NULL) return NULL;
+	return _img_view(img, img->content, img->pixel_w, img->pixel_h);
+}
+
+int fb_image_writable(fb_image *img)
+{
+	img_block *b, *sb, *nb;
+	fb_image *copy;
+	int row, bytes;
+
+	if(img == NULL) return -1;
+	b = _img_block(img);
+	/*头被别人retain着, 换掉content也会换掉他们的; 应该先fb_clone_image再写*/
+	if(__atomic_load_n(&b->ref, __ATOMIC_ACQUIRE) > 1) {
+		printf("fb_image_writable: image is shared (refcount %d), clone it first\n", b->ref);
+		return -1;
+	}
+	sb = _img_storage(b);
+	if(__atomic_load_n(&sb->users, __ATOMIC_ACQUIRE) == 1) return 0; /*只有自己在用*/
+
+	copy = fb_new_image(img->color_type, img->pixel_w, img->pixel_h, 0);
+	if(copy == NULL) return -1;
+	bytes = img->pixel_w * _image_bpp(img->color_type);
+	for(row = 0; row < img->pixel_h; ++row)
+		memcpy(copy->content + row*copy->line_byte, img->content + row*img->line_byte, bytes);
+	if(copy->palette) memcpy(copy->palette, img->palette, IMG_PALETTE_BYTES);
+
+	/*copy的头不再使用, 只留下它的颜色内存给img*/
+	nb = _img_block(copy);
+	nb->ref = 0;
+	img->content = copy->content;
+	img->line_byte = copy->line_byte;
+	img->palette = copy->palette;
+	if(b->parent != NULL) _storage_put(b->parent);
+	b->parent = nb;
+	return 0;
+}
+
+fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h)
+{
 	if(img == NULL) return NULL;
 	if((x<0)||(y<0)||
 		(w<0)||(h<0)||
 		(x+w > img->pixel_w)||
-		(y+h > img->pixel_w))
+		(y+h > img->pixel_h))
 		return NULL;
 
-	ret = (fb_image *)malloc(sizeof(fb_image));
-	if(ret != NULL) {
-		ret->color_type = img->color_type;
-		ret->line_byte = img->line_byte;
-		ret->pixel_w = w;
-		ret->pixel_h = h;
-		if(img->color_type != FB_COLOR_ALPHA_8) x*=4;
-		ret->content = img->content + y*img->line_byte + x;
-	}
-	return ret;
+	x *= _image_bpp(img->color_type);
+	return _img_view(img, img->content + y*img->line_byte + x, w, h);
 }
 
 void fb_free_image(fb_image *image)
 {
-	if(image) free(image);
+	img_block *b;
+
+	if(image == NULL) return;
+	b = _img_block(image);
+	if(__atomic_sub_fetch(&b->ref, 1, __ATOMIC_ACQ_REL) > 0) return;
+	/*头不再使用; 自己块里的颜色内存可能还被子图片使用*/
+	if(b->parent != NULL) _storage_put(b->parent);
+	_storage_put(b);
 }
 
 /*================== read a jpeg image ===============*/
@@ -117,14 +422,199 @@ fb_image *fb_read_jpeg_image(char *file)
 	return image;
 }
 
+/*================== decode a jpeg region ===============*/
+#include <setjmp.h>
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+} jpeg_jmp_error;
+
+static void _jpeg_jmp_exit(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((jpeg_jmp_error *)cinfo->err)->jb, 1);
+}
+
+/*目标像素中心映射到源坐标(最近点)*/
+static inline int _map_coord(int d, int dlen, int s, int slen)
+{
+	return s + ((2*d + 1) * slen) / (2*dlen);
+}
+
+int fb_decode_jpeg_into(char *file, int sx, int sy, int sw, int sh,
+	fb_image *dst, int dx, int dy, int dw, int dh)
+{
+	jpeg_jmp_error jerr;
+	struct jpeg_decompress_struct cinfo;
+	FILE *infile;
+	int n, ox, oy, ow, oh;
+	int vx0, vy0, vx1, vy1, x, y, have;
+	JDIMENSION xoff, wid;
+	unsigned int * volatile row = NULL;
+	unsigned int *drow;
+	JSAMPROW r;
+
+	if((dst == NULL)||(dst->color_type != FB_COLOR_RGB_8880)||(dw <= 0)||(dh <= 0)) {
+		printf("fb_decode_jpeg_into: arg error\n");
+		return -1;
+	}
+	/*只解码落在dst内的部分*/
+	vx0 = (dx < 0) ? 0 : dx;
+	vy0 = (dy < 0) ? 0 : dy;
+	vx1 = (dx+dw > dst->pixel_w) ? dst->pixel_w : dx+dw;
+	vy1 = (dy+dh > dst->pixel_h) ? dst->pixel_h : dy+dh;
+	if((vx1 <= vx0)||(vy1 <= vy0)) return 0;
+
+	if((infile = fopen(file, "rb")) == NULL){
+		printf("fb_decode_jpeg_into: Failed to open file %s\n", file);
+		return -1;
+	}
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = _jpeg_jmp_exit; /*可能在工作线程里解码, 坏文件不能让进程退出*/
+	jpeg_create_decompress(&cinfo);
+	if(setjmp(jerr.jb)) {
+		free(row);
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return -1;
+	}
+	jpeg_stdio_src(&cinfo, infile);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if((sw <= 0)||(sh <= 0)) {
+		sx = sy = 0;
+		sw = cinfo.image_width;
+		sh = cinfo.image_height;
+	}
+	if((sx < 0)||(sy < 0)||(sx+sw > (int)cinfo.image_width)||(sy+sh > (int)cinfo.image_height)) {
+		printf("fb_decode_jpeg_into: crop (%d,%d,%d,%d) out of %ux%u\n",
+			sx, sy, sw, sh, cinfo.image_width, cinfo.image_height);
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return -1;
+	}
+
+	/*选最小的DCT缩放n/8, 使缩放后的裁剪区域仍不小于目标大小*/
+	for(n=1; n<8; ++n)
+	{
+		if((sw*n >= dw*8)&&(sh*n >= dh*8)) break;
+	}
+	cinfo.scale_num = n;
+	cinfo.scale_denom = 8;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	cinfo.out_color_space = JCS_EXT_BGRX;
+	jpeg_start_decompress(&cinfo);
+
+	/*裁剪区域换算到缩放后的输出坐标*/
+	ox = sx*n/8;
+	oy = sy*n/8;
+	ow = sw*n/8; if(ow < 1) ow = 1;
+	oh = sh*n/8; if(oh < 1) oh = 1;
+	if(ox+ow > (int)cinfo.output_width) ow = cinfo.output_width - ox;
+	if(oy+oh > (int)cinfo.output_height) oh = cinfo.output_height - oy;
+
+	/*水平方向只解码可见列对应的iMCU*/
+	xoff = _map_coord(vx0-dx, dw, ox, ow);
+	wid = _map_coord(vx1-1-dx, dw, ox, ow) - xoff + 1;
+	jpeg_crop_scanline(&cinfo, &xoff, &wid);
+
+	row = (unsigned int *)malloc(cinfo.output_width * 4);
+	if(row == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return -1;
+	}
+
+	have = -1;
+	for(y=vy0; y<vy1; ++y)
+	{
+		int need = _map_coord(y-dy, dh, oy, oh);
+		if(need != have) {
+			if(need > (int)cinfo.output_scanline)
+				jpeg_skip_scanlines(&cinfo, need - cinfo.output_scanline);
+			r = (JSAMPROW)row;
+			jpeg_read_scanlines(&cinfo, &r, 1);
+			have = need;
+		}
+		drow = (unsigned int *)(dst->content + y*dst->line_byte);
+		if(ow == dw) {
+			memcpy(drow + vx0, row + (ox + vx0-dx - xoff), (vx1-vx0)*4);
+		} else {
+			for(x=vx0; x<vx1; ++x)
+				drow[x] = row[_map_coord(x-dx, dw, ox, ow) - xoff];
+		}
+	}
+
+	free(row);
+	/*剩下的行不需要, 直接放弃解码*/
+	jpeg_destroy_decompress(&cinfo);
+	fclose(infile);
+	return 0;
+}
+
+/*================== decode a jpeg in memory ===============*/
+fb_image * fb_decode_jpeg_image(const void *data, int len, int w, int h)
+{
+	struct jpeg_decompress_struct cinfo;
+	jpeg_jmp_error jerr;
+	fb_image * volatile image = NULL;
+	JSAMPROW row;
+	int n;
+
+	if((data == NULL)||(len <= 0)) return NULL;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = _jpeg_jmp_exit; /*坏的数据不能让进程退出*/
+	jpeg_create_decompress(&cinfo);
+	if(setjmp(jerr.jb)) {
+		jpeg_destroy_decompress(&cinfo);
+		fb_free_image(image);
+		return NULL;
+	}
+	jpeg_mem_src(&cinfo, (unsigned char *)data, len);
+	jpeg_read_header(&cinfo, TRUE);
+
+	/*选最小的DCT缩放n/8, 使输出不小于w*h*/
+	n = 8;
+	if((w > 0)&&(h > 0)) {
+		for(n=1; n<8; ++n)
+		{
+			if((cinfo.image_width*n >= w*8)&&(cinfo.image_height*n >= h*8)) break;
+		}
+	}
+	cinfo.scale_num = n;
+	cinfo.scale_denom = 8;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	cinfo.out_color_space = JCS_EXT_BGRX;
+	jpeg_start_decompress(&cinfo);
+
+	image = fb_new_image(FB_COLOR_RGB_8880, cinfo.output_width, cinfo.output_height, 0);
+	if(image == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		return NULL;
+	}
+	while(cinfo.output_scanline < cinfo.output_height)
+	{
+		row = (JSAMPROW)(image->content + cinfo.output_scanline*image->line_byte);
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return image;
+}
+
 /*================== read a png image ===============*/
 #include <png.h>
-fb_image *fb_read_png_image(char *file)
+/*逐行把PNG解码到fb_image里, 不经过libpng的row_pointers;
+ *调色板/灰度/RGB都展开成BGRA, tRNS展开成alpha通道*/
+fb_image *fb_read_png_image_ex(char *file, int flags)
 {
-	fb_image *image=NULL;
+	fb_image * volatile image=NULL;
 	png_structp png_ptr;
 	png_infop info_ptr;
 	FILE *fp;
+	int color_type, has_alpha, index, passes, width, height, x, y;
 	
 	fp = fopen(file, "rb");
 	if(fp == NULL) {
@@ -165,54 +655,313 @@ fb_image *fb_read_png_image(char *file)
 	//bind libpng with fp
 	png_init_io(png_ptr, fp);
 	png_set_sig_bytes(png_ptr, 0);
-	
-	png_read_png(png_ptr, info_ptr, 
-		PNG_TRANSFORM_STRIP_16|
-		PNG_TRANSFORM_PACKING|
-		PNG_TRANSFORM_EXPAND|
-		PNG_TRANSFORM_BGR, NULL);
+	png_read_info(png_ptr, info_ptr);
 
-	if(png_get_bit_depth(png_ptr, info_ptr) == 16) {
+	width = png_get_image_width(png_ptr, info_ptr);
+	height = png_get_image_height(png_ptr, info_ptr);
+	color_type = png_get_color_type(png_ptr, info_ptr);
+	has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+	index = (flags & FB_PNG_INDEX) && (color_type == PNG_COLOR_TYPE_PALETTE);
+
+	if(index) {
+		png_set_packing(png_ptr); /*1,2,4位的下标展开成每个像素一个字节*/
+	} else {
+		//所有格式都变换成8位的B,G,R,A
+		png_set_expand(png_ptr); /*调色板->RGB, 低位灰度->8位, tRNS->alpha*/
 		png_set_strip_16(png_ptr);
+		png_set_gray_to_rgb(png_ptr);
+		png_set_bgr(png_ptr);
+		if(has_alpha && (flags & FB_PNG_RGB)) {
+			png_set_strip_alpha(png_ptr);
+			has_alpha = 0;
+		}
+		if(!has_alpha) png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
 	}
-	/*if(png_get_valid(png_ptr,info_ptr,PNG_INFO_tRNS)) {
-		png_set_tRNS_to_alpha(png_ptr);
-	}*/
+	passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
 
-	//not support color type
-	if(png_get_channels(png_ptr, info_ptr) != 4) {
+	if(png_get_rowbytes(png_ptr, info_ptr) != (png_size_t)width*(index ? 1 : 4)) {
 		printf("unrecognized image format.\n");
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		fclose(fp);
 		return NULL; 
 	}
-	int pngheight =png_get_image_height(png_ptr, info_ptr);
-	int pngwidth = png_get_image_width(png_ptr, info_ptr);
-	image = fb_new_image(FB_COLOR_RGBA_8888,pngwidth, pngheight , 0);
+
+	if(index) color_type = FB_COLOR_INDEX_8;
+	else if(flags & FB_PNG_RGB) color_type = FB_COLOR_RGB_8880;
+	else if(has_alpha && (flags & FB_PNG_PREMUL)) color_type = FB_COLOR_RGBA_PREMUL;
+	else color_type = FB_COLOR_RGBA_8888;
+	image = fb_new_image(color_type, width, height, 0);
 	if(image == NULL){
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		fclose(fp);
 		return NULL;
 	}
-	
-	char *dst = image->content;
-	char **row_pointers;
-	char *src;
-	row_pointers = (char **)png_get_rows(png_ptr, info_ptr);
-	int i = 0;
-	while(i <pngheight )
+	if(index) {
+		png_colorp plte;
+		png_bytep trans = NULL;
+		int i, num = 0, num_trans = 0;
+		png_get_PLTE(png_ptr, info_ptr, &plte, &num);
+		if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+			png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL);
+		for(i = 0; (i < num)&&(i < 256); ++i)
+		{
+			unsigned int a = (i < num_trans) ? trans[i] : 255;
+			image->palette[i] = (a<<24)|(plte[i].red<<16)|(plte[i].green<<8)|plte[i].blue;
+		}
+	}
+
+	//隔行扫描的图片每一遍都读到同一行里, libpng只改这一遍的像素;
+	//最后一遍读完的行已经完整, 趁还在cache里预乘alpha
+	while(passes-- > 0)
 	{
-		src = row_pointers[i];
-		memcpy(dst, src, pngwidth * 4);
-		dst += image->line_byte;
-		++i;
+		for(y = 0; y < height; ++y)
+		{
+			unsigned char *p = (unsigned char *)image->content + y*image->line_byte;
+			png_read_row(png_ptr, (png_bytep)p, NULL);
+			if((passes > 0)||(color_type != FB_COLOR_RGBA_PREMUL)) continue;
+			for(x = 0; x < width; ++x, p += 4)
+			{
+				int a = p[3];
+				if(a == 255) continue;
+				p[0] = (p[0]*a + 127) / 255;
+				p[1] = (p[1]*a + 127) / 255;
+				p[2] = (p[2]*a + 127) / 255;
+			}
+		}
 	}
+	png_read_end(png_ptr, NULL);
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	fclose(fp);
 	return image;
 }
 
+fb_image *fb_read_png_image(char *file)
+{
+	return fb_read_png_image_ex(file, 0);
+}
+
+/*================== read a qoi image ===============*/
+/*QOI格式: 一遍扫描, 不用zlib, 解码比PNG快几倍, 压缩率接近.
+ *颜色按r,g,b,a存, 解码时直接写成fb_image的B,G,R,A*/
+#define QOI_OP_INDEX	0x00 /*00xxxxxx*/
+#define QOI_OP_DIFF	0x40 /*01xxxxxx*/
+#define QOI_OP_LUMA	0x80 /*10xxxxxx*/
+#define QOI_OP_RUN	0xc0 /*11xxxxxx*/
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_HEADER_SIZE	14
+#define QOI_PIXELS_MAX	(16*1024*1024)
+#define QOI_HASH(r,g,b,a)	(((r)*3 + (g)*5 + (b)*7 + (a)*11) & 63)
+
+static unsigned int _qoi_be32(const unsigned char *p)
+{
+	return (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+fb_image * fb_decode_qoi_image(const void *data, int len)
+{
+	const unsigned char *p = (const unsigned char *)data, *end;
+	unsigned char index[64][4];
+	unsigned char r = 0, g = 0, b = 0, a = 255;
+	unsigned int w, h;
+	int channels, run = 0, x, y;
+	fb_image *image;
+
+	if((p == NULL)||(len < QOI_HEADER_SIZE + 8)||(memcmp(p, "qoif", 4) != 0)) return NULL;
+	w = _qoi_be32(p+4);
+	h = _qoi_be32(p+8);
+	channels = p[12];
+	if((w == 0)||(h == 0)||(w > QOI_PIXELS_MAX/h)||((channels != 3)&&(channels != 4))) {
+		printf("fb_decode_qoi_image: bad header\n");
+		return NULL;
+	}
+
+	image = fb_new_image((channels == 4) ? FB_COLOR_RGBA_8888 : FB_COLOR_RGB_8880, w, h, 0);
+	if(image == NULL) return NULL;
+
+	memset(index, 0, sizeof(index));
+	end = (const unsigned char *)data + len - 8; /*最后8字节是结束标记*/
+	p += QOI_HEADER_SIZE;
+	for(y=0; y<h; ++y)
+	{
+		unsigned char *d = (unsigned char *)image->content + y*image->line_byte;
+		for(x=0; x<w; ++x, d+=4)
+		{
+			if(run > 0) {
+				run--;
+			} else {
+				int op;
+				if(p >= end) break;
+				op = *p++;
+				if(op == QOI_OP_RGB) {
+					if(p+3 > end) break;
+					r = p[0]; g = p[1]; b = p[2];
+					p += 3;
+				} else if(op == QOI_OP_RGBA) {
+					if(p+4 > end) break;
+					r = p[0]; g = p[1]; b = p[2]; a = p[3];
+					p += 4;
+				} else switch(op & 0xc0) {
+				case QOI_OP_INDEX:
+					r = index[op][0]; g = index[op][1]; b = index[op][2]; a = index[op][3];
+					break;
+				case QOI_OP_DIFF:
+					r += ((op >> 4) & 3) - 2;
+					g += ((op >> 2) & 3) - 2;
+					b += (op & 3) - 2;
+					break;
+				case QOI_OP_LUMA: {
+					int dg = (op & 0x3f) - 32;
+					int drdb = (p < end) ? *p++ : 0x88;
+					r += dg - 8 + ((drdb >> 4) & 0x0f);
+					g += dg;
+					b += dg - 8 + (drdb & 0x0f);
+					break;
+				}
+				default: /*QOI_OP_RUN*/
+					run = op & 0x3f;
+					break;
+				}
+				index[QOI_HASH(r,g,b,a)][0] = r;
+				index[QOI_HASH(r,g,b,a)][1] = g;
+				index[QOI_HASH(r,g,b,a)][2] = b;
+				index[QOI_HASH(r,g,b,a)][3] = a;
+			}
+			d[0] = b; d[1] = g; d[2] = r;
+			d[3] = (channels == 4) ? a : 0xff;
+		}
+		if(x < w) break;
+	}
+	if(y < h) {
+		printf("fb_decode_qoi_image: truncated data\n");
+		fb_free_image(image);
+		return NULL;
+	}
+	return image;
+}
+
+fb_image * fb_read_qoi_image(char *file)
+{
+	struct stat st;
+	fb_image *image;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_read_qoi_image: open %s error %d\n", file, errno);
+		return NULL;
+	}
+	if((fstat(fd, &st) < 0)||(st.st_size < QOI_HEADER_SIZE)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return NULL;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	image = fb_decode_qoi_image(map, st.st_size);
+	munmap(map, st.st_size);
+	return image;
+}
+
+static void _qoi_put_be32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/*RGB_8880存成3通道, 其他存成4通道; 返回0表示成功*/
+int fb_write_qoi_image(fb_image *img, char *file)
+{
+	static const unsigned char padding[8] = {0,0,0,0,0,0,0,1};
+	unsigned char index[64][4];
+	unsigned char pr = 0, pg = 0, pb = 0, pa = 255;
+	unsigned char *out, *p;
+	int x, y, run = 0, last, channels, n;
+	FILE *fp;
+
+	if((img == NULL)||(_image_bpp(img->color_type) != 4)) return -1;
+	channels = (img->color_type == FB_COLOR_RGB_8880) ? 3 : 4;
+	out = (unsigned char *)malloc((size_t)img->pixel_w*img->pixel_h*(channels+1) + QOI_HEADER_SIZE + 8);
+	if(out == NULL) return -1;
+
+	p = out;
+	memcpy(p, "qoif", 4);
+	_qoi_put_be32(p+4, img->pixel_w);
+	_qoi_put_be32(p+8, img->pixel_h);
+	p[12] = channels;
+	p[13] = 0; /*sRGB*/
+	p += QOI_HEADER_SIZE;
+
+	memset(index, 0, sizeof(index));
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *s = (unsigned char *)img->content + y*img->line_byte;
+		for(x=0; x<img->pixel_w; ++x, s+=4)
+		{
+			unsigned char r = s[2], g = s[1], b = s[0];
+			unsigned char a = (channels == 4) ? s[3] : 255;
+			int h;
+
+			last = (y == img->pixel_h-1)&&(x == img->pixel_w-1);
+			if((r == pr)&&(g == pg)&&(b == pb)&&(a == pa)) {
+				run++;
+				if((run == 62)||last) {
+					*p++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if(run > 0) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			h = QOI_HASH(r,g,b,a);
+			if((index[h][0] == r)&&(index[h][1] == g)&&(index[h][2] == b)&&(index[h][3] == a)) {
+				*p++ = QOI_OP_INDEX | h;
+			} else if(a == pa) {
+				signed char dr = r - pr, dg = g - pg, db = b - pb;
+				signed char dr_dg = dr - dg, db_dg = db - dg;
+				if((dr >= -2)&&(dr <= 1)&&(dg >= -2)&&(dg <= 1)&&(db >= -2)&&(db <= 1)) {
+					*p++ = QOI_OP_DIFF | ((dr+2) << 4) | ((dg+2) << 2) | (db+2);
+				} else if((dg >= -32)&&(dg <= 31)&&(dr_dg >= -8)&&(dr_dg <= 7)&&(db_dg >= -8)&&(db_dg <= 7)) {
+					*p++ = QOI_OP_LUMA | (dg+32);
+					*p++ = ((dr_dg+8) << 4) | (db_dg+8);
+				} else {
+					*p++ = QOI_OP_RGB;
+					*p++ = r; *p++ = g; *p++ = b;
+				}
+			} else {
+				*p++ = QOI_OP_RGBA;
+				*p++ = r; *p++ = g; *p++ = b; *p++ = a;
+			}
+			index[h][0] = r; index[h][1] = g; index[h][2] = b; index[h][3] = a;
+			pr = r; pg = g; pb = b; pa = a;
+		}
+	}
+	memcpy(p, padding, sizeof(padding));
+	p += sizeof(padding);
+
+	n = p - out;
+	fp = fopen(file, "wb");
+	if(fp == NULL) {
+		printf("fb_write_qoi_image: open %s error %d\n", file, errno);
+		free(out);
+		return -1;
+	}
+	x = fwrite(out, 1, n, fp);
+	if((fclose(fp) != 0)||(x != n)) {
+		printf("fb_write_qoi_image: write %s error\n", file);
+		free(out);
+		return -1;
+	}
+	free(out);
+	return 0;
+}
+
 /*================== read a font image ===============*/
 
 #include <ft2build.h>
@@ -232,115 +981,738 @@ fb_image *fb_read_png_image(char *file)
   } FT_Bitmap;
  */
 
-static FT_Library library=NULL;
-static FT_Face face;
+#include FT_SIZES_H
+
+/*字体文件通过mmap映射后交给FT_New_Memory_Face, 页面按需载入且多进程共享.
+ *每个字体为每种像素大小保留一个FT_Size, 切换字号只需FT_Activate_Size.
+ *faces[0]是主字体, 其后是备用字体, 主字体没有的字依次到备用字体中查找.*/
+#define FONT_FACE_MAX	4	/*主字体+备用字体的最大个数*/
+#define FONT_SIZE_MAX	8	/*每个字体缓存的字号个数*/
+
+typedef struct {
+	FT_Face face;
+	void *map;	/*字体文件的mmap地址*/
+	size_t map_len;
+	int active;	/*当前激活的FT_Size下标, -1表示没有*/
+	int next;	/*缓存满时下一个被替换的下标*/
+	int size_px[FONT_SIZE_MAX];
+	FT_Size sizes[FONT_SIZE_MAX];
+} font_face;
 
-#if 0 /** Change UTF-8 to Unicode **/
-static FT_ULong Utf8ToUnicode(const char *utf8, int len)
+/*FreeType的library/face不能跨线程使用, 每个线程一个上下文;
+ *其他线程的上下文由font_ctx_clone得到, 和主上下文共享同一份mmap*/
+struct font_ctx {
+	FT_Library library;
+	font_face faces[FONT_FACE_MAX];
+	int face_num;
+	int gen; /*字体栈的版本, 克隆的上下文是克隆时的版本*/
+};
+
+static font_ctx main_ctx;
+
+static int _font_open_memory(FT_Library library, font_face *f, void *map, size_t map_len)
 {
-	FT_ULong unic=0;
-	int i;
-	unsigned char flag = (len==2?0x1F:(len==3?0x0F:(len==4?0x07:0xFF)));
-	if(len == 1){
-		return (FT_ULong)(unsigned char)utf8[0];
-	}else{
-		for(i=0;i<len-1;i++){
-			unic |= (((FT_ULong)((unsigned char)utf8[len-i-1]&0x3f)) << 6*i);
-		}
-		unic |= (((FT_ULong)((unsigned char)utf8[0]&flag))<<(len-1)*6);
+	FT_Error error;
+
+	memset(f, 0, sizeof(*f));
+	error = FT_New_Memory_Face(library, map, map_len, 0, &f->face);
+	if(error){
+		printf("FT_New_Memory_Face: error %d\n", error);
+		return -1;
 	}
-	return unic;
+	error = FT_Select_Charmap(f->face, FT_ENCODING_UNICODE);
+	if(error){
+		printf("FT_Select_Charmap: error %d\n",error);
+		FT_Done_Face(f->face);
+		f->face = NULL;
+		return -1;
+	}
+	f->map = map;
+	f->map_len = map_len;
+	f->active = -1;
+	return 0;
 }
-#endif
 
-void font_init(char *font_file)
+static int _font_open(FT_Library library, font_face *f, char *font_file)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(font_file, O_RDONLY);
+	if(fd < 0){
+		printf("open font \"%s\": error %d\n", font_file, errno);
+		return -1;
+	}
+	if((fstat(fd, &st) < 0)||(st.st_size <= 0)){
+		printf("fstat font \"%s\": error %d\n", font_file, errno);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); /*映射建立后fd不再需要*/
+	if(map == MAP_FAILED){
+		printf("mmap font \"%s\": error %d\n", font_file, errno);
+		return -1;
+	}
+
+	if(_font_open_memory(library, f, map, st.st_size) < 0){
+		printf("open font \"%s\" failed\n", font_file);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+/*激活pixel_size对应的FT_Size, 没有则新建(缓存满时轮换替换)*/
+static int _font_set_size(font_face *f, int pixel_size)
 {
 	FT_Error error;
+	int i;
 
-	if(library == NULL)
+	if((f->active >= 0)&&(f->size_px[f->active] == pixel_size))
+		return 0;
+
+	for(i=0; i<FONT_SIZE_MAX; ++i)
 	{
-		error = FT_Init_FreeType(&library);
+		if((f->sizes[i] != NULL)&&(f->size_px[i] == pixel_size)) {
+			FT_Activate_Size(f->sizes[i]);
+			f->active = i;
+			return 0;
+		}
+	}
+
+	i = f->next;
+	f->next = (i+1) % FONT_SIZE_MAX;
+	if(f->sizes[i] == NULL) {
+		error = FT_New_Size(f->face, &f->sizes[i]);
 		if(error){
-			printf("FT_Init_FreeType: error %d\n",error);
-			library = NULL;
-			return;
+			printf("FT_New_Size: error %d\n", error);
+			f->sizes[i] = NULL;
+			return -1;
 		}
 	}
-	if(face == NULL)
+	FT_Activate_Size(f->sizes[i]);
+	f->active = i;
+	f->size_px[i] = 0;
+	error = FT_Set_Pixel_Sizes(f->face, 0, pixel_size);
+	if(error){
+		printf("FT_Set_Pixel_Sizes: error %d\n", error);
+		return -1;
+	}
+	f->size_px[i] = pixel_size;
+	return 0;
+}
+
+/*找到包含ucs4的字体, 都没有时用主字体(显示.notdef)*/
+static font_face * _font_lookup(font_ctx *ctx, FT_ULong ucs4, FT_UInt *glyph_index)
+{
+	FT_UInt gi;
+	int i;
+	for(i=0; i<ctx->face_num; ++i)
 	{
-		error = FT_New_Face(library, font_file, 0, &face);
-		if(error){
-			printf("FT_New_Face(\"%s\"): error %d\n", font_file, error);
-			face = NULL;
-			return;
+		gi = FT_Get_Char_Index(ctx->faces[i].face, ucs4);
+		if(gi != 0) {
+			*glyph_index = gi;
+			return &ctx->faces[i];
 		}
-		error = FT_Select_Charmap(face, FT_ENCODING_UNICODE);
+	}
+	*glyph_index = 0;
+	return &ctx->faces[0];
+}
+
+static int _font_add(char *font_file)
+{
+	FT_Error error;
+
+	if(main_ctx.library == NULL)
+	{
+		error = FT_Init_FreeType(&main_ctx.library);
 		if(error){
-			printf("FT_Select_Charmap: error %d\n",error);
-			face = NULL;
-			return;
+			printf("FT_Init_FreeType: error %d\n",error);
+			main_ctx.library = NULL;
+			return -1;
 		}
 	}
+	if(main_ctx.face_num >= FONT_FACE_MAX) {
+		printf("add font too many\n");
+		return -1;
+	}
+	if(_font_open(main_ctx.library, &main_ctx.faces[main_ctx.face_num], font_file) < 0)
+		return -1;
+	main_ctx.face_num++;
+	__atomic_add_fetch(&main_ctx.gen, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int font_generation(void)
+{
+	return __atomic_load_n(&main_ctx.gen, __ATOMIC_ACQUIRE);
+}
+
+void font_init(char *font_file)
+{
+	if(main_ctx.face_num == 0) _font_add(font_file);
 	return;
 }
 
-/** read a font image **/ 
-fb_image* fb_read_font_image(const char *text, int pixel_size, fb_font_info *info)
+int font_add_fallback(char *font_file)
 {
-	if(face == NULL) {
+	if(main_ctx.face_num == 0) {
 		printf("call font_init(\"font_file\") first\n");
-		return NULL;
+		return -1;
 	}
-	if((text == NULL)||(pixel_size <= 0)) {
-		printf("arg error\n");
+	return _font_add(font_file);
+}
+
+font_ctx *font_ctx_clone(void)
+{
+	font_ctx *ctx;
+	int i;
+
+	if(main_ctx.face_num == 0) {
+		printf("call font_init(\"font_file\") first\n");
 		return NULL;
 	}
-
-	FT_Error error = FT_Set_Pixel_Sizes(face, 0, pixel_size);
-	if(error){
-		printf("FT_Set_Pixel_Sizes: error %d\n", error);
+	ctx = (font_ctx *)calloc(1, sizeof(font_ctx));
+	if(ctx == NULL) return NULL;
+	ctx->gen = main_ctx.gen;
+	if(FT_Init_FreeType(&ctx->library)) {
+		free(ctx);
 		return NULL;
 	}
+	for(i=0; i<main_ctx.face_num; ++i)
+	{
+		if(_font_open_memory(ctx->library, &ctx->faces[i],
+			main_ctx.faces[i].map, main_ctx.faces[i].map_len) < 0) {
+			font_ctx_free(ctx);
+			return NULL;
+		}
+		ctx->face_num++;
+	}
+	return ctx;
+}
+
+void font_ctx_free(font_ctx *ctx)
+{
+	if((ctx == NULL)||(ctx == &main_ctx)) return;
+	FT_Done_FreeType(ctx->library); /*同时释放所有face和FT_Size, mmap属于主上下文*/
+	free(ctx);
+}
 
-	fb_font_info sinfo;
-	FT_ULong ucs4;
+/*解析一个UTF-8字符, 返回其字节数, 编码错误返回0*/
+int fb_utf8_decode(const char *text, unsigned int *ucs4)
+{
 	if((text[0]&0x80) == 0){
-		sinfo.bytes = 1;
-		ucs4 = (unsigned char)text[0];
+		*ucs4 = (unsigned char)text[0];
+		return 1;
 	}else if((text[0]&0xE0) == 0xC0){
-		sinfo.bytes = 2;
-		ucs4 = ((text[0]&0x1F)<<6)|(text[1]&0x3F);
+		*ucs4 = ((text[0]&0x1F)<<6)|(text[1]&0x3F);
+		return 2;
 	}else if((text[0]&0xF0) == 0xE0){
-		sinfo.bytes = 3;
-		ucs4 = ((text[0]&0x0F)<<12)|((text[1]&0x3F)<<6)|(text[2]&0x3F);
+		*ucs4 = ((text[0]&0x0F)<<12)|((text[1]&0x3F)<<6)|(text[2]&0x3F);
+		return 3;
 	}else if((text[0]&0xF8) == 0xF0){
-		sinfo.bytes = 4;
-		ucs4 = ((text[0]&0x07)<<18)|((text[1]&0x3F)<<12)|((text[2]&0x3F)<<6)|(text[3]&0x3F);
-	}else{
-		printf("code error!\n");
+		*ucs4 = ((text[0]&0x07)<<18)|((text[1]&0x3F)<<12)|((text[2]&0x3F)<<6)|(text[3]&0x3F);
+		return 4;
+	}
+	return 0;
+}
+
+int fb_font_line_height(int pixel_size)
+{
+	if((main_ctx.face_num == 0)||(_font_set_size(&main_ctx.faces[0], pixel_size) < 0))
+		return pixel_size + pixel_size/4;
+	return (int)(main_ctx.faces[0].face->size->metrics.height >> 6);
+}
+
+/** read the image of one unicode character, info->bytes is set to 0 **/
+fb_image* fb_read_glyph_image(unsigned int ucs4, int pixel_size, fb_font_info *info)
+{
+	return fb_read_glyph_image_ctx(&main_ctx, ucs4, pixel_size, info);
+}
+
+fb_image* fb_read_glyph_image_ctx(font_ctx *ctx, unsigned int ucs4, int pixel_size, fb_font_info *info)
+{
+	if(ctx->face_num == 0) {
+		printf("call font_init(\"font_file\") first\n");
+		return NULL;
+	}
+	if(pixel_size <= 0) {
+		printf("arg error\n");
 		return NULL;
 	}
 
-	error = FT_Load_Char(face, ucs4, FT_LOAD_RENDER);
+	FT_UInt glyph_index;
+	font_face *f = _font_lookup(ctx, ucs4, &glyph_index);
+	if(_font_set_size(f, pixel_size) < 0)
+		return NULL;
+
+	FT_Error error = FT_Load_Glyph(f->face, glyph_index, FT_LOAD_RENDER);
 	if(error){
-		printf("FT_Load_Char: error %d", error);
+		printf("FT_Load_Glyph: error %d", error);
 		return NULL;
 	}
-	FT_GlyphSlot slot = face->glyph;
+	FT_GlyphSlot slot = f->face->glyph;
 
 	fb_image* image;
 	/*when ucs4 == 0x20 (blank), the bitmap.width/rows/pitch is 0*/
 	image = fb_new_image(FB_COLOR_ALPHA_8, slot->bitmap.width, slot->bitmap.rows, slot->bitmap.pitch);
 	if(image == NULL){
-		printf("fb_new_image(\"%s\", %d,%d,%d) failed\n", text, slot->bitmap.width, slot->bitmap.rows, slot->bitmap.pitch);
+		printf("fb_new_image(U+%04X, %d,%d,%d) failed\n", ucs4, slot->bitmap.width, slot->bitmap.rows, slot->bitmap.pitch);
+		return NULL;
+	}
+	if(slot->bitmap.rows > 0)
+		memcpy(image->content, slot->bitmap.buffer, slot->bitmap.rows * slot->bitmap.pitch);
+
+	if(info) {
+		info->bytes = 0;
+		info->advance_x = slot->advance.x >> 6;
+		info->left = slot->bitmap_left;
+		info->top = slot->bitmap_top;
+		info->missing = (glyph_index == 0);
+		info->font_gen = ctx->gen;
+	}
+	return image;
+}
+
+/** read a font image **/ 
+fb_image* fb_read_font_image(const char *text, int pixel_size, fb_font_info *info)
+{
+	if(text == NULL) {
+		printf("arg error\n");
+		return NULL;
+	}
+
+	unsigned int ucs4;
+	int bytes = fb_utf8_decode(text, &ucs4);
+	if(bytes == 0){
+		printf("code error!\n");
+		return NULL;
+	}
+
+	fb_image *image = fb_read_glyph_image(ucs4, pixel_size, info);
+	if(image && info) info->bytes = bytes;
+	return image;
+}
+
+/*================== native image file ===============*/
+
+fb_image * fb_map_image(char *path)
+{
+	fb_native_header *hdr;
+	mapped_image *m;
+	struct stat st;
+	void *map;
+	int fd, bpp;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_map_image: open %s error %d\n", path, errno);
+		return NULL;
+	}
+	if((fstat(fd, &st) < 0)||(st.st_size < sizeof(fb_native_header))) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		printf("fb_map_image: mmap %s error %d\n", path, errno);
+		return NULL;
+	}
+
+	hdr = (fb_native_header *)map;
+	bpp = _image_bpp(hdr->color_type);
+	if((hdr->magic != FB_NATIVE_MAGIC)||
+		(hdr->color_type < FB_COLOR_RGB_8880)||(hdr->color_type > FB_COLOR_INDEX_8)||
+		(hdr->pixel_w < 0)||(hdr->pixel_h < 0)||(hdr->line_byte < hdr->pixel_w*bpp)||
+		(hdr->offset % FB_NATIVE_ALIGN)||(hdr->offset < FB_NATIVE_ALIGN + _image_extra(hdr->color_type))||
+		(hdr->offset + (off_t)hdr->line_byte*hdr->pixel_h > st.st_size)) {
+		printf("fb_map_image: bad file %s\n", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	m = (mapped_image *)_img_malloc(sizeof(mapped_image));
+	if(m == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	m->block.pool = IMG_POOL_MAP;
+	m->block.bytes = sizeof(mapped_image);
+	m->block.ref = 1;
+	m->block.users = 1;
+	m->block.parent = NULL;
+	__atomic_add_fetch(&alloc_stat.live_bytes, m->block.bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_stat.live_count, 1, __ATOMIC_RELAXED);
+	m->image.color_type = hdr->color_type;
+	m->image.pixel_w = hdr->pixel_w;
+	m->image.pixel_h = hdr->pixel_h;
+	m->image.line_byte = hdr->line_byte;
+	m->image.content = (char *)map + hdr->offset;
+	m->image.palette = NULL;
+	if(hdr->color_type == FB_COLOR_INDEX_8)
+		m->image.palette = (unsigned int *)((char *)map + FB_NATIVE_ALIGN);
+	m->map = map;
+	m->map_len = st.st_size;
+	return &m->image;
+}
+
+void fb_unmap_image(fb_image *image)
+{
+	fb_free_image(image);
+}
+
+int fb_write_native_image(fb_image *image, char *path)
+{
+	static const char pad[FB_NATIVE_ALIGN];
+	fb_native_header hdr;
+	int y, bytes, ok;
+	FILE *fp;
+
+	if(image == NULL) return -1;
+	bytes = image->pixel_w * _image_bpp(image->color_type);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FB_NATIVE_MAGIC;
+	hdr.color_type = image->color_type;
+	hdr.pixel_w = image->pixel_w;
+	hdr.pixel_h = image->pixel_h;
+	hdr.line_byte = (bytes + FB_NATIVE_ALIGN-1) & ~(FB_NATIVE_ALIGN-1);
+	hdr.offset = FB_NATIVE_ALIGN + _image_extra(image->color_type); /*调色板在文件头后面*/
+
+	fp = fopen(path, "wb");
+	if(fp == NULL) {
+		printf("fb_write_native_image: open %s error %d\n", path, errno);
+		return -1;
+	}
+	ok = (fwrite(&hdr, 1, sizeof(hdr), fp) == sizeof(hdr))&&
+		(fwrite(pad, 1, FB_NATIVE_ALIGN - sizeof(hdr), fp) == FB_NATIVE_ALIGN - sizeof(hdr));
+	if(ok && (image->color_type == FB_COLOR_INDEX_8))
+		ok = (fwrite(image->palette, 1, IMG_PALETTE_BYTES, fp) == IMG_PALETTE_BYTES);
+	for(y=0; ok && (y<image->pixel_h); ++y)
+	{
+		if(fwrite(image->content + y*image->line_byte, 1, bytes, fp) != bytes) ok = 0;
+		else if(fwrite(pad, 1, hdr.line_byte - bytes, fp) != hdr.line_byte - bytes) ok = 0;
+	}
+	if((fclose(fp) != 0)||!ok) {
+		printf("fb_write_native_image: write %s error\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*================== read any image ===============*/
+/*文件的前两个字节*/
+static int _file_magic(char *path)
+{
+	unsigned char magic[2] = {0, 0};
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL) return -1;
+	if(fread(magic, 1, 2, fp) != 2) magic[0] = magic[1] = 0;
+	fclose(fp);
+	return (magic[0] << 8)|magic[1];
+}
+
+fb_image * fb_read_image(char *file)
+{
+	switch(_file_magic(file))
+	{
+	case -1:
+		printf("fb_read_image: open %s error %d\n", file, errno);
 		return NULL;
+	case 0xFFD8:
+		return fb_read_jpeg_image(file);
+	case 0x8950: /*\x89 P*/
+		return fb_read_png_image(file);
+	case 0x716F: /*qo*/
+		return fb_read_qoi_image(file);
+	case 0x4642: /*FB*/
+		return fb_map_image(file);
+	}
+	printf("fb_read_image: unknown format %s\n", file);
+	return NULL;
+}
+
+/*================== decoded image cache ===============*/
+/*按(路径, 修改时间, 文件大小, 解码大小, 解码选项)缓存解码后的图片, 缓存自己持有一个引用;
+ *按路径散列查找; 总大小超过预算时, 从最久没用的开始淘汰没有别人引用的图片. 只在主线程使用*/
+
+#define CACHE_HASH_SIZE	64
+
+typedef struct cache_entry {
+	struct cache_entry *prev, *next; /*LRU链表, 最近使用的在前*/
+	struct cache_entry *hnext; /*散列桶*/
+	unsigned int hash;
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	int w, h;
+	int flags;
+	int bytes;
+	fb_image *image;
+} cache_entry;
+
+static cache_entry *cache_hash[CACHE_HASH_SIZE];
+static cache_entry *cache_head = NULL, *cache_tail = NULL;
+static int cache_budget = 32*1024*1024;
+static fb_cache_stat_t cache_stat;
+
+static unsigned int _path_hash(const char *s)
+{
+	unsigned int h = 2166136261u; /*FNV-1a*/
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void _cache_unlink(cache_entry *e)
+{
+	if(e->prev) e->prev->next = e->next;
+	else cache_head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else cache_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void _cache_push_front(cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache_head;
+	if(cache_head) cache_head->prev = e;
+	else cache_tail = e;
+	cache_head = e;
+}
+
+static void _cache_free_entry(cache_entry *e)
+{
+	cache_entry **pp;
+
+	for(pp = &cache_hash[e->hash % CACHE_HASH_SIZE]; *pp != e; pp = &(*pp)->hnext);
+	*pp = e->hnext;
+	_cache_unlink(e);
+	cache_stat.bytes -= e->bytes;
+	cache_stat.count--;
+	fb_free_image(e->image);
+	free(e);
+}
+
+static void _cache_trim(void)
+{
+	cache_entry *e, *prev;
+	for(e = cache_tail; (e != NULL)&&(cache_stat.bytes > cache_budget); e = prev)
+	{
+		prev = e->prev;
+		if(__atomic_load_n(&_img_storage(_img_block(e->image))->users, __ATOMIC_ACQUIRE) > 1) continue; /*还有克隆在用*/
+		_cache_free_entry(e);
+		cache_stat.evictions++;
 	}
-	memcpy(image->content, slot->bitmap.buffer, slot->bitmap.rows * slot->bitmap.pitch);
+}
 
-	sinfo.advance_x = slot->advance.x >> 6;
-	sinfo.left = slot->bitmap_left;
-	sinfo.top = slot->bitmap_top;
-	if(info) *info = sinfo;
+static fb_image * _cache_decode(char *path, int w, int h, int flags)
+{
+	fb_image *image;
+	int magic = _file_magic(path);
+
+	if(magic == 0x8950) return fb_read_png_image_ex(path, flags);
+	/*PNG等不支持缩放解码, 忽略w/h*/
+	if((w <= 0)||(h <= 0)||(magic != 0xFFD8)) return fb_read_image(path);
+	image = fb_new_image(FB_COLOR_RGB_8880, w, h, 0);
+	if((image != NULL)&&(fb_decode_jpeg_into(path, 0, 0, 0, 0, image, 0, 0, w, h) < 0)) {
+		fb_free_image(image);
+		image = NULL;
+	}
 	return image;
 }
 
+fb_image * fb_cache_get_image(char *path, int w, int h, int flags)
+{
+	struct stat st;
+	cache_entry *e;
+	fb_image *image, *ret;
+	unsigned int hash;
+	int len;
+
+	if(path == NULL) return NULL;
+	if(stat(path, &st) < 0) {
+		printf("fb_cache_get_image: stat %s error %d\n", path, errno);
+		return NULL;
+	}
+	if((w <= 0)||(h <= 0)) w = h = 0;
+	hash = _path_hash(path);
+
+	for(e = cache_hash[hash % CACHE_HASH_SIZE]; e != NULL; e = e->hnext)
+	{
+		if((e->hash != hash)||(e->w != w)||(e->h != h)||(e->flags != flags)||
+			(strcmp(e->path, path) != 0)) continue;
+		if((e->mtime.tv_sec != st.st_mtim.tv_sec)||(e->mtime.tv_nsec != st.st_mtim.tv_nsec)||
+			(e->size != st.st_size)) {
+			/*文件已经改变, 旧的图片由还在用的人释放*/
+			_cache_free_entry(e);
+			cache_stat.evictions++;
+			break;
+		}
+		_cache_unlink(e);
+		_cache_push_front(e);
+		cache_stat.hits++;
+		return fb_clone_image(e->image);
+	}
+
+	cache_stat.misses++;
+	image = _cache_decode(path, w, h, flags);
+	if(image == NULL) return NULL;
+
+	len = strlen(path);
+	e = (cache_entry *)malloc(sizeof(cache_entry) + len + 1);
+	if(e == NULL) return image; /*不缓存, 但也不能让调用者失败*/
+	ret = fb_clone_image(image); /*给调用者自己的头, 写之前fb_image_writable会复制*/
+	if(ret == NULL) {
+		free(e);
+		return image;
+	}
+	e->path = (char *)(e+1);
+	memcpy(e->path, path, len+1);
+	e->mtime = st.st_mtim;
+	e->size = st.st_size;
+	e->w = w;
+	e->h = h;
+	e->flags = flags;
+	e->hash = hash;
+	e->bytes = sizeof(fb_image) + _image_extra(image->color_type) + image->line_byte * image->pixel_h;
+	e->image = image;
+	_cache_push_front(e);
+	e->hnext = cache_hash[hash % CACHE_HASH_SIZE];
+	cache_hash[hash % CACHE_HASH_SIZE] = e;
+	cache_stat.bytes += e->bytes;
+	cache_stat.count++;
+	_cache_trim();
+	return ret;
+}
+
+void fb_cache_put_image(fb_image *image)
+{
+	fb_free_image(image);
+	_cache_trim();
+}
+
+void fb_cache_set_budget(int bytes)
+{
+	cache_budget = bytes;
+	_cache_trim();
+}
+
+void fb_cache_get_stat(fb_cache_stat_t *st)
+{
+	if(st) *st = cache_stat;
+}
+
+/*================== image atlas ===============*/
+/*很多小图标打包在一张大图里(tools/atlaspack生成), 只解码/映射一次;
+ *索引文件每行是"名字 x y w h", 每个图标是大图的一个子图片*/
+
+typedef struct {
+	char *name;
+	fb_image *image;
+} atlas_entry;
+
+struct fb_atlas {
+	fb_image *image;
+	int num;
+	atlas_entry *entries; /*按名字排序*/
+};
+
+static int _atlas_cmp(const void *a, const void *b)
+{
+	return strcmp(((const atlas_entry *)a)->name, ((const atlas_entry *)b)->name);
+}
+
+fb_atlas * fb_atlas_load(char *image_file, char *index_file)
+{
+	char line[256], name[128];
+	int x, y, w, h, cap = 0, failed = 0;
+	atlas_entry *e;
+	fb_atlas *atlas;
+	FILE *fp;
+
+	fp = fopen(index_file, "r");
+	if(fp == NULL) {
+		printf("fb_atlas_load: open %s error %d\n", index_file, errno);
+		return NULL;
+	}
+	atlas = (fb_atlas *)calloc(1, sizeof(fb_atlas));
+	if(atlas == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	atlas->image = fb_read_image(image_file);
+	if(atlas->image == NULL) {
+		fclose(fp);
+		free(atlas);
+		return NULL;
+	}
+
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		if(sscanf(line, "%127s %d %d %d %d", name, &x, &y, &w, &h) != 5) continue;
+		if(atlas->num == cap) {
+			cap = cap ? cap*2 : 32;
+			e = (atlas_entry *)realloc(atlas->entries, cap * sizeof(atlas_entry));
+			if(e == NULL) {
+				failed = 1;
+				break;
+			}
+			atlas->entries = e;
+		}
+		e = &atlas->entries[atlas->num];
+		e->image = fb_get_sub_image(atlas->image, x, y, w, h);
+		if(e->image == NULL) {
+			printf("fb_atlas_load: bad rect for %s\n", name);
+			continue;
+		}
+		e->name = strdup(name);
+		if(e->name == NULL) {
+			fb_free_image(e->image);
+			failed = 1;
+			break;
+		}
+		atlas->num++;
+	}
+	fclose(fp);
+	if(failed) { /*内存不够, 不返回缺了图标的图集*/
+		printf("fb_atlas_load: out of memory loading %s\n", index_file);
+		fb_atlas_free(atlas);
+		return NULL;
+	}
+
+	qsort(atlas->entries, atlas->num, sizeof(atlas_entry), _atlas_cmp);
+	return atlas;
+}
+
+fb_image * fb_atlas_get(fb_atlas *atlas, const char *name)
+{
+	atlas_entry key, *e;
+
+	if((atlas == NULL)||(name == NULL)) return NULL;
+	key.name = (char *)name;
+	e = (atlas_entry *)bsearch(&key, atlas->entries, atlas->num, sizeof(atlas_entry), _atlas_cmp);
+	return e ? e->image : NULL;
+}
+
+void fb_atlas_free(fb_atlas *atlas)
+{
+	int i;
+
+	if(atlas == NULL) return;
+	for(i=0; i<atlas->num; ++i)
+	{
+		fb_free_image(atlas->entries[i].image);
+		free(atlas->entries[i].name);
+	}
+	free(atlas->entries);
+	fb_free_image(atlas->image);
+	free(atlas);
+}
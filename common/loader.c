@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include <sched.h>
+#include <sys/eventfd.h>
+
+/*================== asynchronous image loader ===============*/
+/*解码放到工作线程里做, 工作线程绑定在大核上;
+ *完成的图片通过eventfd通知task_loop, 回调在task_loop的线程里执行*/
+
+#define LOADER_THREAD_MAX	4
+#define CPU_NUM_MAX	16
+
+typedef struct load_job {
+	struct load_job *next;
+	fb_load_opts opts;
+	Load_Func callback;
+	void *arg;
+	fb_image *image;
+	char path[];
+} load_job;
+
+static pthread_mutex_t loader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_cond = PTHREAD_COND_INITIALIZER;
+static load_job *todo_head = NULL, *todo_tail = NULL;
+static load_job *done_head = NULL, *done_tail = NULL;
+static int loader_efd = -1;
+static int loader_threads = 0;
+
+/*找出最高频率的那一组CPU(big.LITTLE中的大核), 返回个数*/
+static int _big_cores(int *cpus)
+{
+	int freq[CPU_NUM_MAX];
+	int i, n = 0, max = 0, num;
+	char name[80];
+	FILE *fp;
+
+	num = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num > CPU_NUM_MAX) num = CPU_NUM_MAX;
+	for(i=0; i<num; ++i)
+	{
+		freq[i] = 0;
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", i);
+		fp = fopen(name, "r");
+		if(fp != NULL) {
+			if(fscanf(fp, "%d", &freq[i]) != 1) freq[i] = 0;
+			fclose(fp);
+		}
+		if(max < freq[i]) max = freq[i];
+	}
+	for(i=0; i<num; ++i)
+	{
+		if(freq[i] == max) cpus[n++] = i; /*读不到频率时max为0, 所有CPU都算*/
+	}
+	return n;
+}
+
+static fb_image * _load_image(load_job *job)
+{
+	fb_decoder *dec;
+	fb_image *image;
+	char buf[16*1024];
+	int fd, n, status;
+
+	fd = open(job->path, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_load_image_async: open %s error %d\n", job->path, errno);
+		return NULL;
+	}
+	n = read(fd, buf, 2);
+	close(fd);
+	/*QOI和.fbi的读取出错不会退出进程, 直接读*/
+	if((n == 2)&&(((buf[0] == 'q')&&(buf[1] == 'o'))||((buf[0] == 'F')&&(buf[1] == 'B'))))
+		return fb_read_image(job->path);
+
+	/*指定了大小的JPEG直接按DCT缩放解码*/
+	if((job->opts.w > 0)&&(job->opts.h > 0)) {
+		if((n == 2)&&((unsigned char)buf[0] == 0xFF)&&((unsigned char)buf[1] == 0xD8)) {
+			image = fb_new_image(FB_COLOR_RGB_8880, job->opts.w, job->opts.h, 0);
+			if(image == NULL) return NULL;
+			if(fb_decode_jpeg_into(job->path, 0, 0, 0, 0, image, 0, 0, job->opts.w, job->opts.h) < 0) {
+				fb_free_image(image);
+				return NULL;
+			}
+			return image;
+		}
+	}
+
+	/*其他情况用增量解码器一次解完, 出错不会退出进程*/
+	fd = open(job->path, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_load_image_async: open %s error %d\n", job->path, errno);
+		return NULL;
+	}
+	dec = fb_decoder_new();
+	if(dec == NULL) {
+		close(fd);
+		return NULL;
+	}
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		fb_decoder_feed(dec, buf, n);
+	fb_decoder_feed_end(dec);
+	close(fd);
+	do {
+		status = fb_decoder_step(dec, 0x7fffffff, NULL, NULL);
+	} while(status == FB_DECODER_MORE);
+	image = (status == FB_DECODER_DONE) ? fb_decoder_take_image(dec) : NULL;
+	fb_decoder_free(dec);
+	return image;
+}
+
+static void * _loader_thread(void *arg)
+{
+	uint64_t one = 1;
+	load_job *job;
+
+	for(;;) {
+		pthread_mutex_lock(&loader_lock);
+		while(todo_head == NULL)
+			pthread_cond_wait(&loader_cond, &loader_lock);
+		job = todo_head;
+		todo_head = job->next;
+		if(todo_head == NULL) todo_tail = NULL;
+		pthread_mutex_unlock(&loader_lock);
+
+		job->image = _load_image(job);
+		job->next = NULL;
+
+		pthread_mutex_lock(&loader_lock);
+		if(done_tail) done_tail->next = job;
+		else done_head = job;
+		done_tail = job;
+		pthread_mutex_unlock(&loader_lock);
+		if(write(loader_efd, &one, sizeof(one)) < 0)
+			printf("loader eventfd write error(%d)\n", errno);
+	}
+	return NULL;
+}
+
+/*task_loop线程: 取出所有完成的任务, 调用回调*/
+static void _loader_event_cb(int fd)
+{
+	uint64_t count;
+	load_job *job, *next;
+
+	if(read(fd, &count, sizeof(count)) < 0) return;
+	pthread_mutex_lock(&loader_lock);
+	job = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&loader_lock);
+
+	for(; job != NULL; job = next)
+	{
+		next = job->next;
+		job->callback(job->image, job->path, job->arg);
+		free(job);
+	}
+}
+
+static int _loader_init(void)
+{
+	int cpus[CPU_NUM_MAX];
+	cpu_set_t set;
+	pthread_t tid;
+	int i, n, e;
+
+	loader_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(loader_efd < 0) {
+		printf("loader eventfd error(%d)\n", errno);
+		return -1;
+	}
+	if(task_add_file(loader_efd, _loader_event_cb) < 0) {
+		close(loader_efd);
+		loader_efd = -1;
+		return -1;
+	}
+
+	n = _big_cores(cpus);
+	if(n > LOADER_THREAD_MAX) n = LOADER_THREAD_MAX;
+	if(n < 1) n = 1;
+	CPU_ZERO(&set);
+	for(i=0; i<n; ++i) CPU_SET(cpus[i], &set);
+	for(i=0; i<n; ++i)
+	{
+		e = pthread_create(&tid, NULL, _loader_thread, NULL);
+		if(e != 0) { /*pthread_create返回错误码, 不设置errno*/
+			printf("create loader thread error(%d): %s\n", e, strerror(e));
+			break;
+		}
+		pthread_setaffinity_np(tid, sizeof(set), &set);
+		pthread_detach(tid);
+		loader_threads++;
+	}
+	if(loader_threads == 0) { /*下次再从头初始化*/
+		task_delete_file(loader_efd);
+		close(loader_efd);
+		loader_efd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int fb_load_image_async(char *path, const fb_load_opts *opts, Load_Func callback, void *arg)
+{
+	load_job *job;
+	int len;
+
+	if((path == NULL)||(callback == NULL)) return -1;
+	if((loader_threads == 0)&&(_loader_init() < 0)) return -1;
+
+	len = strlen(path);
+	job = (load_job *)malloc(sizeof(load_job) + len + 1);
+	if(job == NULL) return -1;
+	memcpy(job->path, path, len+1);
+	if(opts) job->opts = *opts;
+	else memset(&job->opts, 0, sizeof(job->opts));
+	job->callback = callback;
+	job->arg = arg;
+	job->image = NULL;
+	job->next = NULL;
+
+	pthread_mutex_lock(&loader_lock);
+	if(todo_tail) todo_tail->next = job;
+	else todo_head = job;
+	todo_tail = job;
+	pthread_cond_signal(&loader_cond);
+	pthread_mutex_unlock(&loader_lock);
+	return 0;
+}
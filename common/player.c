@@ -0,0 +1,433 @@
+#include "common.h"
+#include <time.h>
+#include <sys/timerfd.h>
+
+/*================== mjpeg / image sequence player ===============*/
+/*读线程按顺序读出每帧的JPEG数据 -> 多个解码线程并行解码 -> 按帧号重排 -> 主线程按时间显示.
+ *显示时间由开始时间和帧号决定, 不会累积误差: 解码线程发现帧已经过了显示时间就不解码,
+ *显示时同一个时刻有多帧就绪只显示最新的一帧, 其余丢弃*/
+
+#define PLAYER_NUM_MAX	2
+#define PLAYER_THREAD_MAX	4
+#define READ_QUEUE_MAX	8	/*读出还没解码的帧*/
+#define REORDER_MAX	4	/*解码完还没显示的帧*/
+#define PLAYER_PREROLL	2	/*开始前预留几帧的时间给解码*/
+#define PLAYER_RETRY_US	2000	/*帧还没解码完时, 隔多久再检查*/
+
+typedef struct {
+	int seq;
+	unsigned char *data;
+	int len;
+} read_frame;
+
+typedef struct {
+	int seq;	/*-1表示空*/
+	fb_image *image;	/*NULL表示被丢弃*/
+} ready_frame;
+
+struct fb_player {
+	/*源*/
+	FILE *avi;	/*MJPEG AVI, 为NULL时是图片序列*/
+	char pattern[256];
+	int first;	/*序列的第一个编号*/
+	int frame_us;
+
+	/*显示*/
+	int x, y, w, h;
+	int timer_fd;
+	long long start_us;
+	int present_seq;	/*下一帧要显示的帧号*/
+	int total;	/*读完后的总帧数, 没读完时是-1*/
+	Player_Func done;
+	void *arg;
+
+	/*线程*/
+	pthread_t reader, decoders[PLAYER_THREAD_MAX];
+	int threads;
+	int running;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/*所有队列的变化都用这一个条件变量通知*/
+	read_frame rq[READ_QUEUE_MAX];
+	int rq_head, rq_num;
+	ready_frame ready[REORDER_MAX];
+
+	/*统计*/
+	int read_num, decoded, presented;
+	int dropped_decode, dropped_present;
+	long long decode_us;
+};
+
+static fb_player *players[PLAYER_NUM_MAX];
+
+static long long _now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/*------------------ source ------------------*/
+static unsigned int _le32(const unsigned char *p)
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+}
+
+/*读出下一个视频帧(##dc/##db块), 没有了返回NULL; 列表直接进入, 其他块跳过*/
+static unsigned char * _avi_next(fb_player *p, int *len)
+{
+	unsigned char hdr[8], *data;
+	unsigned int size;
+
+	while(fread(hdr, 1, 8, p->avi) == 8) {
+		size = _le32(hdr+4);
+		if((memcmp(hdr, "RIFF", 4) == 0)||(memcmp(hdr, "LIST", 4) == 0)) {
+			if(fread(hdr, 1, 4, p->avi) != 4) return NULL; /*列表类型*/
+			continue;
+		}
+		if((hdr[2] == 'd')&&((hdr[3] == 'c')||(hdr[3] == 'b'))&&(size > 0)) {
+			data = (unsigned char *)malloc(size);
+			if(data == NULL) return NULL;
+			if(fread(data, 1, size, p->avi) != size) {
+				free(data);
+				return NULL;
+			}
+			if(size & 1) fseek(p->avi, 1, SEEK_CUR);
+			*len = size;
+			return data;
+		}
+		if(memcmp(hdr, "avih", 4) == 0) {
+			unsigned char avih[4];
+			if(fread(avih, 1, 4, p->avi) != 4) return NULL;
+			if((p->frame_us <= 0)&&(_le32(avih) > 0)) p->frame_us = _le32(avih);
+			size -= 4;
+		}
+		fseek(p->avi, size + (size & 1), SEEK_CUR);
+	}
+	return NULL;
+}
+
+static unsigned char * _seq_read(fb_player *p, int seq, int *len)
+{
+	char path[300];
+	unsigned char *data;
+	struct stat st;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), p->pattern, p->first + seq);
+	fp = fopen(path, "rb");
+	if(fp == NULL) return NULL;
+	data = NULL;
+	if((fstat(fileno(fp), &st) == 0)&&(st.st_size > 0)) {
+		data = (unsigned char *)malloc(st.st_size);
+		if((data != NULL)&&(fread(data, 1, st.st_size, fp) != st.st_size)) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(fp);
+	*len = st.st_size;
+	return data;
+}
+
+/*------------------ threads ------------------*/
+static void * _reader_thread(void *arg)
+{
+	fb_player *p = (fb_player *)arg;
+	unsigned char *data;
+	int seq, len;
+
+	for(seq = 0; ; ++seq) {
+		data = p->avi ? _avi_next(p, &len) : _seq_read(p, seq, &len);
+		pthread_mutex_lock(&p->lock);
+		if(data == NULL) {
+			p->total = seq;
+			pthread_cond_broadcast(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		while((p->rq_num == READ_QUEUE_MAX)&&!p->stop)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if(p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			free(data);
+			break;
+		}
+		read_frame *f = &p->rq[(p->rq_head + p->rq_num) % READ_QUEUE_MAX];
+		f->seq = seq;
+		f->data = data;
+		f->len = len;
+		p->rq_num++;
+		p->read_num++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+static void * _decoder_thread(void *arg)
+{
+	fb_player *p = (fb_player *)arg;
+	read_frame f;
+	fb_image *image;
+	long long t0, due;
+
+	for(;;) {
+		pthread_mutex_lock(&p->lock);
+		while((p->rq_num == 0)&&!p->stop&&(p->total < 0))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if(p->stop||(p->rq_num == 0)) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		f = p->rq[p->rq_head];
+		p->rq_head = (p->rq_head + 1) % READ_QUEUE_MAX;
+		p->rq_num--;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+
+		/*已经过了显示时间的帧不解码*/
+		t0 = _now_us();
+		due = p->start_us + (long long)(f.seq + 1) * p->frame_us;
+		image = NULL;
+		if(t0 < due) {
+			image = fb_decode_jpeg_image(f.data, f.len, p->w, p->h);
+		}
+		free(f.data);
+
+		pthread_mutex_lock(&p->lock);
+		if(image != NULL) {
+			p->decoded++;
+			p->decode_us += _now_us() - t0;
+		} else {
+			p->dropped_decode++;
+		}
+		/*重排队列满了要等显示, 帧号小的总能放进去, 不会死锁*/
+		while((f.seq >= p->present_seq + REORDER_MAX)&&!p->stop)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if(p->stop) {
+			pthread_mutex_unlock(&p->lock);
+			fb_free_image(image);
+			break;
+		}
+		p->ready[f.seq % REORDER_MAX].seq = f.seq;
+		p->ready[f.seq % REORDER_MAX].image = image;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/*------------------ presenter ------------------*/
+static void _arm_timer(fb_player *p, long long at_us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if(at_us <= 0) at_us = 1;
+	its.it_value.tv_sec = at_us / 1000000;
+	its.it_value.tv_nsec = (at_us % 1000000) * 1000;
+	timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void _present(fb_player *p)
+{
+	fb_image *show = NULL;
+	long long now, next;
+	int due, finished;
+
+	now = _now_us();
+	due = (now - p->start_us) / p->frame_us; /*现在应该显示的帧号*/
+
+	pthread_mutex_lock(&p->lock);
+	while(p->present_seq <= due) {
+		ready_frame *r = &p->ready[p->present_seq % REORDER_MAX];
+		if(r->seq != p->present_seq) break; /*还没解码完*/
+		if(r->image != NULL) {
+			if(show != NULL) {
+				fb_free_image(show); /*来不及显示, 直接用更新的一帧*/
+				p->dropped_present++;
+			}
+			show = r->image;
+		}
+		r->seq = -1;
+		r->image = NULL;
+		p->present_seq++;
+		pthread_cond_broadcast(&p->cond);
+	}
+	finished = (p->total >= 0)&&(p->present_seq >= p->total);
+	pthread_mutex_unlock(&p->lock);
+
+	if(show != NULL) {
+		if((show->pixel_w == p->w)&&(show->pixel_h == p->h)) fb_draw_image(p->x, p->y, show, 0);
+		else fb_draw_image_scaled(p->x, p->y, p->w, p->h, show, 0, 0, show->pixel_w, show->pixel_h);
+		fb_update();
+		fb_free_image(show);
+		p->presented++;
+	}
+
+	if(finished) {
+		p->running = 0;
+		if(p->done) p->done(p, p->arg);
+		return;
+	}
+	next = p->start_us + (long long)p->present_seq * p->frame_us;
+	if(next <= now) next = now + PLAYER_RETRY_US; /*这一帧晚了, 等它解码完*/
+	_arm_timer(p, next);
+}
+
+static void _timer_cb(int fd)
+{
+	uint64_t n;
+	int i;
+
+	if(read(fd, &n, sizeof(n)) < 0) return;
+	for(i=0; i<PLAYER_NUM_MAX; ++i)
+	{
+		if(players[i] && (players[i]->timer_fd == fd)) {
+			if(players[i]->running) _present(players[i]);
+			return;
+		}
+	}
+}
+
+/*------------------ public ------------------*/
+fb_player * fb_player_open(char *source, int fps, int threads)
+{
+	fb_player *p;
+	char path[300];
+	int slot;
+
+	if(source == NULL) return NULL;
+	for(slot=0; (slot<PLAYER_NUM_MAX)&&(players[slot] != NULL); ++slot);
+	if(slot == PLAYER_NUM_MAX) {
+		printf("fb_player_open: too many players\n");
+		return NULL;
+	}
+	p = (fb_player *)calloc(1, sizeof(fb_player));
+	if(p == NULL) return NULL;
+	p->frame_us = (fps > 0) ? 1000000 / fps : 0;
+	p->total = -1;
+	p->timer_fd = -1;
+
+	if(strchr(source, '%') != NULL) {
+		/*图片序列, 编号从0或1开始*/
+		snprintf(p->pattern, sizeof(p->pattern), "%s", source);
+		snprintf(path, sizeof(path), source, 0);
+		p->first = (access(path, R_OK) == 0) ? 0 : 1;
+	} else {
+		p->avi = fopen(source, "rb");
+		if(p->avi == NULL) {
+			printf("fb_player_open: open %s error %d\n", source, errno);
+			free(p);
+			return NULL;
+		}
+	}
+
+	if(threads <= 0) threads = 2;
+	if(threads > PLAYER_THREAD_MAX) threads = PLAYER_THREAD_MAX;
+	p->threads = threads;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	players[slot] = p;
+	return p;
+}
+
+int fb_player_start(fb_player *p, int x, int y, int w, int h, Player_Func done, void *arg)
+{
+	int i;
+
+	if((p == NULL)||p->running||(w <= 0)||(h <= 0)) return -1;
+	p->x = x;
+	p->y = y;
+	p->w = w;
+	p->h = h;
+	p->done = done;
+	p->arg = arg;
+	for(i=0; i<REORDER_MAX; ++i) p->ready[i].seq = -1;
+
+	/*AVI的帧率在文件头里, 先读到第一帧再开始计时*/
+	if(p->avi && (p->frame_us <= 0)) {
+		unsigned char hdr[12];
+		long pos = ftell(p->avi);
+		while((p->frame_us <= 0)&&(fread(hdr, 1, 8, p->avi) == 8)) {
+			if((memcmp(hdr, "RIFF", 4) == 0)||(memcmp(hdr, "LIST", 4) == 0)) {
+				if(fread(hdr, 1, 4, p->avi) != 4) break;
+			} else if(memcmp(hdr, "avih", 4) == 0) {
+				if(fread(hdr, 1, 4, p->avi) == 4) p->frame_us = _le32(hdr);
+			} else {
+				fseek(p->avi, _le32(hdr+4) + (_le32(hdr+4) & 1), SEEK_CUR);
+			}
+		}
+		fseek(p->avi, pos, SEEK_SET);
+	}
+	if(p->frame_us <= 0) p->frame_us = 1000000 / 25;
+
+	p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(p->timer_fd < 0) {
+		printf("fb_player_start: timerfd error %d\n", errno);
+		return -1;
+	}
+	if(task_add_file(p->timer_fd, _timer_cb) < 0) {
+		close(p->timer_fd);
+		p->timer_fd = -1;
+		return -1;
+	}
+
+	p->start_us = _now_us() + PLAYER_PREROLL * p->frame_us;
+	p->running = 1;
+	pthread_create(&p->reader, NULL, _reader_thread, p);
+	for(i=0; i<p->threads; ++i)
+		pthread_create(&p->decoders[i], NULL, _decoder_thread, p);
+	_arm_timer(p, p->start_us);
+	return 0;
+}
+
+void fb_player_close(fb_player *p)
+{
+	int i;
+
+	if(p == NULL) return;
+	if(p->timer_fd >= 0) {
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		pthread_join(p->reader, NULL);
+		for(i=0; i<p->threads; ++i) pthread_join(p->decoders[i], NULL);
+		task_delete_file(p->timer_fd);
+		close(p->timer_fd);
+	}
+	for(i=0; i<p->rq_num; ++i) free(p->rq[(p->rq_head + i) % READ_QUEUE_MAX].data);
+	for(i=0; i<REORDER_MAX; ++i) fb_free_image(p->ready[i].image);
+	for(i=0; i<PLAYER_NUM_MAX; ++i)
+		if(players[i] == p) players[i] = NULL;
+	if(p->avi) fclose(p->avi);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p);
+}
+
+void fb_player_get_stat(fb_player *p, fb_player_stat *st)
+{
+	float sec;
+
+	if((p == NULL)||(st == NULL)) return;
+	pthread_mutex_lock(&p->lock);
+	st->read = p->read_num;
+	st->decoded = p->decoded;
+	st->presented = p->presented;
+	st->dropped_decode = p->dropped_decode;
+	st->dropped_present = p->dropped_present;
+	st->read_queue = p->rq_num;
+	st->reorder_queue = 0;
+	for(int i=0; i<REORDER_MAX; ++i)
+		if(p->ready[i].seq >= 0) st->reorder_queue++;
+	st->decode_ms = p->decoded ? p->decode_us / 1000.0f / p->decoded : 0;
+	pthread_mutex_unlock(&p->lock);
+
+	sec = (_now_us() - p->start_us) / 1000000.0f;
+	if(sec <= 0) sec = 1e-6f;
+	st->read_fps = st->read / sec;
+	st->decode_fps = st->decoded / sec;
+	st->present_fps = st->presented / sec;
+}
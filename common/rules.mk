@@ -4,12 +4,13 @@ CROSS_COMPILE := /mnt/d/aclasses/嵌入式系统/实验/嵌入式系统/OrangePi
 CC:=$(CROSS_COMPILE)gcc
 
 CFLAGS:=-Wall -O2
+#CFLAGS += -DFB_RENDER_565 #16位渲染缓冲区, 用于RGB565屏幕或内存带宽不够的板子
 LDFLAGS:=-Wall
 
 INCLUDE := -I../common/external/include
-LIB := -L../common/external/lib -ljpeg -lfreetype -lpng -lasound -lz -lc -lm
+LIB := -L../common/external/lib -ljpeg -lfreetype -lpng -lasound -lz -lpthread -lc -lm
 
-EXESRCS := ../common/graphic.c ../common/touch.c ../common/image.c ../common/task.c $(EXESRCS)
+EXESRCS := ../common/graphic.c ../common/touch.c ../common/image.c ../common/task.c ../common/text.c ../common/sdf.c ../common/decoder.c ../common/loader.c ../common/tiled.c ../common/player.c ../common/camera.c ../common/anim.c ../common/effect.c $(EXESRCS)
 
 EXEOBJS := $(patsubst %.c, %.o, $(EXESRCS))
 
@@ -0,0 +1,411 @@
+#include "common.h"
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SDF_USE_NEON	1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SDF_USE_SSE2	1
+#endif
+
+/*================== signed distance field font ===============*/
+/*每个字只在SDF_REF_SIZE下光栅化一次, 转成距离场存进图集;
+ *任意字号都从同一个图集采样, 再经过阈值/smoothstep得到A8覆盖率.
+ *距离场编码: 128是轮廓, 每个参考像素相差SDF_UNIT, 字内为正*/
+
+#define SDF_REF_SIZE	48	/*参考字号*/
+#define SDF_SPREAD	6	/*轮廓两侧保留的距离(参考像素)*/
+#define SDF_UNIT	(127.0f/SDF_SPREAD)
+
+#define SDF_PAGE_W	1024
+#define SDF_PAGE_H	1024
+#define SDF_PAGE_MAX	4
+#define SDF_HASH_SIZE	512
+#define SDF_FAR	1e20f	/*EDT中的"无穷远", 用有限值避免inf-inf*/
+
+typedef struct sdf_glyph {
+	struct sdf_glyph *next;
+	unsigned int ucs4;
+	fb_image img;	/*图集中的子图片, 和图集页共享内存*/
+	int left, top;	/*距离场图片左上角相对笔位置, 参考像素, 已包含SDF_SPREAD*/
+	int advance_x;	/*参考字号下的步进*/
+	int missing_gen; /*同fb_glyph*/
+} sdf_glyph;
+
+static fb_image *sdf_pages[SDF_PAGE_MAX];
+static int sdf_page_num = 0;
+static int shelf_x = 0, shelf_y = 0, shelf_h = 0; /*当前页的装箱位置*/
+
+static sdf_glyph *sdf_hash[SDF_HASH_SIZE];
+static int sdf_glyph_num = 0;
+
+/*Felzenszwalb 一维平方距离变换*/
+static void _edt_1d(const float *f, float *d, int n, int *v, float *z)
+{
+	int k = 0, q;
+	float s;
+
+	v[0] = 0;
+	z[0] = -SDF_FAR;
+	z[1] = SDF_FAR;
+	for(q=1; q<n; ++q)
+	{
+		for(;;) {
+			s = ((f[q]+q*q) - (f[v[k]]+v[k]*v[k])) / (2*q - 2*v[k]);
+			if((s <= z[k])&&(k > 0)) k--;
+			else break;
+		}
+		if(s <= z[k]) { /*k==0*/
+			v[0] = q;
+			continue;
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = SDF_FAR;
+	}
+	for(k=0,q=0; q<n; ++q)
+	{
+		while(z[k+1] < q) k++;
+		d[q] = (q-v[k])*(q-v[k]) + f[v[k]];
+	}
+}
+
+/*grid中0为目标像素, SDF_FAR为其他; 原地算出到最近目标像素的平方距离*/
+static void _edt_2d(float *grid, int w, int h, float *tmp)
+{
+	int n = (w > h) ? w : h;
+	float *f = tmp, *d = tmp + n, *z = tmp + 2*n;
+	int *v = (int *)(tmp + 3*n + 1);
+	int x, y;
+
+	for(x=0; x<w; ++x)
+	{
+		for(y=0; y<h; ++y) f[y] = grid[y*w + x];
+		_edt_1d(f, d, h, v, z);
+		for(y=0; y<h; ++y) grid[y*w + x] = d[y];
+	}
+	for(y=0; y<h; ++y)
+	{
+		memcpy(f, grid + y*w, w*sizeof(float));
+		_edt_1d(f, grid + y*w, w, v, z);
+	}
+}
+
+/*在图集中分配w*h, 返回页号, 满了返回-1*/
+static int _sdf_alloc(int w, int h, int *px, int *py)
+{
+	if((w > SDF_PAGE_W)||(h > SDF_PAGE_H)) return -1;
+	if((sdf_page_num > 0)&&(shelf_x + w > SDF_PAGE_W)) {
+		shelf_x = 0;
+		shelf_y += shelf_h;
+		shelf_h = 0;
+	}
+	if((sdf_page_num == 0)||(shelf_y + h > SDF_PAGE_H)) {
+		if(sdf_page_num >= SDF_PAGE_MAX) return -1;
+		sdf_pages[sdf_page_num] = fb_new_image(FB_COLOR_ALPHA_8, SDF_PAGE_W, SDF_PAGE_H, 0);
+		if(sdf_pages[sdf_page_num] == NULL) return -1;
+		memset(sdf_pages[sdf_page_num]->content, 0, SDF_PAGE_W*SDF_PAGE_H);
+		sdf_page_num++;
+		shelf_x = shelf_y = shelf_h = 0;
+	}
+	*px = shelf_x;
+	*py = shelf_y;
+	shelf_x += w;
+	if(shelf_h < h) shelf_h = h;
+	return sdf_page_num - 1;
+}
+
+static sdf_glyph * _sdf_make_glyph(unsigned int ucs4)
+{
+	fb_font_info info;
+	fb_image *cov;
+	sdf_glyph *g;
+	float *in, *out, *tmp;
+	int w, h, n, x, y, page, px = 0, py = 0;
+
+	cov = fb_read_glyph_image(ucs4, SDF_REF_SIZE, &info);
+	if(cov == NULL) return NULL;
+	g = (sdf_glyph *)malloc(sizeof(sdf_glyph));
+	if(g == NULL) {
+		fb_free_image(cov);
+		return NULL;
+	}
+	g->ucs4 = ucs4;
+	g->missing_gen = info.missing ? info.font_gen : -1;
+	g->advance_x = info.advance_x;
+	g->left = info.left - SDF_SPREAD;
+	g->top = info.top + SDF_SPREAD;
+	g->img.color_type = FB_COLOR_ALPHA_8;
+	g->img.pixel_w = g->img.pixel_h = 0;
+	g->img.line_byte = 0;
+	g->img.content = NULL;
+	if((cov->pixel_w == 0)||(cov->pixel_h == 0)) { /*空格*/
+		fb_free_image(cov);
+		return g;
+	}
+
+	w = cov->pixel_w + 2*SDF_SPREAD;
+	h = cov->pixel_h + 2*SDF_SPREAD;
+	page = _sdf_alloc(w, h, &px, &py);
+	n = (w > h) ? w : h;
+	in = (float *)malloc((2*w*h + 5*n + 2) * sizeof(float));
+	if((page < 0)||(in == NULL)) {
+		free(in);
+		free(g);
+		fb_free_image(cov);
+		return NULL;
+	}
+	out = in + w*h;
+	tmp = out + w*h;
+
+	/*in: 到最近字内像素的距离, out: 到最近字外像素的距离*/
+	for(y=0; y<h; ++y)
+	{
+		for(x=0; x<w; ++x)
+		{
+			int cx = x - SDF_SPREAD, cy = y - SDF_SPREAD;
+			int a = 0;
+			if((cx >= 0)&&(cy >= 0)&&(cx < cov->pixel_w)&&(cy < cov->pixel_h))
+				a = (unsigned char)cov->content[cy*cov->line_byte + cx];
+			in[y*w + x] = (a >= 128) ? 0 : SDF_FAR;
+			out[y*w + x] = (a >= 128) ? SDF_FAR : 0;
+		}
+	}
+	_edt_2d(in, w, h, tmp);
+	_edt_2d(out, w, h, tmp);
+
+	g->img.pixel_w = w;
+	g->img.pixel_h = h;
+	g->img.line_byte = sdf_pages[page]->line_byte;
+	g->img.content = sdf_pages[page]->content + py*g->img.line_byte + px;
+	for(y=0; y<h; ++y)
+	{
+		unsigned char *dst = (unsigned char *)g->img.content + y*g->img.line_byte;
+		for(x=0; x<w; ++x)
+		{
+			float d = sqrtf(out[y*w + x]) - sqrtf(in[y*w + x]); /*字内为正*/
+			d += (d > 0) ? -0.5f : 0.5f; /*像素中心到轮廓*/
+			int v = (int)(128.0f + d*SDF_UNIT + 0.5f);
+			dst[x] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+		}
+	}
+
+	free(in);
+	fb_free_image(cov);
+	return g;
+}
+
+static sdf_glyph * _sdf_get_glyph(unsigned int ucs4)
+{
+	unsigned int h = ucs4 & (SDF_HASH_SIZE-1);
+	sdf_glyph *g;
+
+	for(g = sdf_hash[h]; g != NULL; g = g->next)
+	{
+		if(g->ucs4 != ucs4) continue;
+		/*加了备用字体以后重新生成, 新的放在表头挡住旧的*/
+		if((g->missing_gen < 0)||(g->missing_gen == font_generation())) return g;
+		break;
+	}
+	g = _sdf_make_glyph(ucs4);
+	if(g == NULL) return NULL;
+	g->next = sdf_hash[h];
+	sdf_hash[h] = g;
+	sdf_glyph_num++;
+	return g;
+}
+
+/*距离值dist[i]转成覆盖率并饱和加到dst[i]:
+ *t = clamp((dist-128)*k + 0.5, 0, 1), cov = t*t*(3-2t)*255 */
+static void _sdf_coverage_row(const unsigned char *dist, unsigned char *dst, int n, float k)
+{
+	int i = 0;
+#if defined(SDF_USE_NEON)
+	float32x4_t vk = vdupq_n_f32(k);
+	float32x4_t vb = vdupq_n_f32(0.5f - 128.0f*k);
+	float32x4_t v0 = vdupq_n_f32(0.0f), v1 = vdupq_n_f32(1.0f);
+	float32x4_t v3 = vdupq_n_f32(3.0f), v255 = vdupq_n_f32(255.0f);
+	for(; i+8 <= n; i += 8)
+	{
+		uint16x8_t d16 = vmovl_u8(vld1_u8(dist + i));
+		float32x4_t t0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(d16)));
+		float32x4_t t1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(d16)));
+		t0 = vminq_f32(vmaxq_f32(vmlaq_f32(vb, t0, vk), v0), v1);
+		t1 = vminq_f32(vmaxq_f32(vmlaq_f32(vb, t1, vk), v0), v1);
+		t0 = vmulq_f32(vmulq_f32(t0, t0), vmlsq_f32(v3, t0, vdupq_n_f32(2.0f)));
+		t1 = vmulq_f32(vmulq_f32(t1, t1), vmlsq_f32(v3, t1, vdupq_n_f32(2.0f)));
+		uint32x4_t c0 = vcvtq_u32_f32(vmlaq_f32(vdupq_n_f32(0.5f), t0, v255));
+		uint32x4_t c1 = vcvtq_u32_f32(vmlaq_f32(vdupq_n_f32(0.5f), t1, v255));
+		uint8x8_t c = vmovn_u16(vcombine_u16(vmovn_u32(c0), vmovn_u32(c1)));
+		vst1_u8(dst + i, vqadd_u8(vld1_u8(dst + i), c));
+	}
+#elif defined(SDF_USE_SSE2)
+	__m128 vk = _mm_set1_ps(k);
+	__m128 vb = _mm_set1_ps(0.5f - 128.0f*k);
+	__m128 v0 = _mm_setzero_ps(), v1 = _mm_set1_ps(1.0f);
+	__m128 v2 = _mm_set1_ps(2.0f), v3 = _mm_set1_ps(3.0f);
+	__m128 v255 = _mm_set1_ps(255.0f), vh = _mm_set1_ps(0.5f);
+	__m128i z = _mm_setzero_si128();
+	for(; i+8 <= n; i += 8)
+	{
+		__m128i d16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(dist + i)), z);
+		__m128 t0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, z));
+		__m128 t1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(d16, z));
+		t0 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(t0, vk), vb), v0), v1);
+		t1 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(t1, vk), vb), v0), v1);
+		t0 = _mm_mul_ps(_mm_mul_ps(t0, t0), _mm_sub_ps(v3, _mm_mul_ps(v2, t0)));
+		t1 = _mm_mul_ps(_mm_mul_ps(t1, t1), _mm_sub_ps(v3, _mm_mul_ps(v2, t1)));
+		__m128i c0 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t0, v255), vh));
+		__m128i c1 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(t1, v255), vh));
+		__m128i c = _mm_packus_epi16(_mm_packs_epi32(c0, c1), z);
+		__m128i o = _mm_loadl_epi64((const __m128i *)(dst + i));
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_adds_epu8(o, c));
+	}
+#endif
+	for(; i < n; ++i)
+	{
+		float t = (dist[i] - 128.0f)*k + 0.5f;
+		if(t < 0.0f) t = 0.0f;
+		if(t > 1.0f) t = 1.0f;
+		int c = dst[i] + (int)(t*t*(3.0f - 2.0f*t)*255.0f + 0.5f);
+		dst[i] = (c > 255) ? 255 : c;
+	}
+}
+
+/*把距离场src按scale双线性缩放, 起点在目标的(fx,fy)(可为小数), 覆盖率累加到dst*/
+static void _sdf_render_glyph(fb_image *dst, fb_image *src, float fx, float fy, float scale, unsigned char *row)
+{
+	int x0 = (int)floorf(fx), y0 = (int)floorf(fy);
+	int w = (int)ceilf(fx + src->pixel_w*scale) - x0;
+	int h = (int)ceilf(fy + src->pixel_h*scale) - y0;
+	int step = (int)(65536.0f/scale);
+	float k = scale / SDF_UNIT; /*一个目标像素对应的距离值跨度的倒数*/
+	int x, y;
+
+	if(x0 < 0) { w += x0; x0 = 0; }
+	if(y0 < 0) { h += y0; y0 = 0; }
+	if(x0 + w > dst->pixel_w) w = dst->pixel_w - x0;
+	if(y0 + h > dst->pixel_h) h = dst->pixel_h - y0;
+
+	for(y=0; y<h; ++y)
+	{
+		/*目标像素中心映射回源坐标, 16.16定点*/
+		int sy = (int)((((y0 + y + 0.5f) - fy)/scale - 0.5f) * 65536.0f);
+		int sx = (int)((((x0 + 0.5f) - fx)/scale - 0.5f) * 65536.0f);
+		int iy = sy >> 16, wy = (sy >> 8) & 0xff;
+		const unsigned char *r0 = NULL, *r1 = NULL;
+		if((iy >= 0)&&(iy < src->pixel_h)) r0 = (unsigned char *)src->content + iy*src->line_byte;
+		if((iy+1 >= 0)&&(iy+1 < src->pixel_h)) r1 = (unsigned char *)src->content + (iy+1)*src->line_byte;
+
+		for(x=0; x<w; ++x, sx += step)
+		{
+			int ix = sx >> 16, wx = (sx >> 8) & 0xff;
+			int a = 0, b = 0, c = 0, d = 0; /*图外距离值为0(很远的字外)*/
+			if((ix >= 0)&&(ix < src->pixel_w)) {
+				if(r0) a = r0[ix];
+				if(r1) c = r1[ix];
+			}
+			if((ix+1 >= 0)&&(ix+1 < src->pixel_w)) {
+				if(r0) b = r0[ix+1];
+				if(r1) d = r1[ix+1];
+			}
+			int top = a*256 + (b-a)*wx;
+			int bot = c*256 + (d-c)*wx;
+			row[x] = (top*256 + (bot-top)*wy) >> 16;
+		}
+		_sdf_coverage_row(row, (unsigned char *)dst->content + (y0+y)*dst->line_byte + x0, w, k);
+	}
+}
+
+/*一次合成的字数; 更长的文本分段合成, 笔位置接着上一段*/
+#define SDF_CHUNK	256
+
+/*把一段字合成到A8画布上, 一次画到屏幕*/
+static void _sdf_draw_chunk(int x, int y, sdf_glyph **glyphs, const float *pens, int count, float scale, int color)
+{
+	static fb_image *canvas = NULL; /*重复使用的A8画布*/
+	static int canvas_w = 0, canvas_h = 0;
+	static unsigned char *row = NULL;
+	static int row_len = 0;
+	int x1 = 0x7fffffff, y1 = 0x7fffffff, x2 = -0x7fffffff, y2 = -0x7fffffff;
+	int i;
+
+	for(i=0; i<count; ++i)
+	{
+		sdf_glyph *g = glyphs[i];
+		int gx1 = (int)floorf(pens[i] + g->left*scale);
+		int gy1 = (int)floorf(-g->top*scale);
+		int gx2 = (int)ceilf(pens[i] + (g->left + g->img.pixel_w)*scale);
+		int gy2 = (int)ceilf((g->img.pixel_h - g->top)*scale);
+		if(x1 > gx1) x1 = gx1;
+		if(y1 > gy1) y1 = gy1;
+		if(x2 < gx2) x2 = gx2;
+		if(y2 < gy2) y2 = gy2;
+	}
+
+	if((canvas == NULL)||(canvas_w < x2-x1)||(canvas_h < y2-y1)) {
+		fb_free_image(canvas);
+		canvas_w = (canvas_w > x2-x1) ? canvas_w : x2-x1;
+		canvas_h = (canvas_h > y2-y1) ? canvas_h : y2-y1;
+		canvas = fb_new_image(FB_COLOR_ALPHA_8, canvas_w, canvas_h, 0);
+		if(canvas == NULL) { canvas_w = canvas_h = 0; return; }
+	}
+	if(row_len < x2-x1+1) {
+		free(row);
+		row_len = x2-x1+1;
+		row = (unsigned char *)malloc(row_len);
+		if(row == NULL) { row_len = 0; return; }
+	}
+	canvas->pixel_w = x2-x1;
+	canvas->pixel_h = y2-y1;
+	for(i=0; i<canvas->pixel_h; ++i)
+		memset(canvas->content + i*canvas->line_byte, 0, canvas->pixel_w);
+
+	for(i=0; i<count; ++i)
+	{
+		sdf_glyph *g = glyphs[i];
+		_sdf_render_glyph(canvas, &g->img,
+			pens[i] + g->left*scale - x1, -g->top*scale - y1, scale, row);
+	}
+	fb_draw_image(x+x1, y+y1, canvas, color);
+}
+
+void fb_draw_sdf_text(int x, int y, char *text, int font_size, int color)
+{
+	sdf_glyph *glyphs[SDF_CHUNK];
+	float pens[SDF_CHUNK];
+	float scale, pen = 0;
+	unsigned int ucs4;
+	int count = 0, n;
+
+	if((text == NULL)||(font_size <= 0)) return;
+	scale = (float)font_size / SDF_REF_SIZE;
+
+	while(*text)
+	{
+		n = fb_utf8_decode(text, &ucs4);
+		if(n == 0) break;
+		text += n;
+		sdf_glyph *g = _sdf_get_glyph(ucs4);
+		if(g == NULL) break;
+		if(g->img.pixel_w > 0) {
+			if(count == SDF_CHUNK) {
+				_sdf_draw_chunk(x, y, glyphs, pens, count, scale, color);
+				count = 0;
+			}
+			glyphs[count] = g;
+			pens[count++] = pen;
+		}
+		pen += g->advance_x * scale;
+	}
+	if(count > 0) _sdf_draw_chunk(x, y, glyphs, pens, count, scale, color);
+	return;
+}
+
+void fb_sdf_stat(int *num, int *bytes)
+{
+	if(num) *num = sdf_glyph_num;
+	if(bytes) *bytes = sdf_page_num * SDF_PAGE_W * SDF_PAGE_H;
+}
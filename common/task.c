@@ -79,18 +79,19 @@ typedef struct {
 	Task_Func callback;
 } myTimer;
 
-#define FILE_NUM_MAX	4
+#define FILE_NUM_MAX	16
 #define TIMER_NUM_MAX	4
 static myFile files[FILE_NUM_MAX];
 static myTimer timers[TIMER_NUM_MAX];
+static Task_Func idles[IDLE_NUM_MAX];
 
-void task_add_file(int fd, Task_Func callback)
+int task_add_file(int fd, Task_Func callback)
 {
 	int i, n;
 
 	if((fd == -1)||(callback == NULL)) {
 		printf("error: fd=%d, callback=%p\n", fd, callback);
-		return;
+		return -1;
 	}
 
 	for(i=0,n=-1; i<FILE_NUM_MAX; ++i)
@@ -101,17 +102,17 @@ void task_add_file(int fd, Task_Func callback)
 		}
 		if(files[i].fd == fd) {
 			printf("fd %d repeat\n", fd);
-			return;
+			return -1;
 		}
 	}
 	
 	if(n < 0) {
 		printf("add file too many\n");
-		return;
+		return -1;
 	}
 	files[n].fd = fd;
 	files[n].callback = callback;
-	return;
+	return 0;
 }
 
 void task_add_timer(myTime period, Task_Func callback)
@@ -172,6 +173,45 @@ void task_delete_timer(int period)
 	return;
 }
 
+void task_add_idle(Task_Func callback)
+{
+	int i, n;
+
+	if(callback == NULL) {
+		printf("error: callback=%p\n", callback);
+		return;
+	}
+
+	for(i=0,n=-1; i<IDLE_NUM_MAX; ++i)
+	{
+		if(idles[i] == NULL) {
+			n = i;
+			continue;
+		}
+		if(idles[i] == callback) return; /*已经添加过*/
+	}
+
+	if(n < 0) {
+		printf("add idle too many\n");
+		return;
+	}
+	idles[n] = callback;
+	return;
+}
+
+void task_delete_idle(Task_Func callback)
+{
+	int i;
+	for(i=0; i<IDLE_NUM_MAX; ++i)
+	{
+		if(idles[i] == callback) {
+			idles[i] = NULL;
+			break;
+		}
+	}
+	return;
+}
+
 static void _check_and_do_task(void)
 {
 	fd_set rfds;
@@ -194,6 +234,10 @@ static void _check_and_do_task(void)
 		if(temp <= 0) timeout = 0; /*已经到时间点了*/
 		else if((timeout == -1)||(timeout > temp)) timeout = temp;
 	}
+	for(i=0; i<IDLE_NUM_MAX; ++i)
+	{
+		if(idles[i] != NULL) timeout = 0; /*有空闲任务时只轮询, 不等待*/
+	}
 	if(timeout >= 0) {
 		to.tv_sec = timeout/1000;
 		to.tv_usec = (timeout%1000)*1000;
@@ -244,6 +288,12 @@ static void _check_and_do_task(void)
 			ptimer->callback(ptimer->period);
 		}
 	}
+
+	/*每轮处理完文件和定时器后, 每个空闲任务执行一次*/
+	for(i=0; i<IDLE_NUM_MAX; ++i)
+	{
+		if(idles[i] != NULL) idles[i](0);
+	}
 	return;
 }
 
@@ -0,0 +1,693 @@
+#include "common.h"
+
+/*================== glyph store ===============*/
+/*字形按(ucs4, 字号)缓存, 只增不减; 同一个字只向FreeType要一次.
+ *渲染线程和预热线程都会插入: 新字形先填好, 再用CAS挂到桶的链表头发布,
+ *已发布的字形不再修改, 所以读的一方不需要加锁*/
+
+#define GLYPH_HASH_SIZE	1024
+
+static fb_glyph *glyph_hash[GLYPH_HASH_SIZE];
+static int glyph_num = 0;
+static int glyph_bytes = 0;
+
+static inline unsigned int _glyph_hash(unsigned int ucs4, int pixel_size)
+{
+	return (ucs4 * 31 + pixel_size) & (GLYPH_HASH_SIZE-1);
+}
+
+/*在链表[g, stop)中查找; 新插入的在前面, 加了备用字体以后重新读的字会挡住旧的.notdef*/
+static fb_glyph * _glyph_find(fb_glyph *g, fb_glyph *stop, unsigned int ucs4, int pixel_size)
+{
+	for(; g != stop; g = g->next)
+	{
+		if((g->ucs4 == ucs4)&&(g->pixel_size == pixel_size))
+			return g;
+	}
+	return NULL;
+}
+
+/*没有这个字时读到的.notdef, 之后字体栈又变了, 要重新读*/
+static inline int _glyph_stale(const fb_glyph *g)
+{
+	return (g->missing_gen >= 0)&&(g->missing_gen != font_generation());
+}
+
+/*光栅化一个字并发布到缓存; head是查找时看到的桶头, 之后别的线程插入的部分要重新查一次*/
+static const fb_glyph * _glyph_add(font_ctx *ctx, unsigned int ucs4, int pixel_size, fb_glyph *head)
+{
+	unsigned int h = _glyph_hash(ucs4, pixel_size);
+	fb_glyph *g, *dup, *stop = head;
+	fb_font_info info;
+
+	g = (fb_glyph *)malloc(sizeof(fb_glyph));
+	if(g == NULL) return NULL;
+	if(ctx) g->image = fb_read_glyph_image_ctx(ctx, ucs4, pixel_size, &info);
+	else g->image = fb_read_glyph_image(ucs4, pixel_size, &info);
+	if(g->image == NULL) {
+		free(g);
+		return NULL;
+	}
+	g->ucs4 = ucs4;
+	g->pixel_size = pixel_size;
+	g->advance_x = info.advance_x;
+	g->left = info.left;
+	g->top = info.top;
+	g->missing_gen = info.missing ? info.font_gen : -1;
+
+	head = __atomic_load_n(&glyph_hash[h], __ATOMIC_ACQUIRE);
+	for(;;) {
+		dup = _glyph_find(head, stop, ucs4, pixel_size);
+		if(dup != NULL) { /*别的线程抢先了*/
+			fb_free_image(g->image);
+			free(g);
+			return dup;
+		}
+		g->next = head;
+		if(__atomic_compare_exchange_n(&glyph_hash[h], &head, g, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			break;
+		stop = g->next; /*失败时head已更新为新的桶头*/
+	}
+	__atomic_fetch_add(&glyph_num, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&glyph_bytes, sizeof(fb_glyph) + sizeof(fb_image) + g->image->line_byte * g->image->pixel_h, __ATOMIC_RELAXED);
+	return g;
+}
+
+const fb_glyph *fb_get_glyph(unsigned int ucs4, int pixel_size)
+{
+	unsigned int h = _glyph_hash(ucs4, pixel_size);
+	fb_glyph *head, *g;
+
+	head = __atomic_load_n(&glyph_hash[h], __ATOMIC_ACQUIRE);
+	g = _glyph_find(head, NULL, ucs4, pixel_size);
+	if((g != NULL)&&!_glyph_stale(g)) return g;
+	return _glyph_add(NULL, ucs4, pixel_size, head);
+}
+
+void fb_glyph_stat(int *num, int *bytes)
+{
+	if(num) *num = __atomic_load_n(&glyph_num, __ATOMIC_RELAXED);
+	if(bytes) *bytes = __atomic_load_n(&glyph_bytes, __ATOMIC_RELAXED);
+}
+
+/*================== glyph prewarm ===============*/
+/*在后台线程中提前光栅化下一屏要用的字, 结果直接发布到字形缓存.
+ *预热线程使用克隆的字体上下文, 不和渲染线程争用FreeType*/
+
+typedef struct prewarm_job {
+	struct prewarm_job *next;
+	int font_size;
+	int num;
+	unsigned int ucs4[];
+} prewarm_job;
+
+static pthread_mutex_t prewarm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prewarm_cond = PTHREAD_COND_INITIALIZER;
+static prewarm_job *prewarm_head = NULL, *prewarm_tail = NULL;
+static int prewarm_pending = 0; /*还没处理的字数*/
+static int prewarm_started = 0;
+static font_ctx *prewarm_ctx = NULL;
+
+static void * _prewarm_thread(void *arg)
+{
+	prewarm_job *job;
+	int i;
+
+	for(;;) {
+		pthread_mutex_lock(&prewarm_lock);
+		while(prewarm_head == NULL)
+			pthread_cond_wait(&prewarm_cond, &prewarm_lock);
+		job = prewarm_head;
+		prewarm_head = job->next;
+		if(prewarm_head == NULL) prewarm_tail = NULL;
+		pthread_mutex_unlock(&prewarm_lock);
+
+		for(i=0; i<job->num; ++i)
+		{
+			unsigned int ucs4 = job->ucs4[i];
+			unsigned int h = _glyph_hash(ucs4, job->font_size);
+			fb_glyph *head = __atomic_load_n(&glyph_hash[h], __ATOMIC_ACQUIRE);
+			if(_glyph_find(head, NULL, ucs4, job->font_size) == NULL)
+				_glyph_add(prewarm_ctx, ucs4, job->font_size, head);
+			__atomic_fetch_sub(&prewarm_pending, 1, __ATOMIC_RELAXED);
+		}
+		free(job);
+	}
+	return NULL;
+}
+
+int fb_prewarm_codepoints(const unsigned int *ucs4, int num, int font_size)
+{
+	prewarm_job *job;
+	pthread_t tid;
+
+	if((ucs4 == NULL)||(num <= 0)||(font_size <= 0)) return -1;
+
+	if(!prewarm_started) {
+		prewarm_ctx = font_ctx_clone();
+		if(prewarm_ctx == NULL) return -1;
+		if(pthread_create(&tid, NULL, _prewarm_thread, NULL) != 0) {
+			printf("create prewarm thread: error %d\n", errno);
+			font_ctx_free(prewarm_ctx);
+			prewarm_ctx = NULL;
+			return -1;
+		}
+		pthread_detach(tid);
+		prewarm_started = 1;
+	}
+
+	job = (prewarm_job *)malloc(sizeof(prewarm_job) + num*sizeof(unsigned int));
+	if(job == NULL) return -1;
+	job->next = NULL;
+	job->font_size = font_size;
+	job->num = num;
+	memcpy(job->ucs4, ucs4, num*sizeof(unsigned int));
+
+	pthread_mutex_lock(&prewarm_lock);
+	if(prewarm_tail) prewarm_tail->next = job;
+	else prewarm_head = job;
+	prewarm_tail = job;
+	__atomic_fetch_add(&prewarm_pending, num, __ATOMIC_RELAXED);
+	pthread_cond_signal(&prewarm_cond);
+	pthread_mutex_unlock(&prewarm_lock);
+	return 0;
+}
+
+int fb_prewarm_text(const char *text, int font_size)
+{
+	unsigned int *codes;
+	int len, num = 0, n, ret;
+
+	if(text == NULL) return -1;
+	len = strlen(text);
+	codes = (unsigned int *)malloc(len * sizeof(unsigned int) + 1);
+	if(codes == NULL) return -1;
+	while(*text)
+	{
+		n = fb_utf8_decode(text, &codes[num]);
+		if(n == 0) break;
+		text += n;
+		if(codes[num] != '\n') num++;
+	}
+	ret = (num > 0) ? fb_prewarm_codepoints(codes, num, font_size) : 0;
+	free(codes);
+	return ret;
+}
+
+int fb_prewarm_pending(void)
+{
+	return __atomic_load_n(&prewarm_pending, __ATOMIC_RELAXED);
+}
+
+void fb_prewarm_cancel(void)
+{
+	prewarm_job *job, *next;
+	int num = 0;
+
+	pthread_mutex_lock(&prewarm_lock);
+	job = prewarm_head;
+	prewarm_head = prewarm_tail = NULL;
+	pthread_mutex_unlock(&prewarm_lock);
+	for(; job != NULL; job = next)
+	{
+		next = job->next;
+		num += job->num;
+		free(job);
+	}
+	__atomic_fetch_sub(&prewarm_pending, num, __ATOMIC_RELAXED);
+}
+
+/*================== measure ===============*/
+
+int fb_measure_text(const char *text, int font_size, fb_text_metrics *m)
+{
+	const fb_glyph *g;
+	unsigned int ucs4;
+	int n, width = 0, ascent = 0, descent = 0;
+
+	while(*text)
+	{
+		n = fb_utf8_decode(text, &ucs4);
+		if(n == 0) break;
+		text += n;
+		g = fb_get_glyph(ucs4, font_size);
+		if(g == NULL) break;
+		width += g->advance_x;
+		if(ascent < g->top) ascent = g->top;
+		if(descent < g->image->pixel_h - g->top) descent = g->image->pixel_h - g->top;
+	}
+	if(m) {
+		m->width = width;
+		m->ascent = ascent;
+		m->descent = descent;
+	}
+	return width;
+}
+
+/*================== layout ===============*/
+/*布局按(文本, 字号, 行宽, 字体栈版本)缓存, 超过LAYOUT_CACHE_MAX个后淘汰最久没用的*/
+
+#define LAYOUT_CACHE_MAX	64
+
+static fb_text_layout *layout_head = NULL; /*最近使用的在前*/
+static int layout_num = 0;
+
+static unsigned int _str_hash(const char *s)
+{
+	unsigned int h = 2166136261u; /*FNV-1a*/
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*CJK字符前后都可以断行, 西文只在空格后断行*/
+static inline int _is_cjk(unsigned int ucs4)
+{
+	return (ucs4 >= 0x2E80);
+}
+
+static fb_text_layout * _do_layout(const char *text, int font_size, int max_width)
+{
+	fb_text_layout *lo;
+	const fb_glyph **glyphs;
+	unsigned int *codes;
+	unsigned int ucs4;
+	int len = strlen(text);
+	int count = 0, n, i;
+
+	glyphs = (const fb_glyph **)malloc(len * (sizeof(fb_glyph *) + sizeof(unsigned int)) + 1);
+	if(glyphs == NULL) return NULL;
+	codes = (unsigned int *)(glyphs + len);
+	for(i=0; i<len; i+=n)
+	{
+		n = fb_utf8_decode(text+i, &ucs4);
+		if(n == 0) break;
+		if(ucs4 != '\n') {
+			glyphs[count] = fb_get_glyph(ucs4, font_size);
+			if(glyphs[count] == NULL) break;
+		} else {
+			glyphs[count] = NULL;
+		}
+		codes[count++] = ucs4;
+	}
+
+	lo = (fb_text_layout *)malloc(sizeof(fb_text_layout) + count*sizeof(fb_layout_item) + len + 1);
+	if(lo == NULL) {
+		free(glyphs);
+		return NULL;
+	}
+	lo->items = (fb_layout_item *)(lo+1);
+	lo->text = (char *)(lo->items + count);
+	memcpy(lo->text, text, len+1);
+	lo->hash = _str_hash(text);
+	lo->font_size = font_size;
+	lo->font_gen = font_generation();
+	lo->max_width = max_width;
+	lo->line_height = fb_font_line_height(font_size);
+	lo->line_num = 0;
+	lo->item_num = 0;
+	lo->width = 0;
+	lo->x1 = lo->y1 = 0x7fffffff;
+	lo->x2 = lo->y2 = -0x7fffffff;
+
+	int start = 0;
+	while(start < count)
+	{
+		int end, next, k, w = 0, brk = -1;
+
+		/*找出本行的结束位置end(不含), 以及下一行的开始位置next*/
+		for(k=start; k<count; ++k)
+		{
+			if(codes[k] == '\n') break;
+			if((k > start)&&(_is_cjk(codes[k])||_is_cjk(codes[k-1])||(codes[k-1] == ' ')))
+				brk = k;
+			if((max_width > 0)&&(k > start)&&(w + glyphs[k]->advance_x > max_width))
+				break;
+			w += glyphs[k]->advance_x;
+		}
+		if((k < count)&&(codes[k] != '\n')&&(brk > start)) end = brk;
+		else end = k;
+		next = end;
+		if((next < count)&&(codes[next] == '\n')) next++;
+		else while((next < count)&&(codes[next] == ' ')) next++; /*自动折行时丢掉行首空格*/
+
+		int pen_x = 0;
+		int base_y = lo->line_num * lo->line_height;
+		for(k=start; k<end; ++k)
+		{
+			const fb_glyph *g = glyphs[k];
+			fb_image *img = g->image;
+			if((img->pixel_w > 0)&&(img->pixel_h > 0)) {
+				fb_layout_item *it = &lo->items[lo->item_num++];
+				it->glyph = g;
+				it->x = pen_x + g->left;
+				it->y = base_y - g->top;
+				if(lo->x1 > it->x) lo->x1 = it->x;
+				if(lo->y1 > it->y) lo->y1 = it->y;
+				if(lo->x2 < it->x + img->pixel_w) lo->x2 = it->x + img->pixel_w;
+				if(lo->y2 < it->y + img->pixel_h) lo->y2 = it->y + img->pixel_h;
+			}
+			pen_x += g->advance_x;
+		}
+		if(lo->width < pen_x) lo->width = pen_x;
+		lo->line_num++;
+		start = next;
+	}
+	if(lo->item_num == 0) lo->x1 = lo->y1 = lo->x2 = lo->y2 = 0;
+	if(lo->line_num == 0) lo->line_num = 1;
+
+	free(glyphs);
+	return lo;
+}
+
+const fb_text_layout *fb_layout_text(const char *text, int font_size, int max_width)
+{
+	fb_text_layout *lo, **pp;
+	unsigned int h;
+	int gen;
+
+	if((text == NULL)||(font_size <= 0)) return NULL;
+	h = _str_hash(text);
+	gen = font_generation();
+	for(pp = &layout_head; (lo = *pp) != NULL; pp = &lo->next)
+	{
+		if((lo->hash == h)&&(lo->font_size == font_size)&&(lo->max_width == max_width)&&
+			(lo->font_gen == gen)&&(strcmp(lo->text, text) == 0)) {
+			*pp = lo->next; /*移到表头*/
+			lo->next = layout_head;
+			layout_head = lo;
+			return lo;
+		}
+	}
+
+	lo = _do_layout(text, font_size, max_width);
+	if(lo == NULL) return NULL;
+	lo->next = layout_head;
+	layout_head = lo;
+	if(++layout_num > LAYOUT_CACHE_MAX) {
+		/*淘汰表尾*/
+		for(pp = &layout_head; (*pp)->next != NULL; pp = &(*pp)->next);
+		free(*pp);
+		*pp = NULL;
+		layout_num--;
+	}
+	return lo;
+}
+
+/*================== text run cache ===============*/
+/*静态文本(按钮, 表头)整串预先合成一张A8图片, 画的时候只需一次fb_draw_image.
+ *只有fb_draw_label走这里, 经常变化的文本用fb_draw_text逐字画, 不占缓存.
+ *按(文本, 字号, 字体栈版本)散列查找, 总大小超过TEXT_RUN_BUDGET时淘汰最久没用的;
+ *加了备用字体以后旧版本的不再命中, 慢慢被淘汰*/
+
+#define TEXT_RUN_BUDGET	(2*1024*1024)
+#define RUN_HASH_SIZE	256
+
+static fb_text_run *run_hash[RUN_HASH_SIZE];
+static fb_text_run *run_head = NULL, *run_tail = NULL; /*最近使用的在前*/
+static int run_num = 0;
+static int run_bytes = 0;
+
+static inline int _run_size(fb_text_run *run)
+{
+	return sizeof(fb_text_run) + strlen(run->text) + 1 +
+		sizeof(fb_image) + run->image->line_byte * run->image->pixel_h;
+}
+
+static inline unsigned int _run_bucket(unsigned int hash, int font_size)
+{
+	return (hash ^ (font_size * 0x9E3779B1u)) & (RUN_HASH_SIZE-1);
+}
+
+/*A8图片src盖到dst的(x,y)上; 字形之间可能重叠, 和逐个混合画上去的结果一样*/
+static void _a8_over(fb_image *dst, int x, int y, const fb_image *src)
+{
+	unsigned char *d = (unsigned char *)dst->content + y*dst->line_byte + x;
+	const unsigned char *sp = (const unsigned char *)src->content;
+	int row, col;
+	for(row = 0; row < src->pixel_h; ++row){
+		for(col = 0; col < src->pixel_w; ++col)
+			d[col] = d[col] + sp[col] - d[col]*sp[col]/255;
+		d += dst->line_byte;
+		sp += src->line_byte;
+	}
+}
+
+/*和fb_draw_text一样逐字排在一行上*/
+static fb_text_run * _make_run(const char *text, int font_size, unsigned int hash)
+{
+	const fb_glyph *g;
+	fb_text_run *run;
+	unsigned int ucs4;
+	const char *p;
+	int n, len, pen = 0;
+	int x1 = 0x7fffffff, y1 = 0x7fffffff, x2 = -0x7fffffff, y2 = -0x7fffffff;
+
+	for(p = text; *p; p += n)
+	{
+		n = fb_utf8_decode(p, &ucs4);
+		if(n == 0) break;
+		g = fb_get_glyph(ucs4, font_size);
+		if(g == NULL) break;
+		if((g->image->pixel_w > 0)&&(g->image->pixel_h > 0)) {
+			if(x1 > pen + g->left) x1 = pen + g->left;
+			if(y1 > -g->top) y1 = -g->top;
+			if(x2 < pen + g->left + g->image->pixel_w) x2 = pen + g->left + g->image->pixel_w;
+			if(y2 < g->image->pixel_h - g->top) y2 = g->image->pixel_h - g->top;
+		}
+		pen += g->advance_x;
+	}
+	if(x2 <= x1) return NULL; /*没有可见的字*/
+	if((x2-x1)*(y2-y1) > TEXT_RUN_BUDGET/8) return NULL; /*太大的不值得缓存*/
+
+	len = strlen(text);
+	run = (fb_text_run *)malloc(sizeof(fb_text_run) + len + 1);
+	if(run == NULL) return NULL;
+	run->image = fb_new_image(FB_COLOR_ALPHA_8, x2-x1, y2-y1, 0);
+	if(run->image == NULL) {
+		free(run);
+		return NULL;
+	}
+	run->text = (char *)(run+1);
+	memcpy(run->text, text, len+1);
+	run->hash = hash;
+	run->font_size = font_size;
+	run->font_gen = font_generation();
+	run->x = x1;
+	run->y = y1;
+	run->width = pen;
+	memset(run->image->content, 0, run->image->line_byte * (y2-y1));
+
+	pen = 0;
+	for(p = text; *p; p += n)
+	{
+		n = fb_utf8_decode(p, &ucs4);
+		if(n == 0) break;
+		g = fb_get_glyph(ucs4, font_size);
+		if(g == NULL) break;
+		if((g->image->pixel_w > 0)&&(g->image->pixel_h > 0))
+			_a8_over(run->image, pen + g->left - x1, -g->top - y1, g->image);
+		pen += g->advance_x;
+	}
+	return run;
+}
+
+static void _run_unlink(fb_text_run *run)
+{
+	fb_text_run **pp;
+
+	if(run->prev) run->prev->next = run->next;
+	else run_head = run->next;
+	if(run->next) run->next->prev = run->prev;
+	else run_tail = run->prev;
+
+	for(pp = &run_hash[_run_bucket(run->hash, run->font_size)]; *pp != run; pp = &(*pp)->hnext);
+	*pp = run->hnext;
+}
+
+static void _run_push_front(fb_text_run *run)
+{
+	run->prev = NULL;
+	run->next = run_head;
+	if(run_head) run_head->prev = run;
+	else run_tail = run;
+	run_head = run;
+}
+
+const fb_text_run *fb_get_text_run(const char *text, int font_size)
+{
+	fb_text_run *run, *old;
+	unsigned int h, b;
+	int gen;
+
+	if((text == NULL)||(font_size <= 0)) return NULL;
+	h = _str_hash(text);
+	b = _run_bucket(h, font_size);
+	gen = font_generation();
+	for(run = run_hash[b]; run != NULL; run = run->hnext)
+	{
+		if((run->hash == h)&&(run->font_size == font_size)&&(run->font_gen == gen)&&
+			(strcmp(run->text, text) == 0)) {
+			if(run != run_head) { /*移到表头*/
+				if(run->prev) run->prev->next = run->next;
+				if(run->next) run->next->prev = run->prev;
+				else run_tail = run->prev;
+				_run_push_front(run);
+			}
+			return run;
+		}
+	}
+
+	run = _make_run(text, font_size, h);
+	if(run == NULL) return NULL;
+	_run_push_front(run);
+	run->hnext = run_hash[b];
+	run_hash[b] = run;
+	run_num++;
+	run_bytes += _run_size(run);
+
+	/*超出预算, 从表尾淘汰, 刚加入的不淘汰*/
+	while((run_bytes > TEXT_RUN_BUDGET)&&(run_tail != run)) {
+		old = run_tail;
+		_run_unlink(old);
+		run_bytes -= _run_size(old);
+		run_num--;
+		fb_free_image(old->image);
+		free(old);
+	}
+	return run;
+}
+
+void fb_text_run_stat(int *num, int *bytes)
+{
+	if(num) *num = run_num;
+	if(bytes) *bytes = run_bytes;
+}
+
+/*================== digit strip ===============*/
+/*"0123456789-"拼在一张A8图片里, 每个字符是其中的一个子图片;
+ *计数器之类经常变化的数字从这里取字, 整个数值先拼成一张图片再画一次*/
+
+#define DIGIT_STRIP_MAX	8	/*缓存的字号个数*/
+#define DIGIT_NUM	11
+
+typedef struct {
+	int font_size;
+	int font_gen;
+	fb_image *strip;
+	fb_image *digit[DIGIT_NUM]; /*fb_get_sub_image, 和strip共享颜色内存*/
+	int left[DIGIT_NUM], top[DIGIT_NUM], advance[DIGIT_NUM];
+} digit_strip;
+
+static digit_strip digit_strips[DIGIT_STRIP_MAX];
+static int digit_strip_next = 0;
+
+static void _free_digit_strip(digit_strip *ds)
+{
+	int i;
+	for(i=0; i<DIGIT_NUM; ++i)
+	{
+		fb_free_image(ds->digit[i]);
+		ds->digit[i] = NULL;
+	}
+	fb_free_image(ds->strip);
+	ds->strip = NULL;
+}
+
+static digit_strip * _get_digit_strip(int font_size)
+{
+	static const char chars[DIGIT_NUM] = "0123456789-";
+	const fb_glyph *g[DIGIT_NUM];
+	digit_strip *ds;
+	int i, row, w = 0, h = 0, x = 0;
+
+	for(i=0; i<DIGIT_STRIP_MAX; ++i)
+	{
+		if((digit_strips[i].strip != NULL)&&(digit_strips[i].font_size == font_size)&&
+			(digit_strips[i].font_gen == font_generation()))
+			return &digit_strips[i];
+	}
+
+	for(i=0; i<DIGIT_NUM; ++i)
+	{
+		g[i] = fb_get_glyph(chars[i], font_size);
+		if(g[i] == NULL) return NULL;
+		w += g[i]->image->pixel_w;
+		if(h < g[i]->image->pixel_h) h = g[i]->image->pixel_h;
+	}
+
+	ds = &digit_strips[digit_strip_next];
+	digit_strip_next = (digit_strip_next+1) % DIGIT_STRIP_MAX;
+	_free_digit_strip(ds);
+	ds->strip = fb_new_image(FB_COLOR_ALPHA_8, w, h, 0);
+	if(ds->strip == NULL) return NULL;
+	ds->font_size = font_size;
+	ds->font_gen = font_generation();
+
+	for(i=0; i<DIGIT_NUM; ++i)
+	{
+		fb_image *src = g[i]->image;
+		fb_image *d = fb_get_sub_image(ds->strip, x, 0, src->pixel_w, src->pixel_h);
+		if(d == NULL) {
+			_free_digit_strip(ds);
+			return NULL;
+		}
+		for(row=0; row<src->pixel_h; ++row)
+			memcpy(d->content + row*d->line_byte, src->content + row*src->line_byte, src->pixel_w);
+		ds->digit[i] = d;
+		ds->left[i] = g[i]->left;
+		ds->top[i] = g[i]->top;
+		ds->advance[i] = g[i]->advance_x;
+		x += src->pixel_w;
+	}
+	return ds;
+}
+
+void fb_draw_number(int x, int y, int value, int font_size, int color)
+{
+	static fb_image *canvas = NULL; /*重复使用的A8画布*/
+	static int canvas_w = 0, canvas_h = 0;
+	char buf[16];
+	digit_strip *ds;
+	int i, d, pen = 0;
+	int x1 = 0x7fffffff, y1 = 0x7fffffff, x2 = -0x7fffffff, y2 = -0x7fffffff;
+
+	ds = _get_digit_strip(font_size);
+	if(ds == NULL) return;
+	sprintf(buf, "%d", value);
+	for(i=0; buf[i]; ++i)
+	{
+		d = (buf[i] == '-') ? 10 : buf[i] - '0';
+		if(x1 > pen + ds->left[d]) x1 = pen + ds->left[d];
+		if(y1 > -ds->top[d]) y1 = -ds->top[d];
+		if(x2 < pen + ds->left[d] + ds->digit[d]->pixel_w) x2 = pen + ds->left[d] + ds->digit[d]->pixel_w;
+		if(y2 < ds->digit[d]->pixel_h - ds->top[d]) y2 = ds->digit[d]->pixel_h - ds->top[d];
+		pen += ds->advance[d];
+	}
+	if((x2 <= x1)||(y2 <= y1)) return;
+
+	if((canvas == NULL)||(canvas_w < x2-x1)||(canvas_h < y2-y1)) {
+		fb_free_image(canvas);
+		canvas_w = (canvas_w > x2-x1) ? canvas_w : x2-x1;
+		canvas_h = (canvas_h > y2-y1) ? canvas_h : y2-y1;
+		canvas = fb_new_image(FB_COLOR_ALPHA_8, canvas_w, canvas_h, 0);
+		if(canvas == NULL) { canvas_w = canvas_h = 0; return; }
+	}
+	canvas->pixel_w = x2-x1;
+	canvas->pixel_h = y2-y1;
+	for(i=0; i<canvas->pixel_h; ++i)
+		memset(canvas->content + i*canvas->line_byte, 0, canvas->pixel_w);
+
+	/*整个数值拼好以后只画一次*/
+	pen = 0;
+	for(i=0; buf[i]; ++i)
+	{
+		d = (buf[i] == '-') ? 10 : buf[i] - '0';
+		_a8_over(canvas, pen + ds->left[d] - x1, -ds->top[d] - y1, ds->digit[d]);
+		pen += ds->advance[d];
+	}
+	fb_draw_image(x+x1, y+y1, canvas, color);
+	return;
+}
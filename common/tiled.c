@@ -0,0 +1,545 @@
+#include "common.h"
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+#include <png.h>
+
+/*================== tiled image viewer ===============*/
+/*比内存还大的图片: 第一次打开时切成TILE_SIZE的小块, 再逐级缩小一半生成金字塔,
+ *每块存成一个QOI文件; 显示时只读取和视口相交的、当前缩放级别的块.
+ *块缓存在LRU里, 读取和沿平移方向的预取都交给loader的工作线程*/
+
+#define TILE_SIZE	256
+#define TILE_CACHE_MAX	64	/*RGB_8880的块每块256KB, 共16MB*/
+#define TILE_PENDING_MAX	8	/*同时在后台读取的块数*/
+#define TILE_FALLBACK	4	/*块还没读到时, 最多往上找几级, 用缩小的块放大代替*/
+#define TILE_BG_COLOR	FB_COLOR(0x40,0x40,0x40)
+
+typedef struct {
+	int level, tx, ty;	/*level<0表示空*/
+	int pending;	/*正在后台读取*/
+	int failed;	/*读取失败, 不再重试*/
+	unsigned int stamp;	/*最近一次使用, 用于LRU*/
+	fb_image *image;
+} tile_entry;
+
+struct fb_tiled {
+	char dir[256];
+	int width, height, levels;
+	tile_entry tiles[TILE_CACHE_MAX];
+	unsigned int stamp;
+	int pending;
+	int closing;	/*已经关闭, 等后台读取都完成后释放*/
+	int last_level, last_x, last_y; /*上一次画的位置, 用于判断平移方向*/
+	Tiled_Func callback;
+	void *arg;
+};
+
+typedef struct {
+	fb_tiled *t;
+	int level, tx, ty;
+} tile_req;
+
+static void _tile_path(char *buf, int len, const char *dir, int level, int tx, int ty)
+{
+	snprintf(buf, len, "%s/%d_%d_%d.qoi", dir, level, tx, ty);
+}
+
+/*第level级的大小, 每级是上一级的一半(向上取整)*/
+static inline int _level_size(int size, int level)
+{
+	return (size + (1 << level) - 1) >> level;
+}
+
+/*------------------ build ------------------*/
+/*按行读原图, 不需要整幅图的内存*/
+typedef struct {
+	int is_png;
+	FILE *fp;
+	int width, height;
+	struct jpeg_decompress_struct cinfo;
+	struct {
+		struct jpeg_error_mgr pub;
+		jmp_buf jb;
+	} jerr;
+	png_structp png;
+	png_infop info;
+} row_source;
+
+static void _src_jpeg_error(j_common_ptr cinfo)
+{
+	row_source *src = (row_source *)cinfo->client_data;
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(src->jerr.jb, 1);
+}
+
+static int _src_open(row_source *src, char *file)
+{
+	unsigned char magic[2];
+
+	memset(src, 0, sizeof(*src));
+	src->fp = fopen(file, "rb");
+	if(src->fp == NULL) {
+		printf("fb_tiled_build: open %s error %d\n", file, errno);
+		return -1;
+	}
+	if(fread(magic, 1, 2, src->fp) != 2) magic[0] = 0;
+	rewind(src->fp);
+
+	if((magic[0] == 0xFF)&&(magic[1] == 0xD8)) {
+		src->cinfo.err = jpeg_std_error(&src->jerr.pub);
+		src->jerr.pub.error_exit = _src_jpeg_error;
+		src->cinfo.client_data = src;
+		jpeg_create_decompress(&src->cinfo);
+		if(setjmp(src->jerr.jb)) return -1;
+		jpeg_stdio_src(&src->cinfo, src->fp);
+		jpeg_read_header(&src->cinfo, TRUE);
+		src->cinfo.out_color_space = JCS_EXT_BGRX;
+		jpeg_start_decompress(&src->cinfo);
+		src->width = src->cinfo.output_width;
+		src->height = src->cinfo.output_height;
+		return 0;
+	}
+
+	if(magic[0] == 0x89) {
+		src->is_png = 1;
+		src->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if(src->png == NULL) return -1;
+		src->info = png_create_info_struct(src->png);
+		if(src->info == NULL) return -1;
+		if(setjmp(png_jmpbuf(src->png))) return -1;
+		png_init_io(src->png, src->fp);
+		png_read_info(src->png, src->info);
+		if(png_get_interlace_type(src->png, src->info) != PNG_INTERLACE_NONE) {
+			printf("fb_tiled_build: interlaced png is not supported\n");
+			return -1;
+		}
+		png_set_expand(src->png);
+		png_set_strip_16(src->png);
+		png_set_gray_to_rgb(src->png);
+		png_set_strip_alpha(src->png);
+		png_set_bgr(src->png);
+		png_set_filler(src->png, 0xff, PNG_FILLER_AFTER);
+		png_read_update_info(src->png, src->info);
+		src->width = png_get_image_width(src->png, src->info);
+		src->height = png_get_image_height(src->png, src->info);
+		return 0;
+	}
+
+	printf("fb_tiled_build: unknown format %s\n", file);
+	return -1;
+}
+
+/*读rows行到strip, 出错返回-1*/
+static int _src_read(row_source *src, fb_image *strip, int rows)
+{
+	JSAMPROW row;
+	int y;
+
+	if(src->is_png) {
+		if(setjmp(png_jmpbuf(src->png))) return -1;
+		for(y=0; y<rows; ++y)
+			png_read_row(src->png, (png_bytep)(strip->content + y*strip->line_byte), NULL);
+		return 0;
+	}
+	if(setjmp(src->jerr.jb)) return -1;
+	for(y=0; y<rows; )
+	{
+		row = (JSAMPROW)(strip->content + y*strip->line_byte);
+		y += jpeg_read_scanlines(&src->cinfo, &row, 1);
+	}
+	return 0;
+}
+
+static void _src_close(row_source *src)
+{
+	if(src->is_png) {
+		if(src->png) png_destroy_read_struct(&src->png, src->info ? &src->info : NULL, NULL);
+	} else if(src->cinfo.err) {
+		jpeg_destroy_decompress(&src->cinfo);
+	}
+	if(src->fp) fclose(src->fp);
+}
+
+/*第0级: 每次读TILE_SIZE行, 切成块*/
+static int _build_level0(row_source *src, const char *dir)
+{
+	char path[300];
+	fb_image *strip, *tile;
+	int tx, ty, rows, ret = 0;
+
+	strip = fb_new_image(FB_COLOR_RGB_8880, src->width, TILE_SIZE, 0);
+	if(strip == NULL) return -1;
+	for(ty=0; (ty*TILE_SIZE < src->height)&&(ret == 0); ++ty)
+	{
+		rows = src->height - ty*TILE_SIZE;
+		if(rows > TILE_SIZE) rows = TILE_SIZE;
+		if(_src_read(src, strip, rows) < 0) {
+			ret = -1;
+			break;
+		}
+		for(tx=0; tx*TILE_SIZE < src->width; ++tx)
+		{
+			int tw = src->width - tx*TILE_SIZE;
+			if(tw > TILE_SIZE) tw = TILE_SIZE;
+			tile = fb_get_sub_image(strip, tx*TILE_SIZE, 0, tw, rows);
+			_tile_path(path, sizeof(path), dir, 0, tx, ty);
+			if((tile == NULL)||(fb_write_qoi_image(tile, path) < 0)) ret = -1;
+			fb_free_image(tile);
+			if(ret < 0) break;
+		}
+	}
+	fb_free_image(strip);
+	return ret;
+}
+
+/*第level级的块由上一级的2x2块拼起来再按2x2平均缩小*/
+static int _build_level(const char *dir, int width, int height, int level)
+{
+	char path[300];
+	fb_image *quad, *child, *tile;
+	int pw = _level_size(width, level-1), ph = _level_size(height, level-1);
+	int lw = _level_size(width, level), lh = _level_size(height, level);
+	int tx, ty, dx, dy, x, y, qw, qh, ret = 0;
+
+	quad = fb_new_image(FB_COLOR_RGB_8880, TILE_SIZE*2, TILE_SIZE*2, 0);
+	if(quad == NULL) return -1;
+	for(ty=0; (ty*TILE_SIZE < lh)&&(ret == 0); ++ty)
+	for(tx=0; (tx*TILE_SIZE < lw)&&(ret == 0); ++tx)
+	{
+		int tw = lw - tx*TILE_SIZE, th = lh - ty*TILE_SIZE;
+		if(tw > TILE_SIZE) tw = TILE_SIZE;
+		if(th > TILE_SIZE) th = TILE_SIZE;
+		/*quad中有效的大小*/
+		qw = pw - tx*TILE_SIZE*2;
+		qh = ph - ty*TILE_SIZE*2;
+		if(qw > TILE_SIZE*2) qw = TILE_SIZE*2;
+		if(qh > TILE_SIZE*2) qh = TILE_SIZE*2;
+
+		for(dy=0; dy<2; ++dy)
+		for(dx=0; dx<2; ++dx)
+		{
+			if((dx*TILE_SIZE >= qw)||(dy*TILE_SIZE >= qh)) continue;
+			_tile_path(path, sizeof(path), dir, level-1, tx*2+dx, ty*2+dy);
+			child = fb_read_qoi_image(path);
+			if(child == NULL) {
+				ret = -1;
+				break;
+			}
+			for(y=0; y<child->pixel_h; ++y)
+				memcpy(quad->content + (dy*TILE_SIZE + y)*quad->line_byte + dx*TILE_SIZE*4,
+					child->content + y*child->line_byte, child->pixel_w*4);
+			fb_free_image(child);
+		}
+		if(ret < 0) break;
+
+		tile = fb_new_image(FB_COLOR_RGB_8880, tw, th, 0);
+		if(tile == NULL) {
+			ret = -1;
+			break;
+		}
+		for(y=0; y<th; ++y)
+		{
+			unsigned char *s0 = (unsigned char *)quad->content + (y*2)*quad->line_byte;
+			unsigned char *s1 = (y*2+1 < qh) ? s0 + quad->line_byte : s0;
+			unsigned char *d = (unsigned char *)tile->content + y*tile->line_byte;
+			for(x=0; x<tw; ++x, d+=4)
+			{
+				int a = x*8, b = (x*2+1 < qw) ? a+4 : a;
+				d[0] = (s0[a] + s0[b] + s1[a] + s1[b] + 2) >> 2;
+				d[1] = (s0[a+1] + s0[b+1] + s1[a+1] + s1[b+1] + 2) >> 2;
+				d[2] = (s0[a+2] + s0[b+2] + s1[a+2] + s1[b+2] + 2) >> 2;
+				d[3] = 0xff;
+			}
+		}
+		_tile_path(path, sizeof(path), dir, level, tx, ty);
+		if(fb_write_qoi_image(tile, path) < 0) ret = -1;
+		fb_free_image(tile);
+	}
+	fb_free_image(quad);
+	return ret;
+}
+
+int fb_tiled_build(char *image_file, char *tile_dir)
+{
+	char path[300];
+	row_source src;
+	int level, levels;
+	FILE *fp;
+
+	if((mkdir(tile_dir, 0755) < 0)&&(errno != EEXIST)) {
+		printf("fb_tiled_build: mkdir %s error %d\n", tile_dir, errno);
+		return -1;
+	}
+	if((_src_open(&src, image_file) < 0)||(_build_level0(&src, tile_dir) < 0)) {
+		_src_close(&src);
+		return -1;
+	}
+	_src_close(&src);
+
+	/*缩小到一块能放下为止*/
+	for(levels = 1; (_level_size(src.width, levels-1) > TILE_SIZE)||
+		(_level_size(src.height, levels-1) > TILE_SIZE); ++levels);
+	for(level = 1; level < levels; ++level)
+	{
+		if(_build_level(tile_dir, src.width, src.height, level) < 0) return -1;
+	}
+
+	/*info最后写, 没有它说明上次没有切完*/
+	snprintf(path, sizeof(path), "%s/info", tile_dir);
+	fp = fopen(path, "w");
+	if(fp == NULL) return -1;
+	fprintf(fp, "%d %d %d %d\n", src.width, src.height, TILE_SIZE, levels);
+	fclose(fp);
+	return 0;
+}
+
+/*------------------ tile cache ------------------*/
+static tile_entry * _tile_find(fb_tiled *t, int level, int tx, int ty)
+{
+	int i;
+	for(i=0; i<TILE_CACHE_MAX; ++i)
+	{
+		tile_entry *e = &t->tiles[i];
+		if((e->level == level)&&(e->tx == tx)&&(e->ty == ty)) return e;
+	}
+	return NULL;
+}
+
+/*空的或最久没用的(不在读取中的)位置*/
+static tile_entry * _tile_slot(fb_tiled *t)
+{
+	tile_entry *e, *lru = NULL;
+	int i;
+
+	for(i=0; i<TILE_CACHE_MAX; ++i)
+	{
+		e = &t->tiles[i];
+		if(e->level < 0) return e;
+		if(e->pending) continue;
+		if((lru == NULL)||((int)(e->stamp - lru->stamp) < 0)) lru = e;
+	}
+	if(lru != NULL) {
+		fb_free_image(lru->image);
+		lru->image = NULL;
+		lru->level = -1;
+	}
+	return lru;
+}
+
+static void _tile_loaded(fb_image *image, char *path, void *arg)
+{
+	tile_req *req = (tile_req *)arg;
+	fb_tiled *t = req->t;
+	tile_entry *e;
+
+	t->pending--;
+	if(t->closing) {
+		fb_free_image(image);
+		if(t->pending == 0) free(t);
+		free(req);
+		return;
+	}
+	e = _tile_find(t, req->level, req->tx, req->ty);
+	free(req);
+	if((e == NULL)||(e->pending == 0)) {
+		fb_free_image(image);
+		return;
+	}
+	e->pending = 0;
+	e->image = image;
+	if(image == NULL) e->failed = 1;
+	if(t->callback) t->callback(t, t->arg);
+}
+
+/*返回已经读到的块; 还没有就在后台读取, 返回NULL*/
+static fb_image * _tile_get(fb_tiled *t, int level, int tx, int ty)
+{
+	char path[300];
+	tile_entry *e;
+	tile_req *req;
+
+	e = _tile_find(t, level, tx, ty);
+	if(e != NULL) {
+		e->stamp = t->stamp;
+		return e->image;
+	}
+	if(t->pending >= TILE_PENDING_MAX) return NULL;
+	e = _tile_slot(t);
+	req = (tile_req *)malloc(sizeof(tile_req));
+	if((e == NULL)||(req == NULL)) {
+		free(req);
+		return NULL;
+	}
+	req->t = t;
+	req->level = level;
+	req->tx = tx;
+	req->ty = ty;
+	_tile_path(path, sizeof(path), t->dir, level, tx, ty);
+	if(fb_load_image_async(path, NULL, _tile_loaded, req) < 0) {
+		free(req);
+		return NULL;
+	}
+	e->level = level;
+	e->tx = tx;
+	e->ty = ty;
+	e->pending = 1;
+	e->failed = 0;
+	e->stamp = t->stamp;
+	t->pending++;
+	return NULL;
+}
+
+/*------------------ public ------------------*/
+fb_tiled * fb_tiled_open(char *image_file, char *tile_dir, Tiled_Func callback, void *arg)
+{
+	char path[300];
+	int w, h, size, levels, i;
+	fb_tiled *t;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/info", tile_dir);
+	for(i=0; i<2; ++i)
+	{
+		fp = fopen(path, "r");
+		if(fp != NULL) {
+			if(fscanf(fp, "%d %d %d %d", &w, &h, &size, &levels) != 4) size = 0;
+			fclose(fp);
+			if((size == TILE_SIZE)&&(w > 0)&&(h > 0)&&(levels > 0)) break;
+		}
+		/*没有切过或者块的大小不同, 重新切*/
+		if((i > 0)||(image_file == NULL)||(fb_tiled_build(image_file, tile_dir) < 0)) {
+			printf("fb_tiled_open: no tiles in %s\n", tile_dir);
+			return NULL;
+		}
+	}
+
+	t = (fb_tiled *)calloc(1, sizeof(fb_tiled));
+	if(t == NULL) return NULL;
+	snprintf(t->dir, sizeof(t->dir), "%s", tile_dir);
+	t->width = w;
+	t->height = h;
+	t->levels = levels;
+	t->last_level = -1;
+	t->callback = callback;
+	t->arg = arg;
+	for(i=0; i<TILE_CACHE_MAX; ++i) t->tiles[i].level = -1;
+	return t;
+}
+
+void fb_tiled_close(fb_tiled *t)
+{
+	int i;
+
+	if(t == NULL) return;
+	for(i=0; i<TILE_CACHE_MAX; ++i)
+	{
+		fb_free_image(t->tiles[i].image);
+		t->tiles[i].image = NULL;
+	}
+	if(t->pending > 0) t->closing = 1; /*等后台读取完成后在回调中释放*/
+	else free(t);
+}
+
+void fb_tiled_get_size(fb_tiled *t, int *w, int *h)
+{
+	if(w) *w = t ? t->width : 0;
+	if(h) *h = t ? t->height : 0;
+}
+
+/*块的屏幕矩形, 相邻的块共享边界, 不会有缝*/
+static inline int _to_screen(int v, float origin, float ls)
+{
+	return (int)floorf((v - origin)*ls + 0.5f);
+}
+
+int fb_tiled_draw(fb_tiled *t, int x, int y, int w, int h, int ix, int iy, float scale)
+{
+	int level, lw, lh, tx, ty, tx1, ty1, tx2, ty2, k, missing = 0;
+	float lx, ly, ls;
+
+	if((t == NULL)||(w <= 0)||(h <= 0)||(scale <= 0)) return -1;
+
+	/*每个块的像素缩小到屏幕上最多缩小一半*/
+	for(level = 0; (level+1 < t->levels)&&(scale*(2 << level) <= 1.0f); ++level);
+	ls = scale * (1 << level);
+	lw = _level_size(t->width, level);
+	lh = _level_size(t->height, level);
+	lx = ix / (float)(1 << level);
+	ly = iy / (float)(1 << level);
+
+	tx1 = (int)floorf(lx / TILE_SIZE);
+	ty1 = (int)floorf(ly / TILE_SIZE);
+	tx2 = (int)floorf((lx + w/ls) / TILE_SIZE);
+	ty2 = (int)floorf((ly + h/ls) / TILE_SIZE);
+	if(tx1 < 0) tx1 = 0;
+	if(ty1 < 0) ty1 = 0;
+	if(tx2 > (lw-1)/TILE_SIZE) tx2 = (lw-1)/TILE_SIZE;
+	if(ty2 > (lh-1)/TILE_SIZE) ty2 = (lh-1)/TILE_SIZE;
+
+	/*图片外面的部分*/
+	fb_draw_rect(x, y, w, h, TILE_BG_COLOR);
+
+	t->stamp++;
+	for(ty = ty1; ty <= ty2; ++ty)
+	for(tx = tx1; tx <= tx2; ++tx)
+	{
+		int tw = lw - tx*TILE_SIZE, th = lh - ty*TILE_SIZE;
+		int x1, y1, x2, y2;
+		fb_image *img;
+
+		if(tw > TILE_SIZE) tw = TILE_SIZE;
+		if(th > TILE_SIZE) th = TILE_SIZE;
+		x1 = x + _to_screen(tx*TILE_SIZE, lx, ls);
+		y1 = y + _to_screen(ty*TILE_SIZE, ly, ls);
+		x2 = x + _to_screen(tx*TILE_SIZE + tw, lx, ls);
+		y2 = y + _to_screen(ty*TILE_SIZE + th, ly, ls);
+		if((x2 <= x1)||(y2 <= y1)) continue;
+
+		img = _tile_get(t, level, tx, ty);
+		if(img != NULL) {
+			fb_draw_image_scaled_clip(x1, y1, x2-x1, y2-y1, img, 0, 0, tw, th, x, y, w, h);
+			continue;
+		}
+		missing++;
+
+		/*先用更小一级的块放大顶替*/
+		for(k = 1; (k <= TILE_FALLBACK)&&(level+k < t->levels); ++k)
+		{
+			tile_entry *e = _tile_find(t, level+k, tx >> k, ty >> k);
+			int sx, sy, sw, sh;
+			if((e == NULL)||(e->image == NULL)) continue;
+			e->stamp = t->stamp;
+			sx = ((tx*TILE_SIZE) >> k) - (tx >> k)*TILE_SIZE;
+			sy = ((ty*TILE_SIZE) >> k) - (ty >> k)*TILE_SIZE;
+			sw = (tw + (1 << k) - 1) >> k;
+			sh = (th + (1 << k) - 1) >> k;
+			if(sx + sw > e->image->pixel_w) sw = e->image->pixel_w - sx;
+			if(sy + sh > e->image->pixel_h) sh = e->image->pixel_h - sy;
+			fb_draw_image_scaled_clip(x1, y1, x2-x1, y2-y1, e->image, sx, sy, sw, sh, x, y, w, h);
+			break;
+		}
+	}
+
+	/*沿平移方向预取视口外的一圈块*/
+	if(level == t->last_level) {
+		int px = -1, py = -1;
+		if(ix > t->last_x) px = tx2 + 1;
+		else if(ix < t->last_x) px = tx1 - 1;
+		if(iy > t->last_y) py = ty2 + 1;
+		else if(iy < t->last_y) py = ty1 - 1;
+		if((px >= 0)&&(px*TILE_SIZE < lw)) {
+			for(ty = ty1; ty <= ty2; ++ty) _tile_get(t, level, px, ty);
+		}
+		if((py >= 0)&&(py*TILE_SIZE < lh)) {
+			for(tx = tx1; tx <= tx2; ++tx) _tile_get(t, level, tx, py);
+		}
+	}
+	/*最小一级只有一块, 总是留着做顶替*/
+	_tile_get(t, t->levels-1, 0, 0);
+
+	t->last_level = level;
+	t->last_x = ix;
+	t->last_y = iy;
+	return missing;
+}
@@ -52,8 +52,11 @@ static void draw_button(void){
 	   可选：font_init("/path/to/your.ttf");
 	   fb_draw_text(btn_x + 20, btn_y + 40, "Clear", 32, btn_text_color);
 	*/
-	/* 实际绘制按钮文字：Clear（已在 main 中初始化字体文件 font.ttc） */
-	fb_draw_text(btn_x + 20, btn_y + BTN_H - 20, "Clear", 32, btn_text_color);
+	/* 实际绘制按钮文字：Clear（已在 main 中初始化字体文件 font.ttc），按测量结果居中 */
+	fb_text_metrics m;
+	fb_measure_text("Clear", 32, &m);
+	fb_draw_label(btn_x + (BTN_W - m.width)/2,
+		btn_y + (BTN_H + m.ascent - m.descent)/2, "Clear", 32, btn_text_color);
 }
 
 /* 画一个方形画笔点，中心在 (cx,cy) */
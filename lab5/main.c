@@ -58,8 +58,10 @@ static void bluetooth_tty_event_cb(int fd)
 
 	buf[n] = '\0';
 	printf("bluetooth tty receive \"%s\"\n", buf);
-	fb_draw_text(2, pen_y, buf, 24, COLOR_TEXT); fb_update();
-	pen_y += 30;
+	/*超过TIME_X的部分自动折行*/
+	const fb_text_layout *lo = fb_layout_text(buf, 24, TIME_X-4);
+	fb_draw_layout(2, pen_y, lo, COLOR_TEXT); fb_update();
+	pen_y += lo ? lo->line_num*lo->line_height : 30;
 	return;
 }
 
@@ -76,11 +78,9 @@ static int bluetooth_tty_init(const char *dev)
 static int st=0;
 static void timer_cb(int period) /*该函数0.5秒执行一次*/
 {
-	char buf[100];
-	sprintf(buf, "%d", st++);
 	fb_draw_rect(TIME_X, TIME_Y, TIME_W, TIME_H, COLOR_BACKGROUND);
 	fb_draw_border(TIME_X, TIME_Y, TIME_W, TIME_H, COLOR_TEXT);
-	fb_draw_text(TIME_X+2, TIME_Y+20, buf, 24, COLOR_TEXT);
+	fb_draw_number(TIME_X+2, TIME_Y+20, st++, 24, COLOR_TEXT);
 	fb_update();
 	return;
 }
@@ -91,7 +91,7 @@ int main(int argc, char *argv[])
 	font_init("./font.ttc");
 	fb_draw_rect(0,0,SCREEN_WIDTH,SCREEN_HEIGHT,COLOR_BACKGROUND);
 	fb_draw_border(SEND_X, SEND_Y, SEND_W, SEND_H, COLOR_TEXT);
-	fb_draw_text(SEND_X+2, SEND_Y+30, "send", 24, COLOR_TEXT);
+	fb_draw_label(SEND_X+2, SEND_Y+30, "send", 24, COLOR_TEXT);
 	fb_update();
 
 	touch_fd = touch_init("/dev/input/event0");
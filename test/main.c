@@ -137,6 +137,17 @@ int main(int argc, char *argv[])
 	fb_free_image(img2);
 	fb_free_image(img3);
 
+	/*图片缓存: 写缓存返回的图片以后, 下一次拿到的不能跟着变*/
+	img1 = fb_cache_get_image("./test.jpg", 0, 0, 0);
+	if((img1 != NULL) && (fb_image_writable(img1) == 0)) {
+		int first = *(int *)img1->content;
+		*(int *)img1->content = ~first;
+		img2 = fb_cache_get_image("./test.jpg", 0, 0, 0);
+		printf("    **cache cow:\t%s\n", ((img2 != NULL) && (*(int *)img2->content == first)) ? "ok" : "FAILED");
+		fb_cache_put_image(img2);
+	}
+	fb_cache_put_image(img1);
+
 	sleep(1);
 	fb_draw_rect(0,0,SCREEN_WIDTH,SCREEN_HEIGHT,WHITE);
 	start = task_get_time();
@@ -157,7 +168,7 @@ int main(int argc, char *argv[])
 //print result
 	sleep(1);
 	fb_draw_rect(0,0,SCREEN_WIDTH,SCREEN_HEIGHT,WHITE);
-	fb_draw_text(55,35,"嵌入式系统实验--测试",40,BLACK);
+	fb_draw_label(55,35,"嵌入式系统实验--测试",40,BLACK);
 	for(row=50,i=0; i<8; i++){
 		fb_draw_rect(50,row,524,5,BLACK);
 		row += 52;
@@ -166,15 +177,15 @@ int main(int argc, char *argv[])
 		fb_draw_rect(column,50,5,364,BLACK);
 		column += 260;
 	}
-	fb_draw_text(155,90,"操作",30,RED);
-	fb_draw_text(370,90,"时间（ms）",30,CYAN);
-	fb_draw_text(135,142,"点pixel",30,RED);
-	fb_draw_text(135,194,"矩形rect",30,RED);
-	fb_draw_text(135,246,"线line",30,RED);
-	fb_draw_text(135,298,"图像image",30,RED);
-	fb_draw_text(135,350,"文本text",30,RED);
-	fb_draw_text(135,402,"合计total",30,ORANGE);
-	fb_draw_text(260,454,"华中科技大学",30,PURPLE);
+	fb_draw_label(155,90,"操作",30,RED);
+	fb_draw_label(370,90,"时间（ms）",30,CYAN);
+	fb_draw_label(135,142,"点pixel",30,RED);
+	fb_draw_label(135,194,"矩形rect",30,RED);
+	fb_draw_label(135,246,"线line",30,RED);
+	fb_draw_label(135,298,"图像image",30,RED);
+	fb_draw_label(135,350,"文本text",30,RED);
+	fb_draw_label(135,402,"合计total",30,ORANGE);
+	fb_draw_label(260,454,"华中科技大学",30,PURPLE);
 	
 	char str[5];
 	for(i=0; i<5; i++){
@@ -0,0 +1,149 @@
+/*把一个目录里的图片打包成一张图集, 在主机上运行:
+ *	atlaspack [-w width] [-p] icons_dir out
+ *生成out.fbi(图集, RGBA_8888; -p则预乘alpha)和out.idx(每行"名字 x y w h"),
+ *名字是去掉扩展名的文件名, 运行时用fb_atlas_load("out.fbi", "out.idx")读取*/
+#include "common.h"
+#include <dirent.h>
+
+#define ICON_NUM_MAX	1024
+#define ATLAS_PAD	1 /*图标之间留空, 避免以后缩放时颜色渗到旁边*/
+
+typedef struct {
+	char name[128];
+	fb_image *img;
+	int x, y;
+} icon;
+
+static icon icons[ICON_NUM_MAX];
+static int icon_num = 0;
+
+static int _cmp_height(const void *a, const void *b)
+{
+	const icon *ia = (const icon *)a, *ib = (const icon *)b;
+	if(ia->img->pixel_h != ib->img->pixel_h) return ib->img->pixel_h - ia->img->pixel_h;
+	return strcmp(ia->name, ib->name);
+}
+
+/*按高度从高到低一行行摆放, 返回图集高度*/
+static int _pack(int width)
+{
+	int i, x = 0, y = 0, shelf_h = 0;
+
+	qsort(icons, icon_num, sizeof(icon), _cmp_height);
+	for(i=0; i<icon_num; ++i)
+	{
+		fb_image *img = icons[i].img;
+		if(img->pixel_w > width) {
+			printf("%s is wider than the atlas\n", icons[i].name);
+			return -1;
+		}
+		if(x + img->pixel_w > width) {
+			x = 0;
+			y += shelf_h + ATLAS_PAD;
+			shelf_h = 0;
+		}
+		icons[i].x = x;
+		icons[i].y = y;
+		x += img->pixel_w + ATLAS_PAD;
+		if(shelf_h < img->pixel_h) shelf_h = img->pixel_h;
+	}
+	return y + shelf_h;
+}
+
+static void _copy_icon(fb_image *atlas, icon *ic, int premul)
+{
+	fb_image *img = ic->img;
+	int x, y;
+
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *s = (unsigned char *)img->content + y*img->line_byte;
+		unsigned char *d = (unsigned char *)atlas->content + (ic->y + y)*atlas->line_byte + ic->x*4;
+		for(x=0; x<img->pixel_w; ++x, s+=4, d+=4)
+		{
+			int a = (img->color_type == FB_COLOR_RGBA_8888) ? s[3] : 255;
+			if(premul) {
+				d[0] = (s[0]*a + 127) / 255;
+				d[1] = (s[1]*a + 127) / 255;
+				d[2] = (s[2]*a + 127) / 255;
+			} else {
+				d[0] = s[0]; d[1] = s[1]; d[2] = s[2];
+			}
+			d[3] = a;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int width = 1024, premul = 0, height, i;
+	char path[1024], *dot;
+	struct dirent *de;
+	fb_image *atlas;
+	FILE *fp;
+	DIR *dir;
+
+	for(i=1; (i<argc)&&(argv[i][0] == '-'); ++i)
+	{
+		if((strcmp(argv[i], "-w") == 0)&&(i+1 < argc)) width = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-p") == 0) premul = 1;
+		else break;
+	}
+	if((argc - i != 2)||(width <= 0)) {
+		printf("usage: %s [-w width] [-p] icons_dir out\n", argv[0]);
+		return 1;
+	}
+
+	dir = opendir(argv[i]);
+	if(dir == NULL) {
+		printf("can't open %s\n", argv[i]);
+		return 1;
+	}
+	while((de = readdir(dir)) != NULL)
+	{
+		if(de->d_name[0] == '.') continue;
+		if(icon_num == ICON_NUM_MAX) {
+			printf("too many images, max %d\n", ICON_NUM_MAX);
+			break;
+		}
+		if(strlen(de->d_name) >= sizeof(icons[0].name)) continue;
+		snprintf(path, sizeof(path), "%s/%s", argv[i], de->d_name);
+		icons[icon_num].img = fb_read_image(path);
+		if(icons[icon_num].img == NULL) continue;
+		if(icons[icon_num].img->color_type == FB_COLOR_ALPHA_8) {
+			fb_free_image(icons[icon_num].img);
+			continue;
+		}
+		strcpy(icons[icon_num].name, de->d_name);
+		dot = strrchr(icons[icon_num].name, '.');
+		if(dot) *dot = '\0';
+		icon_num++;
+	}
+	closedir(dir);
+	if(icon_num == 0) {
+		printf("no images in %s\n", argv[i]);
+		return 1;
+	}
+
+	height = _pack(width);
+	if(height < 0) return 1;
+	atlas = fb_new_image(premul ? FB_COLOR_RGBA_PREMUL : FB_COLOR_RGBA_8888, width, height, 0);
+	if(atlas == NULL) return 1;
+	memset(atlas->content, 0, atlas->line_byte * height);
+	for(i=0; i<icon_num; ++i) _copy_icon(atlas, &icons[i], premul);
+
+	snprintf(path, sizeof(path), "%s.fbi", argv[argc-1]);
+	if(fb_write_native_image(atlas, path) < 0) return 1;
+	snprintf(path, sizeof(path), "%s.idx", argv[argc-1]);
+	fp = fopen(path, "w");
+	if(fp == NULL) {
+		printf("can't create %s\n", path);
+		return 1;
+	}
+	for(i=0; i<icon_num; ++i)
+		fprintf(fp, "%s %d %d %d %d\n", icons[i].name, icons[i].x, icons[i].y,
+			icons[i].img->pixel_w, icons[i].img->pixel_h);
+	fclose(fp);
+	printf("%s.fbi: %d images, %dx%d\n", argv[argc-1], icon_num, width, height);
+	return 0;
+}
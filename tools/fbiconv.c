@@ -0,0 +1,101 @@
+/*把PNG/JPEG图片转换成.fbi本地图片文件, 在主机上运行:
+ *	fbiconv [-p] [-a] [-i] input.png output.fbi
+ *-p: 有透明度的图片预先乘alpha(FB_COLOR_RGBA_PREMUL), 画图时少一次乘法
+ *-a: 只保留alpha通道(FB_COLOR_ALPHA_8), 用于图标等单色图片
+ *-i: 调色板PNG保留调色板(FB_COLOR_INDEX_8), 内存只要1/4; 其他图片不受影响
+ *没有透明像素的PNG存成FB_COLOR_RGB_8880, 画图时直接memcpy*/
+#include "common.h"
+
+static int _opaque(fb_image *img)
+{
+	int x, y;
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *s = (unsigned char *)img->content + y*img->line_byte;
+		for(x=0; x<img->pixel_w; ++x)
+			if(s[x*4+3] != 255) return 0;
+	}
+	return 1;
+}
+
+static int _is_png(char *file)
+{
+	unsigned char sig[4] = {0};
+	FILE *fp = fopen(file, "rb");
+	if(fp == NULL) return 0;
+	if(fread(sig, 1, 4, fp) != 4) sig[0] = 0;
+	fclose(fp);
+	return (sig[0] == 0x89)&&(sig[1] == 'P')&&(sig[2] == 'N')&&(sig[3] == 'G');
+}
+
+/*把解码得到的BGRA图片转换成color_type*/
+static fb_image * _convert(fb_image *img, int color_type)
+{
+	fb_image *out;
+	int x, y;
+
+	out = fb_new_image(color_type, img->pixel_w, img->pixel_h, 0);
+	if(out == NULL) return NULL;
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *s = (unsigned char *)img->content + y*img->line_byte;
+		unsigned char *d = (unsigned char *)out->content + y*out->line_byte;
+		for(x=0; x<img->pixel_w; ++x, s+=4)
+		{
+			if(color_type == FB_COLOR_ALPHA_8) {
+				d[x] = (img->color_type == FB_COLOR_RGBA_8888) ? s[3] : s[1];
+			} else if(color_type == FB_COLOR_RGBA_PREMUL) {
+				d[x*4+0] = (s[0]*s[3] + 127) / 255;
+				d[x*4+1] = (s[1]*s[3] + 127) / 255;
+				d[x*4+2] = (s[2]*s[3] + 127) / 255;
+				d[x*4+3] = s[3];
+			} else {
+				memcpy(d + x*4, s, 4);
+				if(color_type == FB_COLOR_RGB_8880) d[x*4+3] = 0xFF;
+			}
+		}
+	}
+	return out;
+}
+
+int main(int argc, char *argv[])
+{
+	int premul = 0, alpha = 0, index = 0, color_type, ret = -1;
+	fb_image *img, *out;
+	int i;
+
+	for(i=1; (i<argc)&&(argv[i][0] == '-'); ++i)
+	{
+		if(strcmp(argv[i], "-p") == 0) premul = 1;
+		else if(strcmp(argv[i], "-a") == 0) alpha = 1;
+		else if(strcmp(argv[i], "-i") == 0) index = 1;
+		else break;
+	}
+	if(argc - i != 2) {
+		printf("usage: %s [-p] [-a] [-i] input.png|input.jpg output.fbi\n", argv[0]);
+		return 1;
+	}
+
+	img = NULL;
+	if(index && !alpha && _is_png(argv[i])) img = fb_read_png_image_ex(argv[i], FB_PNG_INDEX);
+	if((img == NULL)||(img->color_type != FB_COLOR_INDEX_8)) {
+		fb_free_image(img);
+		img = fb_read_image(argv[i]);
+	}
+	if(img == NULL) {
+		printf("can't read %s\n", argv[i]);
+		return 1;
+	}
+
+	if(img->color_type == FB_COLOR_INDEX_8) color_type = FB_COLOR_INDEX_8;
+	else if(alpha) color_type = FB_COLOR_ALPHA_8;
+	else if((img->color_type == FB_COLOR_RGB_8880)||_opaque(img)) color_type = FB_COLOR_RGB_8880;
+	else color_type = premul ? FB_COLOR_RGBA_PREMUL : FB_COLOR_RGBA_8888;
+
+	out = (color_type == FB_COLOR_INDEX_8) ? fb_retain_image(img) : _convert(img, color_type);
+	if(out != NULL) ret = fb_write_native_image(out, argv[i+1]);
+	fb_free_image(out);
+	if(ret == 0) printf("%s: %dx%d type %d\n", argv[i+1], img->pixel_w, img->pixel_h, color_type);
+	fb_free_image(img);
+	return (ret == 0) ? 0 : 1;
+}
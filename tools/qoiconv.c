@@ -0,0 +1,40 @@
+/*把PNG/JPEG图片编码成QOI格式, 在主机上运行:
+ *	qoiconv input.png output.qoi
+ *没有透明像素的图片存成3通道, 解码得到FB_COLOR_RGB_8880*/
+#include "common.h"
+
+static int _opaque(fb_image *img)
+{
+	int x, y;
+	if(img->color_type == FB_COLOR_RGB_8880) return 1;
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *s = (unsigned char *)img->content + y*img->line_byte;
+		for(x=0; x<img->pixel_w; ++x)
+			if(s[x*4+3] != 255) return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	fb_image *img;
+	int ret;
+
+	if(argc != 3) {
+		printf("usage: %s input.png|input.jpg output.qoi\n", argv[0]);
+		return 1;
+	}
+	img = fb_read_image(argv[1]);
+	if(img == NULL) {
+		printf("can't read %s\n", argv[1]);
+		return 1;
+	}
+
+	if(_opaque(img)) img->color_type = FB_COLOR_RGB_8880; /*alpha都是255, 存3通道*/
+	ret = fb_write_qoi_image(img, argv[2]);
+	if(ret == 0) printf("%s: %dx%d %d channels\n", argv[2], img->pixel_w, img->pixel_h,
+		(img->color_type == FB_COLOR_RGB_8880) ? 3 : 4);
+	fb_free_image(img);
+	return (ret == 0) ? 0 : 1;
+}